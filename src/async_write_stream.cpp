@@ -0,0 +1,540 @@
+﻿#include "async_write_stream.h"
+#include "dstorage_stream.h"
+#include "internal.h"
+
+#include <vector>
+#include <algorithm>
+
+
+namespace ist {
+
+// Windows implementation of AsyncFileWriter. see async_write_stream_posix.cpp for other platforms.
+// AsyncWriteStreamBuf and AsyncWriteStream are built on top of AsyncFileWriter and shared by all platforms.
+#ifdef _WIN32
+#pragma region AsyncFileWriter
+
+struct AsyncFileWriter::PImpl
+{
+    struct Slot
+    {
+        OVERLAPPED ov{};
+        ScopedHandle event; // manual reset. signaled when the write completes
+        DWORD size = 0;
+        bool pending = false;
+    };
+
+    ScopedHandle file_;
+    std::vector<Slot> slots_;
+    bool unbuffered_ = false;
+    bool failed_ = false;
+
+    ~PImpl()
+    {
+        // OVERLAPPED must outlive the writes
+        for (auto& s : slots_) {
+            wait(s);
+        }
+    }
+
+    bool wait(Slot& s)
+    {
+        if (s.pending) {
+            DS_PROFILE_SCOPE("AsyncFileWriter::wait()");
+            DWORD written = 0;
+            BOOL ok = ::GetOverlappedResult(file_.get(), &s.ov, &written, TRUE);
+            s.pending = false;
+            if (!ok || written != s.size) {
+                failed_ = true;
+            }
+        }
+        return !failed_;
+    }
+};
+
+bool AsyncFileWriter::open(const char* path, size_t slot_count)
+{
+    pimpl_ = {};
+    auto m = std::make_shared<PImpl>();
+
+    const DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED;
+    m->file_ = ScopedHandle(::CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, flags | FILE_FLAG_NO_BUFFERING, NULL));
+    m->unbuffered_ = m->file_;
+    if (!m->file_) {
+        // the file system may not support unbuffered I/O (e.g. some network drives)
+        m->file_ = ScopedHandle(::CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, flags, NULL));
+    }
+    if (!m->file_) {
+        return false;
+    }
+
+    m->slots_.resize(std::max(slot_count, size_t(1)));
+    for (auto& s : m->slots_) {
+        HANDLE ev = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (!ev) {
+            return false;
+        }
+        s.event.reset(ev);
+    }
+    pimpl_ = std::move(m);
+    return true;
+}
+
+bool AsyncFileWriter::write(size_t slot, const void* data, size_t size, uint64_t offset)
+{
+    auto& m = *pimpl_;
+    if (slot >= m.slots_.size() || !m.wait(m.slots_[slot])) {
+        return false;
+    }
+
+    auto& s = m.slots_[slot];
+    s.ov = {};
+    s.ov.Offset = DWORD(offset);
+    s.ov.OffsetHigh = DWORD(offset >> 32);
+    s.ov.hEvent = s.event.get();
+    s.size = DWORD(size);
+    if (!::WriteFile(m.file_.get(), data, s.size, NULL, &s.ov) && ::GetLastError() != ERROR_IO_PENDING) {
+        m.failed_ = true;
+        return false;
+    }
+    // completed synchronously or not, the event is signaled and GetOverlappedResult() works
+    s.pending = true;
+    return true;
+}
+
+bool AsyncFileWriter::wait(size_t slot)
+{
+    auto& m = *pimpl_;
+    return slot < m.slots_.size() && m.wait(m.slots_[slot]);
+}
+
+bool AsyncFileWriter::wait_all()
+{
+    auto& m = *pimpl_;
+    for (auto& s : m.slots_) {
+        m.wait(s);
+    }
+    return !m.failed_;
+}
+
+bool AsyncFileWriter::truncate(uint64_t file_size)
+{
+    // SetFilePointer() + SetEndOfFile() would work too, but the file pointer is meaningless for overlapped handles
+    FILE_END_OF_FILE_INFO info{};
+    info.EndOfFile.QuadPart = (LONGLONG)file_size;
+    return ::SetFileInformationByHandle(pimpl_->file_.get(), FileEndOfFileInfo, &info, sizeof(info)) != FALSE;
+}
+
+bool AsyncFileWriter::is_open() const
+{
+    return pimpl_ && pimpl_->file_;
+}
+
+bool AsyncFileWriter::is_unbuffered() const
+{
+    return pimpl_ && pimpl_->unbuffered_;
+}
+
+#pragma endregion AsyncFileWriter
+#endif // _WIN32
+
+
+#pragma region AsyncFileWriter common
+
+AsyncFileWriter::AsyncFileWriter()
+{
+}
+
+AsyncFileWriter::AsyncFileWriter(AsyncFileWriter&& v) noexcept
+{
+    swap(v);
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+    // data of pending writes may be released right after this
+    if (is_open()) {
+        wait_all();
+    }
+}
+
+AsyncFileWriter& AsyncFileWriter::operator=(AsyncFileWriter&& v) noexcept
+{
+    swap(v);
+    return *this;
+}
+
+void AsyncFileWriter::swap(AsyncFileWriter& v)
+{
+    std::swap(pimpl_, v.pimpl_);
+}
+
+bool AsyncFileWriter::close(uint64_t file_size)
+{
+    if (!is_open()) {
+        return false;
+    }
+    bool ok = wait_all();
+    ok = truncate(file_size) && ok;
+    pimpl_ = {};
+    return ok;
+}
+
+#pragma endregion AsyncFileWriter common
+
+
+#pragma region AsyncWriteStreamBuf
+
+static size_t g_write_buffer_size = 1024 * 1024 * 8;
+static size_t g_write_buffer_count = 4;
+
+static constexpr uint64_t AlignSector(uint64_t v)
+{
+    return (v + AsyncFileWriter::sector_size - 1) & ~uint64_t(AsyncFileWriter::sector_size - 1);
+}
+
+void AsyncWriteStreamBuf::set_buffer_size(size_t size)
+{
+    // pbump() takes int
+    g_write_buffer_size = std::clamp<size_t>(AlignSector(size), AsyncFileWriter::sector_size, 1024 * 1024 * 1024);
+}
+
+size_t AsyncWriteStreamBuf::get_buffer_size()
+{
+    return g_write_buffer_size;
+}
+
+void AsyncWriteStreamBuf::set_buffer_count(size_t count)
+{
+    g_write_buffer_count = std::max(count, size_t(2));
+}
+
+size_t AsyncWriteStreamBuf::get_buffer_count()
+{
+    return g_write_buffer_count;
+}
+
+AsyncWriteStreamBuf::AsyncWriteStreamBuf()
+{
+}
+
+AsyncWriteStreamBuf::AsyncWriteStreamBuf(AsyncWriteStreamBuf&& v) noexcept
+{
+    swap(v);
+}
+
+AsyncWriteStreamBuf::~AsyncWriteStreamBuf()
+{
+    close();
+}
+
+AsyncWriteStreamBuf& AsyncWriteStreamBuf::operator=(AsyncWriteStreamBuf&& v) noexcept
+{
+    swap(v);
+    return *this;
+}
+
+void AsyncWriteStreamBuf::swap(AsyncWriteStreamBuf& v)
+{
+    super::swap(v);
+    file_.swap(v.file_);
+    buffers_.swap(v.buffers_);
+    std::swap(mode_, v.mode_);
+    std::swap(buffer_size_, v.buffer_size_);
+    std::swap(current_, v.current_);
+    std::swap(buffer_pos_, v.buffer_pos_);
+    std::swap(reserved_, v.reserved_);
+    std::swap(failed_, v.failed_);
+}
+
+bool AsyncWriteStreamBuf::open(const char* path, std::ios::openmode mode)
+{
+    DS_PROFILE_SCOPE("AsyncWriteStreamBuf::open()");
+
+    close();
+    if (!(mode & std::ios::out) || !file_.open(path, g_write_buffer_count)) {
+        return false;
+    }
+
+    mode_ = mode;
+    buffer_size_ = g_write_buffer_size;
+    // buffers other than the first one are allocated when they are needed. small files don't pay for them.
+    buffers_.resize(g_write_buffer_count);
+    buffers_[0] = CreateBuffer(buffer_size_, false, true, mode & large_pages);
+    if (!buffers_[0]) {
+        file_.close(0);
+        reset();
+        return false;
+    }
+    this->setp(buffers_[0].get(), buffers_[0].get() + buffer_size_);
+    return true;
+}
+
+bool AsyncWriteStreamBuf::open(const std::string& path, std::ios::openmode mode)
+{
+    return open(path.c_str(), mode);
+}
+
+bool AsyncWriteStreamBuf::close()
+{
+    if (!file_.is_open()) {
+        return false;
+    }
+
+    DS_PROFILE_SCOPE("AsyncWriteStreamBuf::close()");
+    bool ok = sync() == 0;
+    ok = file_.close(size()) && ok;
+    reset();
+    return ok;
+}
+
+void AsyncWriteStreamBuf::reset()
+{
+    this->setp(nullptr, nullptr);
+    buffers_.clear();
+    mode_ = {};
+    buffer_size_ = 0;
+    current_ = 0;
+    buffer_pos_ = 0;
+    reserved_ = 0;
+    failed_ = false;
+}
+
+bool AsyncWriteStreamBuf::is_open() const
+{
+    return file_.is_open();
+}
+
+AsyncWriteStreamBuf::pos_type AsyncWriteStreamBuf::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode /*mode*/)
+{
+    if (is_open()) {
+        // no-op seeks. tellp() and seekp(tellp())
+        uint64_t pos = size();
+        if ((dir == std::ios::cur && off == 0) || ((dir == std::ios::beg || dir == std::ios::end) && uint64_t(off) == pos)) {
+            return pos_type(off_type(pos));
+        }
+    }
+    return pos_type(-1);
+}
+
+AsyncWriteStreamBuf::pos_type AsyncWriteStreamBuf::seekpos(pos_type pos, std::ios::openmode mode)
+{
+    return seekoff(pos, std::ios::beg, mode);
+}
+
+bool AsyncWriteStreamBuf::submit()
+{
+    if (!file_.is_open() || failed_) {
+        return false;
+    }
+
+    DS_PROFILE_SCOPE("AsyncWriteStreamBuf::submit()");
+    // full buffers only. sizes are multiples of the sector size.
+    char* head = this->pbase();
+    size_t n = size_t(this->pptr() - head);
+    if (!file_.write(current_, head, n, buffer_pos_)) {
+        failed_ = true;
+        return false;
+    }
+    buffer_pos_ += n;
+
+    // the next buffer is free once its last write is done
+    current_ = (current_ + 1) % buffers_.size();
+    auto& next = buffers_[current_];
+    if (next) {
+        if (!file_.wait(current_)) {
+            failed_ = true;
+            return false;
+        }
+    }
+    else {
+        next = CreateBuffer(buffer_size_, false, true, mode_ & large_pages);
+        if (!next) {
+            failed_ = true;
+            return false;
+        }
+    }
+    this->setp(next.get(), next.get() + buffer_size_);
+    return true;
+}
+
+int AsyncWriteStreamBuf::overflow(int c)
+{
+    if (this->pptr() == this->epptr() && !submit()) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *this->pptr() = traits_type::to_char_type(c);
+        this->pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize AsyncWriteStreamBuf::xsputn(const char* ptr, std::streamsize count)
+{
+    std::streamsize written = 0;
+    while (written < count) {
+        if (this->pptr() == this->epptr() && !submit()) {
+            break;
+        }
+        size_t n = std::min(size_t(count - written), size_t(this->epptr() - this->pptr()));
+        std::memcpy(this->pptr(), ptr + written, n);
+        this->pbump(int(n));
+        written += n;
+    }
+    return written;
+}
+
+int AsyncWriteStreamBuf::sync()
+{
+    if (!file_.is_open()) {
+        return 0;
+    }
+    if (failed_) {
+        return -1;
+    }
+
+    DS_PROFILE_SCOPE("AsyncWriteStreamBuf::sync()");
+    // write the partial buffer padded with zeros up to the sector boundary, and truncate the padding away.
+    char* head = this->pbase();
+    size_t n = size_t(this->pptr() - head);
+    size_t aligned = (size_t)AlignSector(n);
+    std::memset(head + n, 0, aligned - n);
+    bool ok = aligned == 0 || file_.write(current_, head, aligned, buffer_pos_);
+    ok = file_.wait_all() && ok;
+    if (ok && reserved_ < buffer_pos_ + aligned) {
+        ok = file_.truncate(buffer_pos_ + n);
+    }
+    if (!ok) {
+        failed_ = true;
+        return -1;
+    }
+
+    // keep the unaligned tail in the buffer. it is written again with the following data.
+    size_t keep = n % AsyncFileWriter::sector_size;
+    std::memmove(head, head + (n - keep), keep);
+    buffer_pos_ += n - keep;
+    this->setp(head, head + buffer_size_);
+    this->pbump(int(keep));
+    return 0;
+}
+
+bool AsyncWriteStreamBuf::reserve(uint64_t size)
+{
+    if (!file_.is_open() || failed_) {
+        return false;
+    }
+    if (size <= std::max(reserved_, this->size())) {
+        return true;
+    }
+
+    DS_PROFILE_SCOPE("AsyncWriteStreamBuf::reserve()");
+    if (!file_.wait_all() || !file_.truncate(size)) {
+        return false;
+    }
+    reserved_ = size;
+    return true;
+}
+
+uint64_t AsyncWriteStreamBuf::size() const
+{
+    return buffer_pos_ + uint64_t(this->pptr() - this->pbase());
+}
+
+bool AsyncWriteStreamBuf::is_unbuffered() const
+{
+    return file_.is_unbuffered();
+}
+
+#pragma endregion AsyncWriteStreamBuf
+
+
+#pragma region AsyncWriteStream
+
+AsyncWriteStream::AsyncWriteStream()
+    : super(&buf_)
+{
+}
+
+AsyncWriteStream::AsyncWriteStream(AsyncWriteStream&& v) noexcept
+    : super(&buf_)
+{
+    swap(v);
+}
+
+AsyncWriteStream::AsyncWriteStream(const char* path, std::ios::openmode mode)
+    : super(&buf_)
+{
+    open(path, mode);
+}
+
+AsyncWriteStream::AsyncWriteStream(const std::string& path, std::ios::openmode mode)
+    : super(&buf_)
+{
+    open(path, mode);
+}
+
+AsyncWriteStream& AsyncWriteStream::operator=(AsyncWriteStream&& v) noexcept
+{
+    swap(v);
+    return *this;
+}
+
+void AsyncWriteStream::swap(AsyncWriteStream& v)
+{
+    super::swap(v);
+    buf_.swap(v.buf_);
+}
+
+AsyncWriteStreamBuf* AsyncWriteStream::rdbuf() const
+{
+    return const_cast<AsyncWriteStreamBuf*>(&buf_);
+}
+
+bool AsyncWriteStream::open(const char* path, std::ios::openmode mode)
+{
+    if (buf_.open(path, mode)) {
+        this->clear();
+        return true;
+    }
+    else {
+        this->setstate(std::ios::failbit);
+        return false;
+    }
+}
+
+bool AsyncWriteStream::open(const std::string& path, std::ios::openmode mode)
+{
+    return open(path.c_str(), mode);
+}
+
+bool AsyncWriteStream::close()
+{
+    if (!buf_.close()) {
+        this->setstate(std::ios::failbit);
+        return false;
+    }
+    return true;
+}
+
+bool AsyncWriteStream::is_open() const
+{
+    return buf_.is_open();
+}
+
+bool AsyncWriteStream::reserve(uint64_t size)
+{
+    return buf_.reserve(size);
+}
+
+uint64_t AsyncWriteStream::size() const
+{
+    return buf_.size();
+}
+
+bool AsyncWriteStream::is_unbuffered() const
+{
+    return buf_.is_unbuffered();
+}
+#pragma endregion AsyncWriteStream
+
+} // namespace ist
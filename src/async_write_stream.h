@@ -0,0 +1,153 @@
+﻿#pragma once
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <string>
+
+namespace ist {
+
+// unbuffered overlapped file writer. AsyncWriteStreamBuf is built on this.
+// the file is opened with FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED and each slot keeps one WriteFile() in flight.
+// on POSIX, the file is opened with O_DIRECT and writes are done by pwrite() on threads of the writer. (one per slot)
+// without buffering, offsets, sizes and addresses of write() must be multiples of sector_size.
+// if the file system doesn't support unbuffered writes, the file is opened with buffering. is_unbuffered() tells it.
+class AsyncFileWriter
+{
+public:
+    static constexpr size_t sector_size = 4096; // covers both 512e and 4Kn drives
+
+    // movable but non-copyable
+    AsyncFileWriter(const AsyncFileWriter& v) = delete;
+    AsyncFileWriter& operator=(const AsyncFileWriter& v) = delete;
+    AsyncFileWriter(AsyncFileWriter&& v) noexcept;
+    AsyncFileWriter& operator=(AsyncFileWriter&& v) noexcept;
+
+    AsyncFileWriter();
+    ~AsyncFileWriter(); // waits for pending writes and closes without truncation
+
+    void swap(AsyncFileWriter& v);
+    // creates or truncates the file. slot_count is the max number of writes in flight.
+    bool open(const char* path, size_t slot_count);
+    // waits for pending writes, truncates the file to file_size and closes it.
+    // false if any write failed.
+    bool close(uint64_t file_size);
+    bool is_open() const;
+    bool is_unbuffered() const;
+
+    // starts writing [data, data + size) at offset. data must be kept until the slot is waited.
+    // waits for the previous write of the slot first.
+    bool write(size_t slot, const void* data, size_t size, uint64_t offset);
+    // waits for the write of the slot. false if any write has failed so far.
+    bool wait(size_t slot);
+    bool wait_all();
+    // sets the file size. pending writes must be waited beforehand.
+    // lets writes land within the file instead of extending it. extending writes may be done synchronously by the OS.
+    bool truncate(uint64_t file_size);
+
+private:
+    struct PImpl;
+    std::shared_ptr<PImpl> pimpl_;
+};
+
+
+// std::ostream compatible writer for large files. faster than MMapStream with std::ios::out for sequential writes.
+// written data goes to one of the pool buffers, and each filled buffer is written by AsyncFileWriter while
+// the next one is filled. so, xsputn() is just a memcpy() unless all buffers are in flight.
+// the last partial buffer is written with padding up to the sector boundary, and the file is truncated to
+// the written size on close().
+class AsyncWriteStreamBuf : public std::streambuf
+{
+    using super = std::streambuf;
+
+public:
+    static constexpr std::ios::openmode large_pages = std::ios::openmode(0x8000); // allocate buffers with large pages. see CreateBuffer().
+
+    // movable but non-copyable
+    AsyncWriteStreamBuf(const AsyncWriteStreamBuf& v) = delete;
+    AsyncWriteStreamBuf& operator=(const AsyncWriteStreamBuf& v) = delete;
+    AsyncWriteStreamBuf(AsyncWriteStreamBuf&& v) noexcept;
+    AsyncWriteStreamBuf& operator=(AsyncWriteStreamBuf&& v) noexcept;
+
+    AsyncWriteStreamBuf();
+    ~AsyncWriteStreamBuf();
+
+    // std::filebuf compatible
+    void swap(AsyncWriteStreamBuf& buf);
+    bool open(const char* path, std::ios::openmode mode = std::ios::out);
+    bool open(const std::string& path, std::ios::openmode mode = std::ios::out);
+    bool close(); // false if any write failed
+    bool is_open() const;
+
+    // overrides
+    // only tellp() (seekoff(0, std::ios::cur)) is supported. the stream is write only and sequential.
+    pos_type seekoff(off_type off,
+                     std::ios::seekdir dir,
+                     std::ios::openmode mode = std::ios::out) final override;
+    pos_type seekpos(pos_type pos, std::ios::openmode mode = std::ios::out) final override;
+    int overflow(int c) final override;
+    std::streamsize xsputn(const char* ptr, std::streamsize count) final override;
+    // writes everything so far and waits for it. the file is truncated to size() unless reserve()d larger.
+    int sync() final override;
+
+    // sets the file size ahead when the final size is known, so that writes don't extend the file.
+    bool reserve(uint64_t size);
+    uint64_t size() const; // bytes written so far
+    bool is_unbuffered() const; // see AsyncFileWriter
+
+    // size of each pool buffer. rounded up to AsyncFileWriter::sector_size. (default: 8MiB)
+    static void set_buffer_size(size_t size);
+    static size_t get_buffer_size();
+    // number of pool buffers. at least 2. (default: 4)
+    static void set_buffer_count(size_t count);
+    static size_t get_buffer_count();
+
+private:
+    bool submit(); // writes the current buffer and switches to the next one
+    void reset();
+
+    AsyncFileWriter file_;
+    std::vector<std::shared_ptr<char[]>> buffers_; // allocated on first use
+    std::ios::openmode mode_{};
+    size_t buffer_size_ = 0;
+    size_t current_ = 0; // index of the buffer being filled
+    uint64_t buffer_pos_ = 0; // file position of pbase(). always sector-aligned
+    uint64_t reserved_ = 0; // by reserve()
+    bool failed_ = false;
+};
+
+
+class AsyncWriteStream : public std::ostream
+{
+    using super = std::ostream;
+
+public:
+    static constexpr std::ios::openmode large_pages = AsyncWriteStreamBuf::large_pages;
+
+public:
+    // movable but non-copyable
+    AsyncWriteStream(AsyncWriteStream&& v) noexcept;
+    AsyncWriteStream& operator=(AsyncWriteStream&& v) noexcept;
+    AsyncWriteStream(const AsyncWriteStream& v) = delete;
+    AsyncWriteStream& operator=(const AsyncWriteStream& rhs) = delete;
+
+    AsyncWriteStream();
+    AsyncWriteStream(const char* path, std::ios::openmode mode = std::ios::out);
+    AsyncWriteStream(const std::string& path, std::ios::openmode mode = std::ios::out);
+
+    void swap(AsyncWriteStream& buf);
+    AsyncWriteStreamBuf* rdbuf() const;
+
+    bool open(const char* path, std::ios::openmode mode = std::ios::out);
+    bool open(const std::string& path, std::ios::openmode mode = std::ios::out);
+    bool close(); // sets failbit if any write failed
+    bool is_open() const;
+
+    bool reserve(uint64_t size);
+    uint64_t size() const;
+    bool is_unbuffered() const;
+
+private:
+    AsyncWriteStreamBuf buf_;
+};
+
+} // namespace ist
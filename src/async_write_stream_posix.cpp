@@ -0,0 +1,183 @@
+﻿// POSIX implementation of AsyncFileWriter. see async_write_stream.cpp for Windows.
+// AsyncWriteStreamBuf and AsyncWriteStream in async_write_stream.cpp are shared by all platforms.
+#ifndef _WIN32
+#include "async_write_stream.h"
+#include "internal.h"
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace ist {
+
+#pragma region AsyncFileWriter
+
+#ifdef O_DIRECT
+static constexpr int g_write_direct_flag = O_DIRECT;
+#else
+static constexpr int g_write_direct_flag = 0; // not available. writes are always buffered
+#endif
+
+static bool WriteAll(int fd, const char* data, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t r = ::pwrite(fd, data, size, (off_t)offset);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        data += r;
+        size -= size_t(r);
+        offset += uint64_t(r);
+    }
+    return true;
+}
+
+// there is no overlapped I/O for regular files that works everywhere. the writer has its own threads instead of
+// RunAsync(), so that writes never wait behind tasks that may be waiting for the writes.
+struct AsyncFileWriter::PImpl
+{
+    struct Request
+    {
+        size_t slot;
+        const char* data;
+        size_t size;
+        uint64_t offset;
+    };
+
+    ScopedFD file_;
+    bool unbuffered_ = false;
+    bool failed_ = false;
+    bool stop_ = false;
+    std::vector<bool> pending_; // per slot
+    std::deque<Request> requests_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<std::thread> threads_;
+
+    ~PImpl()
+    {
+        {
+            std::unique_lock lock{ mutex_ };
+            stop_ = true;
+        }
+        cond_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    void run()
+    {
+        for (;;) {
+            Request r;
+            {
+                std::unique_lock lock{ mutex_ };
+                cond_.wait(lock, [this]() { return stop_ || !requests_.empty(); });
+                if (requests_.empty()) {
+                    return; // stopped
+                }
+                r = requests_.front();
+                requests_.pop_front();
+            }
+
+            DS_PROFILE_SCOPE("AsyncFileWriter::run()");
+            bool ok = WriteAll(file_.get(), r.data, r.size, r.offset);
+
+            std::unique_lock lock{ mutex_ };
+            pending_[r.slot] = false;
+            failed_ = failed_ || !ok;
+            cond_.notify_all();
+        }
+    }
+};
+
+bool AsyncFileWriter::open(const char* path, size_t slot_count)
+{
+    pimpl_ = {};
+    auto m = std::make_shared<PImpl>();
+
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int fd = ::open(path, flags | g_write_direct_flag, 0644);
+    m->unbuffered_ = fd >= 0 && g_write_direct_flag != 0;
+    if (fd < 0 && errno == EINVAL) {
+        // the file system doesn't support O_DIRECT (e.g. tmpfs)
+        fd = ::open(path, flags, 0644);
+    }
+    if (fd < 0) {
+        return false;
+    }
+    m->file_.reset(fd);
+
+    slot_count = std::max(slot_count, size_t(1));
+    m->pending_.resize(slot_count);
+    for (size_t i = 0; i < slot_count; ++i) {
+        m->threads_.emplace_back([m = m.get()]() { m->run(); });
+    }
+    pimpl_ = std::move(m);
+    return true;
+}
+
+bool AsyncFileWriter::write(size_t slot, const void* data, size_t size, uint64_t offset)
+{
+    auto& m = *pimpl_;
+    if (slot >= m.pending_.size() || !wait(slot)) {
+        return false;
+    }
+    {
+        std::unique_lock lock{ m.mutex_ };
+        m.pending_[slot] = true;
+        m.requests_.push_back({ slot, (const char*)data, size, offset });
+    }
+    m.cond_.notify_all();
+    return true;
+}
+
+bool AsyncFileWriter::wait(size_t slot)
+{
+    auto& m = *pimpl_;
+    if (slot >= m.pending_.size()) {
+        return false;
+    }
+    DS_PROFILE_SCOPE("AsyncFileWriter::wait()");
+    std::unique_lock lock{ m.mutex_ };
+    m.cond_.wait(lock, [&]() { return !m.pending_[slot]; });
+    return !m.failed_;
+}
+
+bool AsyncFileWriter::wait_all()
+{
+    auto& m = *pimpl_;
+    std::unique_lock lock{ m.mutex_ };
+    m.cond_.wait(lock, [&]() { return std::none_of(m.pending_.begin(), m.pending_.end(), [](bool v) { return v; }); });
+    return !m.failed_;
+}
+
+bool AsyncFileWriter::truncate(uint64_t file_size)
+{
+    return ::ftruncate(pimpl_->file_.get(), (off_t)file_size) == 0;
+}
+
+bool AsyncFileWriter::is_open() const
+{
+    return pimpl_ && pimpl_->file_;
+}
+
+bool AsyncFileWriter::is_unbuffered() const
+{
+    return pimpl_ && pimpl_->unbuffered_;
+}
+
+#pragma endregion AsyncFileWriter
+
+} // namespace ist
+#endif // _WIN32
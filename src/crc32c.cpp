@@ -0,0 +1,137 @@
+﻿#include "dstorage_stream.h"
+#include "internal.h"
+
+#include <array>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <nmmintrin.h>
+
+// SSE4.2 code path is selected at runtime. gcc / clang need the target attribute to emit it without -msse4.2.
+#ifdef _MSC_VER
+#define DS_TARGET_SSE42
+#else
+#define DS_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+
+namespace ist {
+
+#pragma region Checksum
+
+static bool HasSSE42()
+{
+    static const bool s_available = []() {
+#ifdef _MSC_VER
+        int info[4]{};
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+#else
+        unsigned int a, b, c, d;
+        return __get_cpuid(1, &a, &b, &c, &d) && (c & (1 << 20)) != 0;
+#endif
+        }();
+    return s_available;
+}
+
+static uint32_t Crc32cSoftware(uint32_t crc, const uint8_t* src, size_t size)
+{
+    static const auto s_table = []() {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            }
+            table[i] = c;
+        }
+        return table;
+        }();
+    for (size_t i = 0; i < size; ++i) {
+        crc = s_table[(crc ^ src[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+DS_TARGET_SSE42 static uint32_t Crc32cSSE42(uint32_t crc, const uint8_t* src, size_t size)
+{
+    uint64_t c = crc;
+    for (; size >= 8; size -= 8, src += 8) {
+        uint64_t v;
+        std::memcpy(&v, src, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; size > 0; --size, ++src) {
+        c32 = _mm_crc32_u8(c32, *src);
+    }
+    return c32;
+}
+
+uint32_t Crc32c(const void* data, size_t size, uint32_t crc)
+{
+    crc = ~crc;
+    crc = HasSSE42() ? Crc32cSSE42(crc, (const uint8_t*)data, size) : Crc32cSoftware(crc, (const uint8_t*)data, size);
+    return ~crc;
+}
+
+// same as crc32_combine() of zlib. shifts crc1 by size2 bytes of zeros with GF(2) matrix squaring.
+static uint32_t Gf2MatrixTimes(const uint32_t* mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++mat) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+static void Gf2MatrixSquare(uint32_t* square, const uint32_t* mat)
+{
+    for (int n = 0; n < 32; ++n) {
+        square[n] = Gf2MatrixTimes(mat, mat[n]);
+    }
+}
+
+uint32_t Crc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+    if (size2 == 0) {
+        return crc1;
+    }
+
+    uint32_t even[32]; // even-power-of-two zeros operator
+    uint32_t odd[32];  // odd-power-of-two zeros operator
+    odd[0] = 0x82F63B78; // operator for one zero bit
+    uint32_t row = 1;
+    for (int n = 1; n < 32; ++n) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    Gf2MatrixSquare(even, odd); // two zero bits
+    Gf2MatrixSquare(odd, even); // four zero bits
+
+    // the first square puts the operator for one zero byte (eight zero bits) in even
+    do {
+        Gf2MatrixSquare(even, odd);
+        if (size2 & 1) {
+            crc1 = Gf2MatrixTimes(even, crc1);
+        }
+        size2 >>= 1;
+        if (size2 == 0) {
+            break;
+        }
+        Gf2MatrixSquare(odd, even);
+        if (size2 & 1) {
+            crc1 = Gf2MatrixTimes(odd, crc1);
+        }
+        size2 >>= 1;
+    } while (size2 != 0);
+    return crc1 ^ crc2;
+}
+
+#pragma endregion Checksum
+
+} // namespace ist
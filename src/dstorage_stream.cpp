@@ -1,22 +1,128 @@
-﻿#include "dstorage_stream.h"
-#include "internal.h"
-
-#include <atomic>
-#include <mutex>
-#include <future>
-#include <filesystem>
-#include <dstorage.h>
+﻿// platform-independent parts and the Windows implementation (DirectStorage, and Win32 overlapped I/O as the fallback).
+// the engine of other platforms is in dstorage_stream_posix.cpp. see dstorage_stream_impl.h for the boundary.
+#include "dstorage_stream_impl.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
+#include <thread>
+#include <array>
+#include <cerrno>
+#ifdef _WIN32
 #include <dxgi1_4.h>
-#include <winrt/base.h>
 #include <ppltasks.h>
+#include <TraceLoggingProvider.h>
+#endif
 
 
 namespace ist {
 
+#pragma region Stats
+std::atomic<uint64_t> g_stat_open_streams{ 0 };
+std::atomic<uint64_t> g_stat_inflight_requests{ 0 };
+std::atomic<uint64_t> g_stat_inflight_bytes{ 0 };
+std::atomic<uint64_t> g_stat_total_streams{ 0 };
+std::atomic<uint64_t> g_stat_total_bytes{ 0 };
+std::atomic<uint64_t> g_stat_errors{ 0 };
+std::atomic<uint64_t> g_stat_cancelled{ 0 };
+std::atomic<uint64_t> g_stat_buffer_pool_hits{ 0 };
+std::atomic<uint64_t> g_stat_buffer_pool_misses{ 0 };
+
+Stats GetStats()
+{
+    Stats r;
+    r.open_streams = g_stat_open_streams.load();
+    r.inflight_requests = g_stat_inflight_requests.load();
+    r.inflight_bytes = g_stat_inflight_bytes.load();
+    r.total_streams = g_stat_total_streams.load();
+    r.total_bytes = g_stat_total_bytes.load();
+    r.errors = g_stat_errors.load();
+    r.cancelled = g_stat_cancelled.load();
+    r.buffer_pool_hits = g_stat_buffer_pool_hits.load();
+    r.buffer_pool_misses = g_stat_buffer_pool_misses.load();
+    return r;
+}
+
+#ifdef _WIN32
+// {6e0ac3b4-2f5d-4c8e-9a71-3d4b8f2e6c15}
+TRACELOGGING_DEFINE_PROVIDER(g_trace_provider, "ist.DirectStorageStream",
+    (0x6e0ac3b4, 0x2f5d, 0x4c8e, 0x9a, 0x71, 0x3d, 0x4b, 0x8f, 0x2e, 0x6c, 0x15));
+#endif
+
+// g_trace_enabled is checked first so that tracing costs nearly nothing when no one listens.
+static std::atomic_bool g_trace_enabled{ false };
+static std::mutex g_trace_mutex;
+static std::shared_ptr<TraceHook> g_trace_hook; // shared_ptr to keep it alive while being called. guarded by g_trace_mutex
+static bool g_trace_logging = false; // ETW. always false on POSIX. guarded by g_trace_mutex
+
+void SetTraceHook(TraceHook hook)
+{
+    std::unique_lock lock{ g_trace_mutex };
+    g_trace_hook = hook ? std::make_shared<TraceHook>(std::move(hook)) : nullptr;
+    g_trace_enabled = g_trace_hook || g_trace_logging;
+}
+
+void EnableTraceLogging([[maybe_unused]] bool enable)
+{
+#ifdef _WIN32
+    std::unique_lock lock{ g_trace_mutex };
+    if (enable == g_trace_logging) {
+        return;
+    }
+    if (enable) {
+        if (FAILED(TraceLoggingRegister(g_trace_provider))) {
+            return;
+        }
+    }
+    else {
+        TraceLoggingUnregister(g_trace_provider);
+    }
+    g_trace_logging = enable;
+    g_trace_enabled = g_trace_hook || g_trace_logging;
+#endif
+}
+
+void Trace(TraceEventType type, TracePhase phase, const void* stream, int64_t value)
+{
+    if (!g_trace_enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    TraceEvent ev{ type, phase, stream, value, NowNS() };
+
+    std::shared_ptr<TraceHook> hook;
+    bool logging;
+    {
+        std::unique_lock lock{ g_trace_mutex };
+        hook = g_trace_hook;
+        logging = g_trace_logging;
+    }
+    if (hook) {
+        (*hook)(ev);
+    }
+    if (logging) {
+#ifdef _WIN32
+        TraceLoggingWrite(g_trace_provider, "TraceEvent",
+            TraceLoggingInt32((int)ev.type, "Type"),
+            TraceLoggingInt32((int)ev.phase, "Phase"),
+            TraceLoggingPointer(ev.stream, "Stream"),
+            TraceLoggingInt64(ev.value, "Value"));
+#endif
+    }
+}
+
+#pragma endregion Stats
+
+
 #pragma region Misc
-using winrt::check_hresult;
-using winrt::com_ptr;
 
+// global variables shared by all platforms
+uint32_t g_ds_staging_buffer_size = 1024 * 1024 * 64;
+uint32_t g_ds_small_file_threshold = 1024 * 64;
+uint32_t g_ds_streaming_ring_size = 8;
+std::atomic_bool g_ds_adaptive{ false };
+
+#ifdef _WIN32
 // functions
 // d3d12.dll や dstorage.dll がないと exe が起動すらしなくなってしまうのは避けたいため、
 // 古き悪しき LoadLibrary() & GetProcAddress() でインポートを解決する。
@@ -24,16 +130,35 @@ using winrt::com_ptr;
 decltype(&D3D12CreateDevice) g_D3D12CreateDevice;
 decltype(&DStorageSetConfiguration1) g_DStorageSetConfiguration1;
 decltype(&DStorageGetFactory) g_DStorageGetFactory;
+decltype(&DStorageCreateCompressionCodec) g_DStorageCreateCompressionCodec;
 
 // global variables
 static DSTORAGE_CONFIGURATION1 g_ds_config = {};
 static com_ptr<ID3D12Device> g_d3d12_device;
 static com_ptr<IDStorageFactory> g_ds_factory;
-static com_ptr<IDStorageQueue> g_ds_queue;
-static uint32_t g_ds_staging_buffer_size = 1024 * 1024 * 64;
 static bool g_ds_debug = false;
+
+// adaptive request sizing. see DStorageStream::enable_adaptive_request_size()
+static constexpr uint32_t g_ds_min_max_request_size = 1024 * 1024;
+static constexpr double g_ds_target_request_latency = 0.008; // in seconds
+static std::atomic<uint32_t> g_ds_max_request_size{ 0 }; // 0: not measured yet. use staging buffer size
+static std::atomic<double> g_ds_throughput{ 0.0 }; // bytes per second
 static std::mutex g_ds_mutex;
 
+// Win32 overlapped I/O fallback. see OverlappedEngine.
+static bool g_ds_force_overlapped = false;
+static constexpr uint32_t g_ov_request_size = 1024 * 1024;
+static constexpr size_t g_ov_queue_depth = 16; // outstanding reads per stream
+
+// one queue for each priority. requests in a queue signal its fence with increasing values.
+struct QueueSlot
+{
+    com_ptr<IDStorageQueue> queue;
+    com_ptr<ID3D12Fence> fence;
+    uint64_t fence_value = 0;
+};
+static QueueSlot g_ds_queues[4]; // indexed by DSTORAGE_PRIORITY + 1. guarded by g_ds_mutex.
+
 
 struct DirectStorageInitializer
 {
@@ -45,6 +170,7 @@ struct DirectStorageInitializer
         if (HMODULE dstorage = LoadLibraryA("dstorage.dll")) {
             (void*&)g_DStorageSetConfiguration1 = ::GetProcAddress(dstorage, "DStorageSetConfiguration1");
             (void*&)g_DStorageGetFactory = ::GetProcAddress(dstorage, "DStorageGetFactory");
+            (void*&)g_DStorageCreateCompressionCodec = ::GetProcAddress(dstorage, "DStorageCreateCompressionCodec");
         }
 
         if (!g_ds_factory) {
@@ -67,45 +193,76 @@ struct DirectStorageInitializer
                     g_ds_factory->SetDebugFlags(DSTORAGE_DEBUG_SHOW_ERRORS | DSTORAGE_DEBUG_BREAK_ON_ERROR);
                 }
             }
-
-            if (!g_ds_queue) {
-                DSTORAGE_QUEUE_DESC desc{};
-                desc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
-                desc.Priority = DSTORAGE_PRIORITY_NORMAL;
-                desc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
-                desc.Device = g_d3d12_device.get();
-                g_ds_factory->CreateQueue(&desc, IID_PPV_ARGS(g_ds_queue.put()));
-                if (!g_ds_queue) {
-                    return;
-                }
-            }
+            // queues are created on demand by GetQueue()
         }
     }
 };
 
+static void InitializeDirectStorage()
+{
+    static DirectStorageInitializer s_resolve_imports;
+}
+
+// g_ds_mutex must be locked
+static QueueSlot* GetQueue(int priority)
+{
+    QueueSlot& slot = g_ds_queues[priority + 1];
+    if (!slot.queue && g_ds_factory && g_d3d12_device) {
+        DSTORAGE_QUEUE_DESC desc{};
+        desc.Capacity = DSTORAGE_MAX_QUEUE_CAPACITY;
+        desc.Priority = (DSTORAGE_PRIORITY)priority;
+        desc.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        desc.Device = g_d3d12_device.get();
+        g_ds_factory->CreateQueue(&desc, IID_PPV_ARGS(slot.queue.put()));
+    }
+    if (slot.queue && !slot.fence && g_d3d12_device) {
+        g_d3d12_device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(slot.fence.put()));
+        slot.fence_value = 0;
+    }
+    return slot.queue && slot.fence ? &slot : nullptr;
+}
+
 
 void DStorageStream::set_device(ID3D12Device* device, IDStorageFactory* factory, IDStorageQueue* queue)
 {
+    IDStorageQueue* queues[] = { nullptr, queue, nullptr, nullptr };
+    set_device(device, factory, queues);
+}
+
+void DStorageStream::set_device(ID3D12Device* device, IDStorageFactory* factory, std::span<IDStorageQueue* const> queues)
+{
+    std::unique_lock lock{ g_ds_mutex };
     g_d3d12_device.attach(device);
     g_ds_factory.attach(factory);
-    g_ds_queue.attach(queue);
+    for (size_t i = 0; i < std::size(g_ds_queues); ++i) {
+        g_ds_queues[i] = {};
+        if (i < queues.size()) {
+            g_ds_queues[i].queue.attach(queues[i]);
+        }
+    }
 }
 
 void DStorageStream::release_device()
 {
+    ClearFileCache();
+    std::unique_lock lock{ g_ds_mutex };
     g_d3d12_device = {};
     g_ds_factory = {};
-    g_ds_queue = {};
+    for (auto& slot : g_ds_queues) {
+        slot = {};
+    }
 }
 
-void DStorageStream::set_staging_buffer_size(uint32_t size)
+void DStorageStream::force_overlapped_io(bool v)
 {
-    g_ds_staging_buffer_size = size;
+    g_ds_force_overlapped = v;
 }
 
-uint32_t DStorageStream::get_staging_buffer_size()
+bool DStorageStream::is_direct_storage_available()
 {
-    return g_ds_staging_buffer_size;
+    InitializeDirectStorage();
+    std::unique_lock lock{ g_ds_mutex };
+    return (bool)g_ds_factory;
 }
 
 void DStorageStream::disable_bypassio(bool v)
@@ -137,515 +294,2903 @@ void DStorageStream::enable_debug(bool v)
     g_ds_debug = true;
 }
 
+DStorageStream::request_size_info DStorageStream::get_request_size_info()
+{
+    request_size_info r;
+    r.adaptive = g_ds_adaptive;
+    r.staging_buffer_size = g_ds_staging_buffer_size;
+    if (r.adaptive) {
+        uint32_t max_size = g_ds_max_request_size.load();
+        r.first_request_size = std::min(g_ds_first_request_size, g_ds_staging_buffer_size);
+        r.max_request_size = max_size ? std::min(max_size, g_ds_staging_buffer_size) : g_ds_staging_buffer_size;
+    }
+    else {
+        r.first_request_size = r.max_request_size = g_ds_staging_buffer_size;
+    }
+    r.throughput = g_ds_throughput.load();
+    return r;
+}
+
+// called from the reactor thread. throughput is measured while any stream is in flight.
+static void UpdateThroughput(double bytes_per_second)
+{
+    double prev = g_ds_throughput.load();
+    double tp = prev == 0.0 ? bytes_per_second : prev * 0.75 + bytes_per_second * 0.25;
+    g_ds_throughput = tp;
+
+    // largest power of two that can be read within the target latency
+    uint64_t size = g_ds_min_max_request_size;
+    while (size * 2 <= tp * g_ds_target_request_latency && size * 2 <= UINT32_MAX) {
+        size *= 2;
+    }
+    g_ds_max_request_size = (uint32_t)size;
+}
+
 
-BufferPtr CreateBuffer(size_t size, bool async_free, bool prefetch)
+size_t GetPageSize()
 {
     static const size_t page_size = []() {
         ::SYSTEM_INFO si;
         ::GetSystemInfo(&si);
         return si.dwPageSize;
         }();
+    return page_size;
+}
 
-    // align to page size
-    size = (size + page_size - 1) & ~(page_size - 1);
-    char* ptr = (char*)::VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-
-    if (prefetch) {
-        concurrency::create_task([ptr, size]() {
-            DS_PROFILE_SCOPE("AsyncBufferPrefetch");
-            // VirtualAlloc() deferrs the actual allocation. actual allocation occurs when memory is accessed.
-            // ( https://randomascii.wordpress.com/2014/12/10/hidden-costs-of-memory-allocation/ )
-            // this PrefetchVirtualMemory() prompts the actual allocation.
-            WIN32_MEMORY_RANGE_ENTRY ranges[1];
-            ranges[0].VirtualAddress = ptr;
-            ranges[0].NumberOfBytes = size;
-            return ::PrefetchVirtualMemory(::GetCurrentProcess(), 1, ranges, 0);
-            });
-    }
+// large pages require SeLockMemoryPrivilege. it is not granted by default, and need to be enabled for the process.
+// returns 0 if large pages are not available.
+size_t GetLargePageSize()
+{
+    static const size_t large_page_size = []() -> size_t {
+        size_t size = ::GetLargePageMinimum();
+        if (size == 0) {
+            return 0;
+        }
 
-    if (async_free) {
-        struct AsyncBufferDeleter
+        ScopedHandle token;
         {
-            void operator()(void* p) const {
-                concurrency::create_task([p]() {
-                    DS_PROFILE_SCOPE("AsyncBufferDeleter");
-                    ::VirtualFree(p, 0, MEM_RELEASE);
-                    });
+            HANDLE h = nullptr;
+            if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &h)) {
+                return 0;
             }
-        };
-        return BufferPtr(ptr, AsyncBufferDeleter());
+            token.reset(h);
+        }
+
+        TOKEN_PRIVILEGES tp{};
+        tp.PrivilegeCount = 1;
+        tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        if (!::LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid)) {
+            return 0;
+        }
+        // AdjustTokenPrivileges() succeeds even if the privilege is not held. need to check GetLastError().
+        if (!::AdjustTokenPrivileges(token.get(), FALSE, &tp, 0, nullptr, nullptr) || ::GetLastError() != ERROR_SUCCESS) {
+            return 0;
+        }
+        return size;
+        }();
+    return large_page_size;
+}
+
+char* AllocateMemory(size_t size, bool large_pages, int numa_node)
+{
+    DWORD type = MEM_COMMIT | MEM_RESERVE;
+    if (large_pages) {
+        type |= MEM_LARGE_PAGES;
+    }
+    if (numa_node >= 0) {
+        return (char*)::VirtualAllocExNuma(::GetCurrentProcess(), nullptr, size, type, PAGE_READWRITE, (DWORD)numa_node);
     }
     else {
-        struct BufferDeleter
-        {
-            void operator()(void* p) const {
-                DS_PROFILE_SCOPE("BufferDeleter");
-                ::VirtualFree(p, 0, MEM_RELEASE);
-            }
-        };
-        return BufferPtr(ptr, BufferDeleter());
+        return (char*)::VirtualAlloc(nullptr, size, type, PAGE_READWRITE);
     }
 }
 
-static std::wstring ToWString(std::string_view str)
+void FreeMemory(char* p, size_t)
 {
-    size_t wclen = ::MultiByteToWideChar(CP_UTF8, MB_PRECOMPOSED, str.data(), (int)str.size(), nullptr, 0);
-
-    std::wstring wpath;
-    wpath.resize(wclen);
-    ::MultiByteToWideChar(CP_UTF8, MB_PRECOMPOSED, str.data(), (int)str.size(), wpath.data(), (int)wpath.size());
-    return wpath;
+    ::VirtualFree(p, 0, MEM_RELEASE);
 }
-#pragma endregion Misc
-
-
-#pragma region DStorageStreamBuf
 
-struct DStorageStreamBuf::PImpl
+void PrefetchMemory(char* p, size_t size)
 {
-    // movable std::atomic<status_code> to make PImpl implicitly movable
-    class AtomicStatusCode : public std::atomic<status_code>
-    {
-    public:
-        using super = std::atomic<status_code>;
-        using super::super;
-
-        AtomicStatusCode(AtomicStatusCode&& v) noexcept
-        {
-            *this = std::move(v);
-        }
-        AtomicStatusCode& operator=(AtomicStatusCode&& v) noexcept
-        {
-            this->exchange(v);
-            return *this;
-        }
-    };
+    RunAsync([p, size]() {
+        DS_PROFILE_SCOPE("AsyncBufferPrefetch");
+        // VirtualAlloc() deferrs the actual allocation. actual allocation occurs when memory is accessed.
+        // ( https://randomascii.wordpress.com/2014/12/10/hidden-costs-of-memory-allocation/ )
+        // this PrefetchVirtualMemory() prompts the actual allocation.
+        // with VirtualAllocExNuma(), pages are allocated on the preferred node regardless of which thread touches them.
+        WIN32_MEMORY_RANGE_ENTRY ranges[1];
+        ranges[0].VirtualAddress = p;
+        ranges[0].NumberOfBytes = size;
+        ::PrefetchVirtualMemory(::GetCurrentProcess(), 1, ranges, 0);
+        });
+}
 
-    BufferPtr buf_;
-    std::wstring path_;
-    std::future<HRESULT> future_;
-
-    com_ptr<IDStorageFile> file_;
-    com_ptr<ID3D12Fence> fence_;
-    std::vector<ScopedHandle> events_;
-    uint64_t file_size_ = 0;
-    uint64_t read_size_ = 0;
-    uint32_t event_pos_ = 0;
-    std::ios::openmode mode_ = 0;
-    AtomicStatusCode state_{ status_code::idle };
+// compressed file format:
+//   CompressedFileHeader
+//   CompressedChunk[chunk_count]
+//   chunk data...
+// each chunk holds chunk_size bytes of uncompressed data (except the last one) and is compressed independently,
+// so that one chunk == one DSTORAGE_REQUEST.
+struct CompressedFileHeader
+{
+    static constexpr uint32_t magic_value = 0x44475344; // "DSGD"
+    static constexpr uint32_t current_version = 1;
+
+    uint32_t magic = magic_value;
+    uint32_t version = current_version;
+    uint64_t uncompressed_size = 0;
+    uint32_t chunk_size = 0;
+    uint32_t chunk_count = 0;
 };
 
+struct CompressedChunk
+{
+    uint64_t offset = 0; // from the beginning of the file (the asset in pack file)
+    uint32_t size = 0; // compressed size
+    uint32_t format = DSTORAGE_COMPRESSION_FORMAT_NONE; // DSTORAGE_COMPRESSION_FORMAT. incompressible chunks are stored as is.
+};
 
-DStorageStreamBuf::DStorageStreamBuf()
+std::wstring ToWString(std::string_view str)
 {
-    DS_PROFILE_SCOPE("DStorageStreamBuf::DStorageStreamBuf()");
-    static DirectStorageInitializer s_resolve_imports;
+    size_t wclen = ::MultiByteToWideChar(CP_UTF8, MB_PRECOMPOSED, str.data(), (int)str.size(), nullptr, 0);
 
-    pimpl_ = std::make_unique<PImpl>();
+    std::wstring wpath;
+    wpath.resize(wclen);
+    ::MultiByteToWideChar(CP_UTF8, MB_PRECOMPOSED, str.data(), (int)str.size(), wpath.data(), (int)wpath.size());
+    return wpath;
 }
+#endif // _WIN32
 
-DStorageStreamBuf::~DStorageStreamBuf()
+void DStorageStream::set_staging_buffer_size(uint32_t size)
 {
-    DS_PROFILE_SCOPE("DStorageStreamBuf::~DStorageStreamBuf()");
-    close();
-    pimpl_ = {};
+    g_ds_staging_buffer_size = size;
 }
 
-DStorageStreamBuf::DStorageStreamBuf(DStorageStreamBuf&& v) noexcept
-    : DStorageStreamBuf()
+uint32_t DStorageStream::get_staging_buffer_size()
 {
-    *this = std::move(v);
+    return g_ds_staging_buffer_size;
 }
 
-DStorageStreamBuf& DStorageStreamBuf::operator=(DStorageStreamBuf&& v) noexcept
+void DStorageStream::set_small_file_threshold(uint32_t size)
 {
-    swap(v);
-    return *this;
+    g_ds_small_file_threshold = size;
 }
 
-void DStorageStreamBuf::swap(DStorageStreamBuf& v) noexcept
+uint32_t DStorageStream::get_small_file_threshold()
 {
-    super::swap(v);
-    std::swap(pimpl_, v.pimpl_);
+    return g_ds_small_file_threshold;
 }
 
-DStorageStreamBuf::pos_type DStorageStreamBuf::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode mode)
+void DStorageStream::set_streaming_ring_size(uint32_t blocks)
 {
-    auto& m = *pimpl_;
-    char* head = m.buf_.get();
-    char* tail = head + m.file_size_;
-
-    char* current = this->gptr();
-    if (dir == std::ios::beg)
-        current = head + off;
-    else if (dir == std::ios::cur)
-        current += off;
-    else if (dir == std::ios::end)
-        current = tail - off;
-
-    size_t distance = size_t(std::distance(head, current));
-    while (m.read_size_ < distance) {
-        if (!wait_next_block()) {
-            break;
-        }
-    }
-    current = std::min(current, head + m.read_size_);
-
-    this->setg(current, current, tail);
-    return pos_type(current - head);
+    g_ds_streaming_ring_size = std::max(blocks, 2u);
 }
 
-DStorageStreamBuf::pos_type DStorageStreamBuf::seekpos(pos_type pos, std::ios::openmode mode)
+uint32_t DStorageStream::get_streaming_ring_size()
 {
-    return seekoff(pos, std::ios::beg, mode);
+    return g_ds_streaming_ring_size;
 }
 
-// implement our own xsgetn() / xsputn() because std::streambuf can't handle count of > INT_MAX
-// ( https://github.com/microsoft/STL/issues/388 )
-std::streamsize DStorageStreamBuf::xsgetn(char* dst, std::streamsize count)
+void DStorageStream::enable_adaptive_request_size(bool v)
 {
-    auto& m = *pimpl_;
-    char* head = m.buf_.get();
-    char* tail = head + m.read_size_;
-    char* src = this->gptr();
-
-    size_t remain = count;
-    while (remain) {
-        size_t n = std::min(remain, size_t(tail - src));
-        std::memcpy(dst, src, n);
-        dst += n;
-        src += n;
-        remain -= n;
-        this->setg(src, src, tail);
-
-        if (remain) {
-            if (underflow() == traits_type::eof()) {
-                return count - remain;
-            }
-            else {
-                head = m.buf_.get();
-                tail = head + m.read_size_;
-                src = this->gptr();
-            }
-        }
-    }
-    return count;
+    g_ds_adaptive = v;
 }
 
-int DStorageStreamBuf::underflow()
+bool IsLargePageAvailable()
 {
-    return wait_next_block() ? 0 : traits_type::eof();
+    return GetLargePageSize() != 0;
 }
 
-long DStorageStreamBuf::do_read()
+// freed buffers are kept here and reused by CreateBuffer().
+// buffers are grouped by size class to make them reusable for slightly different sizes.
+class BufferPool
 {
-    DS_PROFILE_SCOPE("DStorageStreamBuf::do_read()");
-
-    auto& m = *pimpl_;
-    HRESULT hr;
+public:
+    struct Key
+    {
+        size_t size = 0;
+        int numa_node = -1;
+        bool large_pages = false;
 
-    auto signal_all = [&m]() {
-        for (auto& e : m.events_) {
-            ::SetEvent(e.get());
+        bool operator<(const Key& v) const
+        {
+            return std::tie(size, numa_node, large_pages) < std::tie(v.size, v.numa_node, v.large_pages);
         }
-        };
+    };
 
+    static BufferPool& instance()
     {
-        DS_PROFILE_SCOPE("DStorageStreamBuf::do_read(): OpenFile");
+        static BufferPool s_instance;
+        return s_instance;
+    }
 
-        // OpenFile() to large file may take long.
-        hr = g_ds_factory->OpenFile(m.path_.c_str(), IID_PPV_ARGS(m.file_.put()));
-        if (FAILED(hr)) {
-            m.state_ = status_code::error_file_open_failed;
-            signal_all();
-            return hr;
+    static size_t size_class(size_t size)
+    {
+        constexpr size_t min_class = 64 * 1024;
+        constexpr size_t max_pow2_class = 64 * 1024 * 1024;
+        if (size <= min_class) {
+            return min_class;
+        }
+        else if (size <= max_pow2_class) {
+            size_t r = min_class;
+            while (r < size) {
+                r *= 2;
+            }
+            return r;
+        }
+        else {
+            return (size + max_pow2_class - 1) & ~(max_pow2_class - 1);
         }
-        g_d3d12_device->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(m.fence_.put()));
     }
 
+    char* acquire(const Key& key)
     {
-        DS_PROFILE_SCOPE("DStorageStreamBuf::do_read(): Submit");
-
-        std::unique_lock lock{ g_ds_mutex };
-
-        uint64_t remain = m.file_size_;
-        uint64_t progress = 0;
-        uint64_t i = 0;
-        while (remain > 0) {
-            uint32_t read_size = (uint32_t)std::min<uint64_t>(g_ds_staging_buffer_size, remain);
-            DSTORAGE_REQUEST request = {};
-            request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
-            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
-            request.Source.File.Source = m.file_.get();
-            request.Source.File.Offset = progress;
-            request.Source.File.Size = read_size;
-            request.UncompressedSize = read_size;
-            request.Destination.Memory.Buffer = m.buf_.get() + progress;
-            request.Destination.Memory.Size = read_size;
-            g_ds_queue->EnqueueRequest(&request);
-
-            remain -= read_size;
-            progress += read_size;
-            g_ds_queue->EnqueueSignal(m.fence_.get(), progress);
-            m.fence_->SetEventOnCompletion(progress, m.events_[i].get());
-
-            ++i;
+        std::unique_lock lock{ mutex_ };
+        auto it = buffers_.find(key);
+        if (it == buffers_.end()) {
+            return nullptr;
         }
-
-        // submit
-        g_ds_queue->Submit();
-        m.state_ = status_code::reading;
+        char* r = it->second;
+        buffers_.erase(it);
+        pooled_size_ -= key.size;
+        return r;
     }
 
+    // returns false if the pool is full. caller must free the buffer in that case. null is never pooled.
+    bool release(char* ptr, const Key& key)
     {
-        DS_PROFILE_SCOPE("DStorageStreamBuf::do_read(): WaitForSingleObject");
-
-        // wait
-        ::WaitForSingleObject(m.events_.back().get(), INFINITE);
-
-        DSTORAGE_ERROR_RECORD rec{};
-        g_ds_queue->RetrieveErrorRecord(&rec);
-        hr = rec.FirstFailure.HResult;
-        if (SUCCEEDED(hr)) {
-            m.state_ = status_code::completed;
+        if (!ptr) {
+            return true;
         }
-        else {
-            m.state_ = status_code::error_unknown;
+        std::unique_lock lock{ mutex_ };
+        if (pooled_size_ + key.size > capacity_) {
+            return false;
         }
+        buffers_.emplace(key, ptr);
+        pooled_size_ += key.size;
+        return true;
     }
-    return hr;
-}
-
-bool DStorageStreamBuf::open(std::wstring&& path, std::ios::openmode mode)
-{
-    close();
 
-    DS_PROFILE_SCOPE("DStorageStreamBuf::open()");
+    void set_capacity(size_t v)
+    {
+        std::unique_lock lock{ mutex_ };
+        capacity_ = v;
+        trim();
+    }
 
-    auto& m = *pimpl_;
-    if (!g_ds_factory) {
-        m.state_ = status_code::error_dll_not_found;
-        return false;
+    size_t get_capacity() const
+    {
+        return capacity_;
     }
 
-    // IDStorageFactory::OpenFile() can be very slow, so we run it asynchronously.
-    // also, file size can be obtained by IDStorageFile::GetFileInformation() but it requires IDStorageFactory::OpenFile().
-    // therefore, we use std::filesystem::file_size() instead. (which is reasonably fast)
+    void clear()
+    {
+        std::unique_lock lock{ mutex_ };
+        auto capacity = capacity_;
+        capacity_ = 0;
+        trim();
+        capacity_ = capacity;
+    }
 
-    m.path_ = std::move(path);
-    m.mode_ = mode;
+private:
+    // mutex_ must be locked
+    void trim()
     {
-        // get file size
-        std::error_code ec;
-        m.file_size_ = std::filesystem::file_size(std::filesystem::path(m.path_), ec);
-        if (ec) {
-            m.state_ = status_code::error_file_open_failed;
-            return false;
-        }
-        if (m.file_size_ == 0) {
-            m.state_ = status_code::completed;
-            return true;
+        // release larger buffers first
+        while (pooled_size_ > capacity_ && !buffers_.empty()) {
+            auto it = std::prev(buffers_.end());
+            FreeMemory(it->second, it->first.size);
+            pooled_size_ -= it->first.size;
+            buffers_.erase(it);
         }
+    }
 
-        // allocate buffer
-        m.buf_ = CreateBuffer(m.file_size_, m.mode_ & async_free);
-        char* gp = m.buf_.get();
-        this->setg(gp, gp, gp);
+    std::mutex mutex_;
+    std::multimap<Key, char*> buffers_;
+    size_t pooled_size_ = 0;
+    size_t capacity_ = 0;
+};
 
-        // allocate events
-        size_t event_count = (m.file_size_ / g_ds_staging_buffer_size) + (m.file_size_ % g_ds_staging_buffer_size ? 1 : 0);
-        m.events_.reserve(event_count);
-        for (size_t i = 0; i < event_count; ++i) {
-            m.events_.emplace_back(::CreateEvent(nullptr, TRUE, FALSE, nullptr));
-        }
-    }
-    m.state_ = status_code::launched;
-    m.future_ = std::async(std::launch::async, [this]() { return do_read(); });
-    return true;
+void SetBufferPoolCapacity(size_t size)
+{
+    BufferPool::instance().set_capacity(size);
 }
 
-void DStorageStreamBuf::close()
+size_t GetBufferPoolCapacity()
 {
-    DS_PROFILE_SCOPE("DStorageStreamBuf::close()");
+    return BufferPool::instance().get_capacity();
+}
+
+void ClearBufferPool()
+{
+    BufferPool::instance().clear();
+}
+
+BufferPtr CreateBuffer(size_t size, bool async_free, bool prefetch, bool large_pages, int numa_node)
+{
+    TraceScope trace{ TraceEventType::create_buffer, nullptr, (int64_t)size };
+
+    auto& pool = BufferPool::instance();
+    bool pooled = pool.get_capacity() > 0;
+    if (pooled) {
+        size = BufferPool::size_class(size);
+    }
+
+    auto align = [](size_t size, size_t alignment) { return (size + alignment - 1) & ~(alignment - 1); };
+    char* ptr = nullptr;
+    bool hit = false;
+    BufferPool::Key key;
+    key.numa_node = numa_node;
+
+    // try large pages first, and fallback to normal pages if failed.
+    // large pages are non-pageable and committed on allocation. prefetch is not needed.
+    if (large_pages && GetLargePageSize()) {
+        key.size = align(size, GetLargePageSize());
+        key.large_pages = true;
+        if (pooled) {
+            ptr = pool.acquire(key);
+            hit = ptr != nullptr;
+        }
+        if (!ptr) {
+            ptr = AllocateMemory(key.size, true, numa_node);
+        }
+        if (ptr) {
+            prefetch = false;
+        }
+    }
+    if (!ptr) {
+        key.size = align(size, GetPageSize());
+        key.large_pages = false;
+        if (pooled) {
+            ptr = pool.acquire(key);
+            if (ptr) {
+                // pooled buffers are already committed.
+                prefetch = false;
+                hit = true;
+            }
+        }
+        if (!ptr) {
+            ptr = AllocateMemory(key.size, false, numa_node);
+        }
+    }
+    size = key.size;
+    if (pooled) {
+        ++(hit ? g_stat_buffer_pool_hits : g_stat_buffer_pool_misses);
+    }
+
+    if (!ptr) {
+        // shared_ptr calls the deleter even for null. an empty BufferPtr has none.
+        return {};
+    }
+    if (prefetch) {
+        PrefetchMemory(ptr, size);
+    }
+
+    if (pooled) {
+        struct PooledBufferDeleter
+        {
+            BufferPool::Key key;
+            bool async_free;
+
+            void operator()(char* p) const {
+                if (BufferPool::instance().release(p, key)) {
+                    return;
+                }
+                if (async_free) {
+                    RunAsync([p, size = key.size]() {
+                        DS_PROFILE_SCOPE("AsyncBufferDeleter");
+                        FreeMemory(p, size);
+                        });
+                }
+                else {
+                    DS_PROFILE_SCOPE("BufferDeleter");
+                    FreeMemory(p, key.size);
+                }
+            }
+        };
+        return BufferPtr(ptr, PooledBufferDeleter{ key, async_free });
+    }
+    else if (async_free) {
+        struct AsyncBufferDeleter
+        {
+            size_t size;
+
+            void operator()(char* p) const {
+                RunAsync([p, size = size]() {
+                    DS_PROFILE_SCOPE("AsyncBufferDeleter");
+                    FreeMemory(p, size);
+                    });
+            }
+        };
+        return BufferPtr(ptr, AsyncBufferDeleter{ size });
+    }
+    else {
+        struct BufferDeleter
+        {
+            size_t size;
+
+            void operator()(char* p) const {
+                DS_PROFILE_SCOPE("BufferDeleter");
+                FreeMemory(p, size);
+            }
+        };
+        return BufferPtr(ptr, BufferDeleter{ size });
+    }
+}
+
+#pragma endregion Misc
+
+
+#ifdef _WIN32
+#pragma region CompletionReactor
+
+// one library-owned thread waits for completion of all streams.
+// instead of a thread and an event per block for each stream, all fences signal one auto-reset event,
+// and streams are woken only when their blocks are done.
+class CompletionReactor
+{
+public:
+    static CompletionReactor& instance()
+    {
+        static CompletionReactor s_instance;
+        return s_instance;
+    }
+
+    void watch(std::shared_ptr<CompletionTarget> target)
+    {
+        {
+            std::unique_lock lock{ mutex_ };
+            added_.push_back(std::move(target));
+        }
+        ::SetEvent(wake_.get());
+    }
+
+private:
+    CompletionReactor()
+    {
+        wake_.reset(::CreateEvent(nullptr, FALSE, FALSE, nullptr));
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~CompletionReactor()
+    {
+        stop_ = true;
+        ::SetEvent(wake_.get());
+        thread_.join();
+    }
+
+    void run()
+    {
+        using clock = std::chrono::steady_clock;
+        constexpr auto min_window = std::chrono::milliseconds(50);
+
+        std::vector<std::shared_ptr<CompletionTarget>> targets;
+        clock::time_point window_start;
+        uint64_t window_bytes = 0;
+        while (!stop_) {
+            ::WaitForSingleObject(wake_.get(), INFINITE);
+
+            DS_PROFILE_SCOPE("CompletionReactor::run()");
+            {
+                std::unique_lock lock{ mutex_ };
+                if (targets.empty() && !added_.empty()) {
+                    // idle -> busy. idle time is not counted for throughput.
+                    window_start = clock::now();
+                    window_bytes = 0;
+                }
+                targets.insert(targets.end(), added_.begin(), added_.end());
+                added_.clear();
+            }
+            uint64_t landed = 0;
+            std::erase_if(targets, [&](auto& t) { return t->update(wake_.get(), landed); });
+
+            window_bytes += landed;
+            auto now = clock::now();
+            if (now - window_start >= min_window || (targets.empty() && window_bytes > 0)) {
+                double elapsed = std::chrono::duration<double>(now - window_start).count();
+                if (window_bytes > 0 && elapsed > 0.0) {
+                    UpdateThroughput(window_bytes / elapsed);
+                }
+                window_start = now;
+                window_bytes = 0;
+            }
+        }
+    }
+
+    ScopedHandle wake_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<CompletionTarget>> added_;
+    std::atomic_bool stop_{ false };
+};
+
+#pragma endregion CompletionReactor
+#endif // _WIN32
+
+
+#pragma region FileCache
+
+#ifdef _WIN32
+bool FileCache::probe(const path_type& path, FileInfo& dst)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr{};
+    if (!::GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attr) || (attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return false;
+    }
+    dst.size = (uint64_t(attr.nFileSizeHigh) << 32) | attr.nFileSizeLow;
+    dst.last_write_time = (uint64_t(attr.ftLastWriteTime.dwHighDateTime) << 32) | attr.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+#endif // _WIN32
+
+void SetFileCacheCapacity(size_t count, bool validate)
+{
+    FileCache::instance().set_capacity(count, validate);
+}
+
+size_t GetFileCacheCapacity()
+{
+    return FileCache::instance().get_capacity();
+}
+
+void ClearFileCache()
+{
+    FileCache::instance().clear();
+}
+
+#pragma endregion FileCache
+
+
+#pragma region DStorageStreamBuf
+
+#ifdef _WIN32
+// Win32 fallback when DirectStorage is not available (or forced by DStorageStream::force_overlapped_io()).
+// files are opened with FILE_FLAG_OVERLAPPED (and FILE_FLAG_NO_BUFFERING if possible), and each stream keeps
+// multiple reads outstanding. one library-owned thread waits for completion of all streams on an IOCP.
+// streams are also kicked through the port (null OVERLAPPED) to start reading and to cancel.
+class OverlappedEngine
+{
+public:
+    using PImplPtr = std::shared_ptr<DStorageStreamBuf::PImpl>;
+
+    static OverlappedEngine& instance()
+    {
+        static OverlappedEngine s_instance;
+        return s_instance;
+    }
+
+    // m->handle_ must be opened with FILE_FLAG_OVERLAPPED
+    void push(PImplPtr m)
+    {
+        if (!::CreateIoCompletionPort(m->handle_.get(), iocp_.get(), (ULONG_PTR)m.get(), 0)) {
+            {
+                std::unique_lock lock{ m->mutex_ };
+                m->error_ = { HRESULT_FROM_WIN32(::GetLastError()), 0, 0 };
+            }
+            m->handle_.reset();
+            m->finish(DStorageStreamBuf::status_code::error_file_open_failed);
+            return;
+        }
+        m->requests_.resize(m->blocks_.size());
+        auto* key = m.get();
+        {
+            std::unique_lock lock{ mutex_ };
+            active_.emplace(key, std::move(m));
+        }
+        kick(key);
+    }
+
+    // ignored if the stream is not pushed yet or already finished
+    void kick(DStorageStreamBuf::PImpl* m)
+    {
+        ::PostQueuedCompletionStatus(iocp_.get(), 0, (ULONG_PTR)m, nullptr);
+    }
+
+private:
+    OverlappedEngine()
+    {
+        iocp_.reset(::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1));
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~OverlappedEngine()
+    {
+        ::PostQueuedCompletionStatus(iocp_.get(), 0, 0, nullptr);
+        thread_.join();
+    }
+
+    void run()
+    {
+        for (;;) {
+            DWORD bytes = 0;
+            ULONG_PTR key = 0;
+            OVERLAPPED* ov = nullptr;
+            BOOL ok = ::GetQueuedCompletionStatus(iocp_.get(), &bytes, &key, &ov, INFINITE);
+            DWORD error = ok ? ERROR_SUCCESS : ::GetLastError();
+            if (!ov && (!ok || key == 0)) {
+                break; // stop requested
+            }
+
+            DS_PROFILE_SCOPE("OverlappedEngine::run()");
+            PImplPtr m;
+            {
+                std::unique_lock lock{ mutex_ };
+                auto it = active_.find((DStorageStreamBuf::PImpl*)key);
+                if (it == active_.end()) {
+                    continue;
+                }
+                m = it->second;
+            }
+            if (ov) {
+                m->on_read(ov, bytes, error);
+            }
+            if (m->pump()) {
+                std::unique_lock lock{ mutex_ };
+                active_.erase(m.get());
+            }
+        }
+    }
+
+    ScopedHandle iocp_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::unordered_map<DStorageStreamBuf::PImpl*, PImplPtr> active_; // keeps streams alive while reading
+};
+
+// split ranges into blocks of staging buffer size. empty ranges means the whole file.
+bool DStorageStreamBuf::PImpl::build_blocks(std::span<const range> ranges, uint64_t file_size)
+{
+    range whole{ 0, file_size, 0 };
+    if (ranges.empty()) {
+        ranges = { &whole, 1 };
+    }
+
+    // with adaptive request sizing, requests start small for fast first block and grow up to max_request_size.
+    uint32_t max_request_size = g_ds_staging_buffer_size;
+    uint32_t request_size = max_request_size;
+    if (overlapped_) {
+        // smaller requests to keep multiple reads outstanding
+        max_request_size = request_size = std::min(max_request_size, g_ov_request_size);
+    }
+    else if (g_ds_adaptive) {
+        if (uint32_t tuned = g_ds_max_request_size.load()) {
+            max_request_size = std::min(tuned, max_request_size);
+        }
+        request_size = std::min(g_ds_first_request_size, max_request_size);
+    }
+
+    uint64_t buffer_pos = 0;
+    uint64_t buffer_size = 0;
+    uint64_t request_total = 0;
+    for (const range& r : ranges) {
+        if (r.file_offset + r.size > file_size) {
+            return false;
+        }
+        if (r.buffer_offset != range::packed) {
+            buffer_pos = r.buffer_offset;
+        }
+
+        uint64_t remain = r.size;
+        uint64_t progress = 0;
+        while (remain > 0) {
+            uint32_t read_size = (uint32_t)std::min<uint64_t>(request_size, remain);
+            request_size = (uint32_t)std::min<uint64_t>(uint64_t(request_size) * 2, max_request_size);
+            request_total += read_size;
+
+            Block block;
+            block.file_offset = r.file_offset + progress;
+            block.buffer_offset = buffer_pos + progress;
+            block.size = read_size;
+            block.source_size = read_size;
+            block.fence_value = request_total;
+            blocks_.push_back(block);
+
+            remain -= read_size;
+            progress += read_size;
+        }
+        buffer_pos += r.size;
+        buffer_size = std::max(buffer_size, buffer_pos);
+    }
+    file_size_ = buffer_size;
+    return true;
+}
+
+// read the header and the chunk table of compressed file, and make one block per chunk.
+DStorageStreamBuf::status_code DStorageStreamBuf::PImpl::build_compressed_blocks(uint64_t file_size)
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::PImpl::build_compressed_blocks()");
+
+    // header and chunk table are read from the mapped pack file, or by ReadFile()
+    CompressedFileHeader header{};
+    std::vector<CompressedChunk> chunks;
+    auto validate_header = [&]() {
+        // DirectStorage requires uncompressed size of a request to fit in the staging buffer.
+        return header.magic == CompressedFileHeader::magic_value && header.version == CompressedFileHeader::current_version &&
+            header.chunk_size != 0 && header.chunk_size <= g_ds_staging_buffer_size;
+    };
+    if (pack_) {
+        const char* src = (const char*)pack_->mmap_.data() + pack_offset_;
+        if (pack_offset_ + sizeof(header) > file_size) {
+            return status_code::error_invalid_format;
+        }
+        std::memcpy(&header, src, sizeof(header));
+        if (!validate_header() || pack_offset_ + sizeof(header) + sizeof(CompressedChunk) * header.chunk_count > file_size) {
+            return status_code::error_invalid_format;
+        }
+        chunks.resize(header.chunk_count);
+        std::memcpy(chunks.data(), src + sizeof(header), sizeof(CompressedChunk) * chunks.size());
+    }
+    else {
+        ScopedHandle file(::CreateFileW(path_.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL));
+        if (!file) {
+            return status_code::error_file_open_failed;
+        }
+
+        DWORD read = 0;
+        if (!::ReadFile(file.get(), &header, sizeof(header), &read, nullptr) || read != sizeof(header) || !validate_header()) {
+            return status_code::error_invalid_format;
+        }
+
+        chunks.resize(header.chunk_count);
+        DWORD table_size = DWORD(sizeof(CompressedChunk) * chunks.size());
+        if (!::ReadFile(file.get(), chunks.data(), table_size, &read, nullptr) || read != table_size) {
+            return status_code::error_invalid_format;
+        }
+    }
+
+    uint64_t buffer_pos = 0;
+    uint64_t request_total = 0;
+    blocks_.reserve(chunks.size());
+    for (const CompressedChunk& chunk : chunks) {
+        if (pack_offset_ + chunk.offset + chunk.size > file_size || buffer_pos >= header.uncompressed_size) {
+            return status_code::error_invalid_format;
+        }
+        request_total += chunk.size;
+
+        Block block;
+        block.file_offset = pack_offset_ + chunk.offset;
+        block.buffer_offset = buffer_pos;
+        block.size = (uint32_t)std::min<uint64_t>(header.chunk_size, header.uncompressed_size - buffer_pos);
+        block.source_size = chunk.size;
+        block.compression = (uint8_t)chunk.format;
+        block.fence_value = request_total;
+        blocks_.push_back(block);
+
+        buffer_pos += block.size;
+    }
+    if (buffer_pos != header.uncompressed_size) {
+        return status_code::error_invalid_format;
+    }
+    file_size_ = header.uncompressed_size;
+    return status_code::idle;
+}
+
+// small files are read by ReadFile() on the calling thread.
+// for them, OpenFile() / fence / Submit() of DirectStorage cost much more than the transfer itself.
+bool DStorageStreamBuf::PImpl::is_small() const
+{
+    return destination_ == destination::memory && !(mode_ & compressed) && file_size_ <= g_ds_small_file_threshold;
+}
+
+// FILE_FLAG_NO_BUFFERING requires sector-aligned offsets, sizes and addresses.
+// the last block of the file is read with the size rounded up, which fits in the page-aligned buffer of CreateBuffer().
+bool DStorageStreamBuf::PImpl::can_read_unbuffered() const
+{
+    if (user_buffer_ || g_ds_config.ForceFileBuffering) {
+        return false;
+    }
+    for (const Block& b : blocks_) {
+        bool aligned = b.file_offset % g_sector_size == 0 && b.buffer_offset % g_sector_size == 0;
+        bool tail = b.file_offset + b.size == file_size_on_disk_ && b.buffer_offset + b.size == file_size_;
+        if (!aligned || (b.size % g_sector_size != 0 && !tail)) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif // _WIN32
+
+// streaming mode needs a whole-file read to owned memory. slots are of the largest block, and files that fit in the ring
+// are read as usual.
+void DStorageStreamBuf::PImpl::setup_streaming()
+{
+    uint64_t slot_size = 0;
+    for (const Block& b : blocks_) {
+        slot_size = std::max<uint64_t>(slot_size, b.size);
+    }
+    slot_size = (slot_size + g_sector_size - 1) & ~(g_sector_size - 1);
+    if (slot_size * g_ds_streaming_ring_size < file_size_) {
+        streaming_ = true;
+        ring_slots_ = g_ds_streaming_ring_size;
+        slot_size_ = slot_size;
+    }
+}
+
+#ifdef _WIN32
+DStorageStreamBuf::status_code DStorageStreamBuf::PImpl::read_small()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::PImpl::read_small()");
+
+    if (pack_) {
+        // just copy from the mapped pack file
+        const char* src = (const char*)pack_->mmap_.data();
+        for (size_t i = 0; i < blocks_.size(); ++i) {
+            const Block& block = blocks_[i];
+            std::memcpy(buf_.get() + block.buffer_offset, src + block.file_offset, block.size);
+            record_landed(block.size);
+            landed_.push_back((uint32_t)i);
+            done_[i] = true;
+            completed_blocks_ = i + 1;
+            if (on_block_) {
+                on_block_(get_block(i));
+            }
+        }
+        if (verify_) {
+            hash_blocks(0, blocks_.size());
+            return check_checksum() ? status_code::completed : status_code::error_checksum_mismatch;
+        }
+        return status_code::completed;
+    }
+
+    ScopedHandle file(::CreateFileW(path_.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL));
+    if (!file) {
+        error_ = { HRESULT_FROM_WIN32(::GetLastError()), 0, 0 };
+        return status_code::error_file_open_failed;
+    }
+
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        const Block& block = blocks_[i];
+        OVERLAPPED ov{};
+        ov.Offset = DWORD(block.file_offset);
+        ov.OffsetHigh = DWORD(block.file_offset >> 32);
+        DWORD read = 0;
+        if (!::ReadFile(file.get(), buf_.get() + block.buffer_offset, block.size, &read, &ov) || read != block.size) {
+            HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+            error_ = { FAILED(hr) ? hr : E_FAIL, block.file_offset, block.size };
+            return status_code::error_read_failed;
+        }
+
+        // no other threads see this stream yet. no need to lock.
+        record_landed(block.size);
+        landed_.push_back((uint32_t)i);
+        done_[i] = true;
+        completed_blocks_ = i + 1;
+        if (on_block_) {
+            on_block_(get_block(i));
+        }
+    }
+    if (verify_) {
+        hash_blocks(0, blocks_.size());
+        return check_checksum() ? status_code::completed : status_code::error_checksum_mismatch;
+    }
+    return status_code::completed;
+}
+
+HRESULT DStorageStreamBuf::PImpl::open_file()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::PImpl::open_file()");
+
+    if (cancel_requested_) {
+        finish(status_code::cancelled);
+        return E_ABORT;
+    }
+    if (overlapped_) {
+        HRESULT hr = S_OK;
+        {
+            TraceScope trace{ TraceEventType::open_file, this };
+            uint64_t begin = NowNS();
+            DWORD flags = FILE_FLAG_OVERLAPPED | (unbuffered_ ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN);
+            handle_.reset(::CreateFileW(path_.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, flags, NULL));
+            if (!handle_) {
+                hr = HRESULT_FROM_WIN32(::GetLastError());
+            }
+            open_file_ns_ = NowNS() - begin;
+        }
+        if (FAILED(hr)) {
+            {
+                std::unique_lock lock{ mutex_ };
+                error_ = { hr, 0, 0 };
+            }
+            finish(status_code::error_file_open_failed);
+        }
+        return hr;
+    }
+    if (file_) {
+        // taken from FileCache
+        return S_OK;
+    }
+
+    // OpenFile() to large file may take long.
+    HRESULT hr;
+    {
+        TraceScope trace{ TraceEventType::open_file, this };
+        uint64_t begin = NowNS();
+        hr = g_ds_factory->OpenFile(path_.c_str(), IID_PPV_ARGS(file_.put()));
+        open_file_ns_ = NowNS() - begin;
+    }
+    if (FAILED(hr)) {
+        {
+            std::unique_lock lock{ mutex_ };
+            error_ = { hr, 0, 0 };
+        }
+        finish(status_code::error_file_open_failed);
+    }
+    else {
+        FileCache::instance().store(path_, { file_size_on_disk_, file_time_, file_ });
+    }
+    return hr;
+}
+
+bool DStorageStreamBuf::PImpl::enqueue_requests()
+{
+    if (cancel_requested_) {
+        finish(status_code::cancelled);
+        return false;
+    }
+    QueueSlot* slot = GetQueue(get_priority(mode_));
+    if (!slot) {
+        finish(status_code::error_unknown);
+        return false;
+    }
+    // status array is per stream so that failures of other streams on the same queue are not reported to this.
+    HRESULT hr = g_ds_factory->CreateStatusArray((uint32_t)blocks_.size(), nullptr, IID_PPV_ARGS(status_.put()));
+    if (FAILED(hr)) {
+        {
+            std::unique_lock lock{ mutex_ };
+            error_ = { hr, 0, 0 };
+        }
+        finish(status_code::error_unknown);
+        return false;
+    }
+    queue_ = slot->queue;
+    fence_ = slot->fence;
+    fence_base_ = slot->fence_value;
+
+    // counted before enqueueing because requests may complete before this returns.
+    uint64_t request_bytes = 0;
+    for (const Block& block : blocks_) {
+        request_bytes += block.source_size;
+    }
+    g_stat_inflight_requests += blocks_.size();
+    g_stat_inflight_bytes += request_bytes;
+
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        const Block& block = blocks_[i];
+        DSTORAGE_REQUEST request = {};
+        request.Options.CompressionFormat = (DSTORAGE_COMPRESSION_FORMAT)block.compression;
+        request.Options.SourceType = DSTORAGE_REQUEST_SOURCE_FILE;
+        request.Source.File.Source = file_.get();
+        request.Source.File.Offset = block.file_offset;
+        request.Source.File.Size = block.source_size;
+        request.UncompressedSize = block.size;
+        request.CancellationTag = tag();
+        switch (destination_) {
+        case destination::memory:
+            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MEMORY;
+            request.Destination.Memory.Buffer = buf_.get() + block.buffer_offset;
+            request.Destination.Memory.Size = block.size;
+            break;
+        case destination::buffer:
+            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_BUFFER;
+            request.Destination.Buffer.Resource = resource_.get();
+            request.Destination.Buffer.Offset = resource_offset_ + block.buffer_offset;
+            request.Destination.Buffer.Size = block.size;
+            break;
+        case destination::texture_region:
+            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_TEXTURE_REGION;
+            request.Destination.Texture.Resource = resource_.get();
+            request.Destination.Texture.SubresourceIndex = region_.subresource;
+            request.Destination.Texture.Region = { region_.left, region_.top, region_.front, region_.right, region_.bottom, region_.back };
+            break;
+        case destination::multiple_subresources:
+            request.Options.DestinationType = DSTORAGE_REQUEST_DESTINATION_MULTIPLE_SUBRESOURCES;
+            request.Destination.MultipleSubresources.Resource = resource_.get();
+            request.Destination.MultipleSubresources.FirstSubresource = region_.subresource;
+            break;
+        }
+        queue_->EnqueueRequest(&request);
+        queue_->EnqueueStatus(status_.get(), (uint32_t)i);
+        queue_->EnqueueSignal(fence_.get(), fence_base_ + block.fence_value);
+    }
+    slot->fence_value = fence_base_ + blocks_.back().fence_value;
+    state_ = status_code::reading;
+    submit_ns_ = elapsed();
+    Trace(TraceEventType::submit, TracePhase::instant, this, (int64_t)blocks_.size());
+    return true;
+}
+
+void DStorageStreamBuf::PImpl::cancel()
+{
+    cancel_requested_ = true;
+
+    if (overlapped_) {
+        OverlappedEngine::instance().kick(this);
+        return;
+    }
+
+    // exclusive with enqueue_requests(). if requests are not enqueued yet, Submitter will see cancel_requested_ and skip them.
+    std::unique_lock lock{ g_ds_mutex };
+    if (queue_ && is_busy(state_.load())) {
+        // cancelled requests still signal the fence and the status array, so completion is handled as usual.
+        queue_->CancelRequestsWithTag(~0ull, tag());
+    }
+}
+
+bool DStorageStreamBuf::PImpl::update(HANDLE wake_event, uint64_t& landed_bytes)
+{
+    // signals are processed in order. so, all blocks with fence value <= completed value are done.
+    // with DirectStorage, completion order is always the same as the block order.
+    // the fence is shared with the other streams of the same priority. it may not have reached our base yet.
+    uint64_t fence_value = fence_->GetCompletedValue();
+    if (fence_value < fence_base_) {
+        if (armed_block_ != 0) {
+            armed_block_ = 0;
+            fence_->SetEventOnCompletion(fence_base_ + blocks_[0].fence_value, wake_event);
+        }
+        return false;
+    }
+    uint64_t completed = fence_value - fence_base_;
+    size_t prev = completed_blocks_.load();
+    size_t n = prev;
+    while (n < blocks_.size() && blocks_[n].fence_value <= completed) {
+        ++n;
+    }
+
+    if (n != prev) {
+        uint64_t bytes = 0;
+        {
+            std::unique_lock lock{ mutex_ };
+            for (size_t i = prev; i < n; ++i) {
+                landed_.push_back((uint32_t)i);
+                done_[i] = true;
+                bytes += blocks_[i].source_size;
+
+                HRESULT hr = status_->GetHResult((uint32_t)i);
+                if (FAILED(hr) && SUCCEEDED(error_.hresult)) {
+                    error_ = { hr, blocks_[i].file_offset, blocks_[i].source_size };
+                }
+            }
+            completed_blocks_ = n;
+        }
+        landed_bytes += bytes;
+        g_stat_inflight_requests -= n - prev;
+        g_stat_inflight_bytes -= bytes;
+        record_landed(bytes);
+        if (on_block_ && !cancel_requested_) {
+            for (size_t i = prev; i < n; ++i) {
+                on_block_(get_block(i));
+            }
+        }
+        if (verify_) {
+            // hash on a worker thread to keep the reactor responsive. the task wakes the reactor when done.
+            // the reactor keeps this alive until update() returns true, which waits for the task.
+            ++hash_pending_;
+            concurrency::create_task([this, prev, n, wake_event]() {
+                hash_blocks(prev, n);
+                --hash_pending_;
+                ::SetEvent(wake_event);
+                });
+        }
+    }
+
+    if (n == blocks_.size()) {
+        if (hash_pending_.load() != 0) {
+            if (n != prev) {
+                notify();
+            }
+            return false;
+        }
+        if (FAILED(error_.hresult)) {
+            finish(cancel_requested_ ? status_code::cancelled : status_code::error_read_failed);
+        }
+        else if (verify_ && !check_checksum()) {
+            finish(status_code::error_checksum_mismatch);
+        }
+        else {
+            finish(status_code::completed);
+        }
+        return true;
+    }
+    if (n != prev) {
+        notify();
+    }
+    if (armed_block_ != n) {
+        // if the value is already reached, the event is signaled immediately.
+        armed_block_ = n;
+        fence_->SetEventOnCompletion(fence_base_ + blocks_[n].fence_value, wake_event);
+    }
+    return false;
+}
+#endif // _WIN32
+
+void DStorageStreamBuf::PImpl::hash_blocks(size_t first, size_t last)
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::PImpl::hash_blocks()");
+
+    for (size_t i = first; i < last; ++i) {
+        const Block& b = blocks_[i];
+        block_checksums_[i] = Crc32c(block_data(i), b.size);
+    }
+}
+
+bool DStorageStreamBuf::PImpl::check_checksum()
+{
+    uint32_t crc = 0;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        crc = Crc32cCombine(crc, block_checksums_[i], blocks_[i].size);
+    }
+    checksum_ = crc;
+    std::unique_lock lock{ mutex_ };
+    return verify_checksum_locked();
+}
+
+bool DStorageStreamBuf::PImpl::verify_checksum_locked()
+{
+    if (!has_expected_checksum_ || checksum_ == expected_checksum_) {
+        return true;
+    }
+#ifdef _WIN32
+    error_ = { HRESULT_FROM_WIN32(ERROR_CRC), 0, file_size_ };
+#else
+    error_ = { -EBADMSG, 0, file_size_ };
+#endif
+    return false;
+}
+
+void DStorageStreamBuf::PImpl::finish(status_code state)
+{
+    // finish() is only called on launched streams
+    --g_stat_open_streams;
+    {
+        std::unique_lock lock{ mutex_ };
+        if (state == status_code::completed && verify_ && !verify_checksum_locked()) {
+            // set_expected_checksum() was called after check_checksum()
+            state = status_code::error_checksum_mismatch;
+        }
+        record_finish(state);
+        state_ = state;
+    }
+    notify();
+}
+
+void DStorageStreamBuf::PImpl::record_landed(uint64_t bytes)
+{
+    g_stat_total_bytes += bytes;
+    if (bytes_.fetch_add(bytes) == 0 && bytes > 0) {
+        first_block_ns_ = elapsed();
+        Trace(TraceEventType::first_block, TracePhase::instant, this);
+    }
+}
+
+void DStorageStreamBuf::PImpl::record_finish(status_code state)
+{
+    total_ns_ = elapsed();
+    ++g_stat_total_streams;
+    if (state == status_code::cancelled) {
+        ++g_stat_cancelled;
+    }
+    else if (state < status_code::idle) {
+        ++g_stat_errors;
+    }
+    Trace(TraceEventType::complete, TracePhase::instant, this, (int64_t)state);
+}
+
+#ifdef _WIN32
+void DStorageStreamBuf::PImpl::on_read(OVERLAPPED* ov, DWORD bytes, DWORD error)
+{
+    size_t i = size_t(ov - requests_.data());
+    const Block& b = blocks_[i];
+    --outstanding_;
+    --g_stat_inflight_requests;
+    g_stat_inflight_bytes -= b.size;
+
+    // unbuffered reads of the last block may return more than the block size. fewer means the file was truncated.
+    if (error != ERROR_SUCCESS || bytes < b.size) {
+        HRESULT hr = HRESULT_FROM_WIN32(error != ERROR_SUCCESS ? error : ERROR_HANDLE_EOF);
+        std::unique_lock lock{ mutex_ };
+        if (SUCCEEDED(error_.hresult)) {
+            error_ = { hr, b.file_offset, b.size };
+        }
+        io_failed_ = true;
+        return;
+    }
+
+    if (verify_) {
+        hash_blocks(i, i + 1);
+    }
+    {
+        // reads complete out of order. completed_blocks_ advances over the contiguous completed prefix.
+        std::unique_lock lock{ mutex_ };
+        landed_.push_back((uint32_t)i);
+        done_[i] = true;
+        size_t n = completed_blocks_.load();
+        while (n < blocks_.size() && done_[n]) {
+            ++n;
+        }
+        completed_blocks_ = n;
+    }
+    record_landed(b.size);
+    notify();
+    if (on_block_ && !cancel_requested_) {
+        on_block_(get_block(i));
+    }
+}
+
+bool DStorageStreamBuf::PImpl::pump()
+{
+    if (cancel_requested_ || io_failed_) {
+        // outstanding reads complete with ERROR_OPERATION_ABORTED
+        if (outstanding_ > 0 && !cancel_issued_) {
+            ::CancelIoEx(handle_.get(), nullptr);
+            cancel_issued_ = true;
+        }
+    }
+    else {
+        bool first = next_request_ == 0;
+        // in streaming mode, the slot of the next block may still be in use by the consumer. release_blocks() kicks the engine.
+        size_t issuable = streaming_ ? std::min(blocks_.size(), released_blocks_.load() + ring_slots_) : blocks_.size();
+        while (outstanding_ < g_ov_queue_depth && next_request_ < issuable) {
+            size_t i = next_request_++;
+            const Block& b = blocks_[i];
+            OVERLAPPED& ov = requests_[i];
+            ov = {};
+            ov.Offset = DWORD(b.file_offset);
+            ov.OffsetHigh = DWORD(b.file_offset >> 32);
+            DWORD read_size = unbuffered_ ? DWORD((b.size + g_sector_size - 1) & ~(g_sector_size - 1)) : b.size;
+
+            ++g_stat_inflight_requests;
+            g_stat_inflight_bytes += b.size;
+            // completion is queued to the port even if ReadFile() completes synchronously
+            if (!::ReadFile(handle_.get(), block_data(i), read_size, nullptr, &ov) && ::GetLastError() != ERROR_IO_PENDING) {
+                HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+                --g_stat_inflight_requests;
+                g_stat_inflight_bytes -= b.size;
+                {
+                    std::unique_lock lock{ mutex_ };
+                    error_ = { hr, b.file_offset, b.size };
+                }
+                io_failed_ = true;
+                return pump();
+            }
+            ++outstanding_;
+        }
+        if (first && next_request_ > 0) {
+            state_ = status_code::reading;
+            submit_ns_ = elapsed();
+            Trace(TraceEventType::submit, TracePhase::instant, this, (int64_t)blocks_.size());
+        }
+    }
+
+    if (outstanding_ > 0 || (next_request_ < blocks_.size() && !cancel_requested_ && !io_failed_)) {
+        return false;
+    }
+    handle_.reset();
+    if (completed_blocks_.load() != blocks_.size()) {
+        finish(cancel_requested_ ? status_code::cancelled : status_code::error_read_failed);
+    }
+    else if (verify_ && !check_checksum()) {
+        finish(status_code::error_checksum_mismatch);
+    }
+    else {
+        finish(status_code::completed);
+    }
+    return true;
+}
+#endif // _WIN32
+
+// wait until any block after `current` is completed or reading is finished. returns number of completed blocks.
+size_t DStorageStreamBuf::PImpl::wait_blocks(size_t current)
+{
+    if (completed_blocks_.load() > current || !is_busy(state_.load())) {
+        return completed_blocks_.load();
+    }
+    std::unique_lock lock{ mutex_ };
+    cond_.wait(lock, [&]() { return completed_blocks_.load() > current || !is_busy(state_.load()); });
+    return completed_blocks_.load();
+}
+
+// take the next block in completion order that is not reported yet.
+bool DStorageStreamBuf::PImpl::next_landed(block& dst, bool wait)
+{
+    std::unique_lock lock{ mutex_ };
+    if (wait) {
+        cond_.wait(lock, [&]() { return polled_blocks_ < landed_.size() || !is_busy(state_.load()); });
+    }
+    if (polled_blocks_ < landed_.size()) {
+        dst = get_block(landed_[polled_blocks_++]);
+        return true;
+    }
+    return false;
+}
+
+// wait until all blocks overlapping [pos, pos + size) of the buffer are completed.
+bool DStorageStreamBuf::PImpl::wait_range(uint64_t pos, uint64_t size)
+{
+    std::unique_lock lock{ mutex_ };
+    cond_.wait(lock, [&]() { return covered(pos, size) || !is_busy(state_.load()); });
+    return covered(pos, size);
+}
+
+bool DStorageStreamBuf::PImpl::covered(uint64_t pos, uint64_t size) const
+{
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        const Block& b = blocks_[i];
+        if (b.buffer_offset < pos + size && pos < b.buffer_offset + b.size && !done_[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DStorageStreamBuf::PImpl::is_ready(const awaiter& a) const
+{
+    if (!is_busy(state_.load())) {
+        return true;
+    }
+    switch (a.what) {
+    case awaiter::kind::block: return completed_blocks_.load() > a.pos;
+    case awaiter::kind::range: return !buf_ || a.pos >= file_size_ || covered(a.pos, a.size);
+    default: return false;
+    }
+}
+
+// called from the engine (or worker threads) after the state is updated.
+void DStorageStreamBuf::PImpl::notify()
+{
+    cond_.notify_all();
+
+    std::vector<Waiter> ready;
+    {
+        std::unique_lock lock{ mutex_ };
+        auto it = std::partition(waiters_.begin(), waiters_.end(), [&](const Waiter& w) {
+            return !is_ready({ nullptr, w.what, w.pos, w.size, {} });
+            });
+        ready.assign(std::make_move_iterator(it), std::make_move_iterator(waiters_.end()));
+        waiters_.erase(it, waiters_.end());
+    }
+    // outside the lock. resumed coroutines may wait on this stream again.
+    for (Waiter& w : ready) {
+        if (w.exec) {
+            w.exec(w.handle);
+        }
+        else {
+            w.handle.resume();
+        }
+    }
+}
+
+#ifdef _WIN32
+void DStorageStreamBuf::PImpl::release_blocks(size_t n)
+{
+    released_blocks_ = n;
+    if (is_busy(state_.load())) {
+        OverlappedEngine::instance().kick(this);
+    }
+}
+#endif // _WIN32
+
+void DStorageStreamBuf::PImpl::wait_finish()
+{
+    if (!is_busy(state_.load())) {
+        return;
+    }
+    std::unique_lock lock{ mutex_ };
+    cond_.wait(lock, [&]() { return !is_busy(state_.load()); });
+}
+
+
+
+#ifdef _WIN32
+// all EnqueueRequest() / Submit() are done by one library-owned thread.
+// producers just push streams to a lock-free list and never wait for each other,
+// and streams pushed while the submitter is busy are coalesced into one Submit().
+class Submitter
+{
+public:
+    using PImplPtr = std::shared_ptr<DStorageStreamBuf::PImpl>;
+
+    static Submitter& instance()
+    {
+        static Submitter s_instance;
+        return s_instance;
+    }
+
+    void push(PImplPtr target)
+    {
+        push(std::span<PImplPtr>{ &target, 1 });
+    }
+
+    // hand opened streams to the engine that reads them. overlapped streams go to OverlappedEngine.
+    static void dispatch(std::span<PImplPtr> targets)
+    {
+        auto it = std::partition(targets.begin(), targets.end(), [](auto& m) { return !m->overlapped_; });
+        instance().push(std::span<PImplPtr>{ targets.begin(), it });
+        for (; it != targets.end(); ++it) {
+            OverlappedEngine::instance().push(std::move(*it));
+        }
+    }
+
+    void push(std::span<PImplPtr> targets)
+    {
+        if (targets.empty()) {
+            return;
+        }
+        // link nodes in reverse order. the list is reversed again when drained.
+        Node* first = nullptr;
+        Node* last = nullptr;
+        for (auto& t : targets) {
+            Node* n = new Node{ std::move(t), first };
+            if (!last) {
+                last = n;
+            }
+            first = n;
+        }
+
+        Node* head = head_.load(std::memory_order_relaxed);
+        do {
+            last->next = head;
+        } while (!head_.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+
+        // the submitter is woken only if the list was empty. otherwise, it is already woken and will see our nodes.
+        if (!head) {
+            ::SetEvent(wake_.get());
+        }
+    }
+
+private:
+    struct Node
+    {
+        PImplPtr target;
+        Node* next = nullptr;
+    };
+
+    Submitter()
+    {
+        wake_.reset(::CreateEvent(nullptr, FALSE, FALSE, nullptr));
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~Submitter()
+    {
+        stop_ = true;
+        ::SetEvent(wake_.get());
+        thread_.join();
+    }
+
+    void run()
+    {
+        std::vector<PImplPtr> targets;
+        std::vector<IDStorageQueue*> queues;
+        while (!stop_) {
+            ::WaitForSingleObject(wake_.get(), INFINITE);
+
+            DS_PROFILE_SCOPE("Submitter::run()");
+            Node* n = head_.exchange(nullptr, std::memory_order_acquire);
+            for (; n; ) {
+                targets.push_back(std::move(n->target));
+                Node* next = n->next;
+                delete n;
+                n = next;
+            }
+            if (targets.empty()) {
+                continue;
+            }
+            std::reverse(targets.begin(), targets.end()); // to FIFO
+
+            {
+                // g_ds_mutex is only to be exclusive with set_device() / release_device(). not contended.
+                std::unique_lock lock{ g_ds_mutex };
+                std::erase_if(targets, [](auto& m) { return !m->enqueue_requests(); });
+                for (auto& m : targets) {
+                    if (std::find(queues.begin(), queues.end(), m->queue_.get()) == queues.end()) {
+                        queues.push_back(m->queue_.get());
+                    }
+                }
+                for (auto* q : queues) {
+                    q->Submit();
+                }
+            }
+            for (auto& m : targets) {
+                CompletionReactor::instance().watch(std::move(m));
+            }
+            targets.clear();
+            queues.clear();
+        }
+    }
+
+    ScopedHandle wake_;
+    std::thread thread_;
+    std::atomic<Node*> head_{ nullptr };
+    std::atomic_bool stop_{ false };
+};
+
+// OpenFile() is done in a task on the thread pool, requests are enqueued by Submitter,
+// and completion is handled by CompletionReactor (or OverlappedEngine).
+// all targets are opened by one task and pushed to Submitter at once, so they are submitted by one Submit().
+void DStorageStreamBuf::PImpl::start(std::vector<PImplPtr>&& targets)
+{
+    concurrency::create_task([targets = std::move(targets)]() mutable {
+        DS_PROFILE_SCOPE("DStorageStreamBuf: open");
+
+        std::erase_if(targets, [](auto& m) { return FAILED(m->open_file()); });
+        Submitter::dispatch(targets);
+        });
+}
+#endif // _WIN32
+
+
+DStorageStreamBuf::DStorageStreamBuf()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::DStorageStreamBuf()");
+#ifdef _WIN32
+    InitializeDirectStorage();
+#endif
+
+    pimpl_ = std::make_shared<PImpl>();
+}
+
+DStorageStreamBuf::~DStorageStreamBuf()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::~DStorageStreamBuf()");
+    close();
+    pimpl_ = {};
+}
+
+DStorageStreamBuf::DStorageStreamBuf(DStorageStreamBuf&& v) noexcept
+    : DStorageStreamBuf()
+{
+    *this = std::move(v);
+}
+
+DStorageStreamBuf& DStorageStreamBuf::operator=(DStorageStreamBuf&& v) noexcept
+{
+    swap(v);
+    return *this;
+}
+
+void DStorageStreamBuf::swap(DStorageStreamBuf& v) noexcept
+{
+    super::swap(v);
+    std::swap(pimpl_, v.pimpl_);
+}
+
+DStorageStreamBuf::pos_type DStorageStreamBuf::seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode /*mode*/)
+{
+    auto& m = *pimpl_;
+    if (m.streaming_) {
+        return seekoff_streaming(off, dir);
+    }
+    char* head = m.buf_.get();
+    char* tail = head + m.file_size_;
+
+    char* current = this->gptr();
+    if (dir == std::ios::beg)
+        current = head + off;
+    else if (dir == std::ios::cur)
+        current += off;
+    else if (dir == std::ios::end)
+        current = tail - off;
+
+    size_t distance = size_t(std::distance(head, current));
+    while (m.read_size_ < distance) {
+        if (!wait_next_block()) {
+            break;
+        }
+    }
+    current = std::min(current, head + m.read_size_);
+
+    this->setg(current, current, tail);
+    return pos_type(current - head);
+}
+
+// the get area is the current block. seeking backward out of it fails.
+DStorageStreamBuf::pos_type DStorageStreamBuf::seekoff_streaming(off_type off, std::ios::seekdir dir)
+{
+    auto& m = *pimpl_;
+    uint64_t base = m.read_size_ - uint64_t(this->egptr() - this->eback());
+    uint64_t current = base + uint64_t(this->gptr() - this->eback());
+    if (dir == std::ios::beg)
+        current = off;
+    else if (dir == std::ios::cur)
+        current += off;
+    else if (dir == std::ios::end)
+        current = m.file_size_ - off;
+
+    if (current < base || current > m.file_size_) {
+        return pos_type(off_type(-1));
+    }
+    while (m.read_size_ < current) {
+        if (!wait_next_block()) {
+            break;
+        }
+    }
+    current = std::min(current, m.read_size_);
+    base = m.read_size_ - uint64_t(this->egptr() - this->eback());
+
+    this->setg(this->eback(), this->eback() + (current - base), this->egptr());
+    return pos_type(off_type(current));
+}
+
+DStorageStreamBuf::pos_type DStorageStreamBuf::seekpos(pos_type pos, std::ios::openmode mode)
+{
+    return seekoff(pos, std::ios::beg, mode);
+}
+
+// implement our own xsgetn() / xsputn() because std::streambuf can't handle count of > INT_MAX
+// ( https://github.com/microsoft/STL/issues/388 )
+std::streamsize DStorageStreamBuf::xsgetn(char* dst, std::streamsize count)
+{
+    auto& m = *pimpl_;
+    if (!m.buf_) {
+        return 0;
+    }
+    if (m.streaming_) {
+        // block by block through the ring
+        std::streamsize done = 0;
+        while (done < count) {
+            if (this->gptr() == this->egptr() && underflow() == traits_type::eof()) {
+                break;
+            }
+            size_t n = std::min(size_t(count - done), size_t(this->egptr() - this->gptr()));
+            std::memcpy(dst + done, this->gptr(), n);
+            this->setg(this->eback(), this->gptr() + n, this->egptr());
+            done += n;
+        }
+        return done;
+    }
+    char* head = m.buf_.get();
+    char* tail = head + m.read_size_;
+    char* src = this->gptr();
+
+    size_t remain = count;
+    while (remain) {
+        size_t n = std::min(remain, size_t(tail - src));
+        std::memcpy(dst, src, n);
+        dst += n;
+        src += n;
+        remain -= n;
+        this->setg(src, src, tail);
+
+        if (remain) {
+            if (underflow() == traits_type::eof()) {
+                return count - remain;
+            }
+            else {
+                head = m.buf_.get();
+                tail = head + m.read_size_;
+                src = this->gptr();
+            }
+        }
+    }
+    return count;
+}
+
+int DStorageStreamBuf::underflow()
+{
+    if (!pimpl_->buf_) {
+        return traits_type::eof();
+    }
+    while (this->gptr() == this->egptr()) {
+        if (!wait_next_block()) {
+            return traits_type::eof();
+        }
+    }
+    return traits_type::to_int_type(*this->gptr());
+}
+
+int DStorageStreamBuf::get_numa_node(std::ios::openmode mode)
+{
+    return int((mode >> 24) & 0x7f) - 1;
+}
+
+#ifdef _WIN32
+int DStorageStreamBuf::get_priority(std::ios::openmode mode)
+{
+    switch (mode & realtime_priority) {
+    case low_priority: return DSTORAGE_PRIORITY_LOW;
+    case high_priority: return DSTORAGE_PRIORITY_HIGH;
+    case realtime_priority: return DSTORAGE_PRIORITY_REALTIME;
+    default: return DSTORAGE_PRIORITY_NORMAL;
+    }
+}
+
+bool DStorageStreamBuf::prepare(std::wstring&& path, std::span<const range> ranges, std::ios::openmode mode)
+{
+    auto& m = *pimpl_;
+    m.open_time_ = NowNS();
+    TraceScope trace{ TraceEventType::open, &m };
+    ScopeExit on_exit{ [&m]() {
+        status_code state = m.state_.load();
+        if (state == status_code::launched) {
+            ++g_stat_open_streams;
+        }
+        else {
+            // finished (or failed) without going to the worker thread
+            m.record_finish(state);
+        }
+    } };
+    if (m.has_pending_checksum_) {
+        m.has_expected_checksum_ = true;
+        m.expected_checksum_ = m.pending_checksum_;
+        m.has_pending_checksum_ = false;
+    }
+
+    // without DirectStorage, reads to memory fall back to Win32 overlapped I/O.
+    // compressed files need GDeflate of DirectStorage, and GPU destinations need the queue.
+    // streaming mode also goes to overlapped I/O. DirectStorage requests of a stream are enqueued all at once, and the ring
+    // needs each read to wait for its slot.
+    bool want_streaming = (mode & streaming) && ranges.empty() && !m.user_buffer_;
+    m.overlapped_ = (want_streaming || !g_ds_factory || g_ds_force_overlapped) && m.destination_ == PImpl::destination::memory && !(mode & compressed) && !m.pack_;
+    if (!g_ds_factory && !m.overlapped_) {
+        m.state_ = status_code::error_dll_not_found;
+        return false;
+    }
+
+    // IDStorageFactory::OpenFile() can be very slow, so we run it asynchronously. (or skip it if the file is cached)
+    // also, file size can be obtained by IDStorageFile::GetFileInformation() but it requires IDStorageFactory::OpenFile().
+    // therefore, we use GetFileAttributesExW() instead. (which is reasonably fast)
+
+    m.path_ = std::move(path);
+    m.mode_ = mode;
+    {
+        // get file size
+        uint64_t file_size = 0;
+        if (m.pack_) {
+            file_size = m.pack_->mmap_.size();
+            m.file_ = m.pack_->file_;
+        }
+        else {
+            FileCache::FileInfo info;
+            if (!FileCache::instance().query(m.path_, info)) {
+                HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+                m.error_ = { FAILED(hr) ? hr : E_FAIL, 0, 0 };
+                m.state_ = status_code::error_file_open_failed;
+                return false;
+            }
+            file_size = info.size;
+            m.file_size_on_disk_ = info.size;
+            m.file_time_ = info.last_write_time;
+            if (!m.overlapped_) {
+                m.file_ = std::move(info.file);
+            }
+        }
+        m.probe_ns_ = m.elapsed();
+
+        if (m.mode_ & compressed) {
+            // ranges are not supported for compressed file.
+            status_code err = ranges.empty() ? m.build_compressed_blocks(file_size) : status_code::error_out_of_range;
+            if (err != status_code::idle) {
+                m.blocks_.clear();
+                m.state_ = err;
+                return false;
+            }
+        }
+        else if (!m.build_blocks(ranges, file_size)) {
+            m.state_ = status_code::error_out_of_range;
+            return false;
+        }
+        if (m.blocks_.empty()) {
+            m.state_ = status_code::completed;
+            return true;
+        }
+        if (want_streaming && m.overlapped_ && !m.is_small()) {
+            m.setup_streaming();
+        }
+
+        if (m.destination_ == PImpl::destination::memory) {
+            if (m.user_buffer_) {
+                if (m.file_size_ > m.user_buffer_size_) {
+                    m.state_ = status_code::error_out_of_range;
+                    return false;
+                }
+                // caller owns the memory. no-op deleter.
+                m.buf_ = BufferPtr(m.user_buffer_, [](char*) {});
+            }
+            else if (m.is_small()) {
+                // VirtualAlloc() and prefetch are overkill for small buffers
+                m.buf_ = BufferPtr(new char[m.file_size_]);
+            }
+            else {
+                // allocate buffer
+                m.buf_ = CreateBuffer(m.buffer_size(), m.mode_ & async_free, true, m.mode_ & large_pages, get_numa_node(m.mode_));
+            }
+            char* gp = m.buf_.get();
+            this->setg(gp, gp, gp);
+        }
+        else if (m.destination_ != PImpl::destination::buffer && m.blocks_.size() != 1) {
+            // texture requests can't be split. whole data must fit in the staging buffer.
+            m.state_ = status_code::error_out_of_range;
+            return false;
+        }
+        m.done_.resize(m.blocks_.size());
+        m.unbuffered_ = m.overlapped_ && m.can_read_unbuffered();
+        m.verify_ = (m.mode_ & verify) && m.destination_ == PImpl::destination::memory;
+        if (m.verify_) {
+            m.block_checksums_.resize(m.blocks_.size());
+        }
+
+        if (m.is_small()) {
+            m.state_ = m.read_small();
+            if (m.state_.load() != status_code::completed) {
+                return false;
+            }
+            wait_next_block(); // reflect all blocks to read_size() and the get area
+            return true;
+        }
+    }
+    m.state_ = status_code::launched;
+    return true;
+}
+#endif // _WIN32
+
+bool DStorageStreamBuf::open(std::wstring&& path, std::ios::openmode mode)
+{
+    return open(std::move(path), std::span<const range>{}, mode);
+}
+
+bool DStorageStreamBuf::open(std::wstring&& path, std::span<const range> ranges, std::ios::openmode mode)
+{
+    close();
+
+    DS_PROFILE_SCOPE("DStorageStreamBuf::open()");
+
+    if (!prepare(std::move(path), ranges, mode)) {
+        return false;
+    }
+    launch();
+    return true;
+}
+
+bool DStorageStreamBuf::open(std::wstring&& path, void* dst, size_t dst_size, std::span<const range> ranges, std::ios::openmode mode)
+{
+    close();
+
+    DS_PROFILE_SCOPE("DStorageStreamBuf::open()");
+
+    auto& m = *pimpl_;
+    m.user_buffer_ = (char*)dst;
+    m.user_buffer_size_ = dst_size;
+    if (!prepare(std::move(path), ranges, mode)) {
+        return false;
+    }
+    launch();
+    return true;
+}
+
+#ifdef _WIN32
+bool DStorageStreamBuf::open_buffer(std::wstring&& path, ID3D12Resource* dst, uint64_t dst_offset, std::span<const range> ranges, std::ios::openmode mode)
+{
+    close();
+
+    DS_PROFILE_SCOPE("DStorageStreamBuf::open_buffer()");
+
+    auto& m = *pimpl_;
+    m.destination_ = PImpl::destination::buffer;
+    m.resource_.copy_from(dst);
+    m.resource_offset_ = dst_offset;
+    if (!prepare(std::move(path), ranges, mode)) {
+        return false;
+    }
+    launch();
+    return true;
+}
+
+bool DStorageStreamBuf::open_texture(std::wstring&& path, ID3D12Resource* dst, const texture_region& region, std::ios::openmode mode)
+{
+    close();
+
+    DS_PROFILE_SCOPE("DStorageStreamBuf::open_texture()");
+
+    auto& m = *pimpl_;
+    m.destination_ = PImpl::destination::texture_region;
+    m.resource_.copy_from(dst);
+    m.region_ = region;
+    if (!prepare(std::move(path), {}, mode)) {
+        return false;
+    }
+    launch();
+    return true;
+}
+
+bool DStorageStreamBuf::open_subresources(std::wstring&& path, ID3D12Resource* dst, uint32_t first_subresource, std::ios::openmode mode)
+{
+    close();
+
+    DS_PROFILE_SCOPE("DStorageStreamBuf::open_subresources()");
+
+    auto& m = *pimpl_;
+    m.destination_ = PImpl::destination::multiple_subresources;
+    m.resource_.copy_from(dst);
+    m.region_.subresource = first_subresource;
+    if (!prepare(std::move(path), {}, mode)) {
+        return false;
+    }
+    launch();
+    return true;
+}
+#endif // _WIN32
+
+void DStorageStreamBuf::launch()
+{
+    if (pimpl_->state_.load() == status_code::launched) {
+        PImpl::start({ pimpl_ });
+    }
+}
+
+void DStorageStreamBuf::close()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::close()");
+
+    auto& m = *pimpl_;
+    if (PImpl::is_busy(m.state_.load())) {
+        // in-flight requests are cancelled and we don't wait for them.
+        // owned buffer and resources are kept alive by the engine and released when they are done.
+        m.cancel();
+        if (m.has_caller_destination()) {
+            // caller-provided destinations must not be written after close().
+            m.wait_finish();
+        }
+    }
+    block_callback cb = m.on_block_; // copy. the engine may still see the old one.
+    auto prev = std::move(pimpl_);
+    pimpl_ = std::make_shared<PImpl>();
+    pimpl_->on_block_ = std::move(cb);
+    if (prev->has_pending_checksum_) {
+        // set for the coming open()
+        pimpl_->has_pending_checksum_ = true;
+        pimpl_->pending_checksum_ = prev->pending_checksum_;
+    }
+}
+
+void DStorageStreamBuf::cancel()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::cancel()");
+    pimpl_->cancel();
+}
+
+bool DStorageStreamBuf::is_open() const
+{
+    auto& m = *pimpl_;
+    return m.state_.load() >= status_code::launched;
+}
+
+DStorageStreamBuf::status_code DStorageStreamBuf::state() const
+{
+    return pimpl_->state_.load();
+}
+
+DStorageStreamBuf::error_info DStorageStreamBuf::error() const
+{
+    auto& m = *pimpl_;
+    std::unique_lock lock{ m.mutex_ };
+    return m.error_;
+}
+
+bool DStorageStreamBuf::is_complete() const
+{
+    return state() == status_code::completed;
+}
+
+bool DStorageStreamBuf::wait()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::wait()");
+
+    auto& m = *pimpl_;
+    if (m.streaming_) {
+        // cancels the rest as close() does, rather than reading blocks nobody will see.
+        // completed if the consumer has already taken every block.
+        m.cancel();
+        m.wait_finish();
+        m.block_pos_ = m.blocks_.size();
+        this->setg(nullptr, nullptr, nullptr);
+        return m.state_.load() == status_code::completed;
+    }
+    m.wait_finish();
+    while (wait_next_block()) {} // for setg() and advance block_pos_
+    return m.state_.load() == status_code::completed;
+}
+
+bool DStorageStreamBuf::wait_next_block()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::wait_next_block()");
+
+    auto& m = *pimpl_;
+    if (m.state_.load() <= status_code::idle) {
+        return false;
+    }
+    else if (m.streaming_) {
+        // one block at a time. the previous block is released for the engine to reuse its slot.
+        if (m.block_pos_ > 0) {
+            m.release_blocks(m.block_pos_);
+        }
+        if (m.block_pos_ >= m.blocks_.size()) {
+            this->setg(nullptr, nullptr, nullptr);
+            return false;
+        }
+        size_t n;
+        {
+            TraceScope trace{ TraceEventType::wait_next_block, &m, (int64_t)m.block_pos_ };
+            n = m.wait_blocks(m.block_pos_);
+        }
+        if (n <= m.block_pos_) {
+            m.block_pos_ = m.blocks_.size();
+            this->setg(nullptr, nullptr, nullptr);
+            return false;
+        }
+        size_t i = m.block_pos_++;
+        const auto& b = m.blocks_[i];
+        m.read_size_ = b.buffer_offset + b.size;
+        char* gp = m.block_data(i);
+        this->setg(gp, gp, gp + b.size);
+        return true;
+    }
+    else if (m.block_pos_ < m.blocks_.size()) {
+        size_t n;
+        {
+            TraceScope trace{ TraceEventType::wait_next_block, &m, (int64_t)m.block_pos_ };
+            n = m.wait_blocks(m.block_pos_);
+        }
+        if (n <= m.block_pos_) {
+            // failed. no more blocks will come.
+            m.block_pos_ = m.blocks_.size();
+            return false;
+        }
+        m.block_pos_ = n;
+
+        const auto& last = m.blocks_[m.block_pos_ - 1];
+        m.read_size_ = std::max(m.read_size_, last.buffer_offset + last.size);
+
+        if (m.buf_) {
+            char* gp = this->gptr();
+            this->setg(gp, gp, m.buf_.get() + m.read_size_);
+        }
+        return true;
+    }
+    return false;
+}
+
+void DStorageStreamBuf::set_block_callback(block_callback cb)
+{
+    pimpl_->on_block_ = std::move(cb);
+}
+
+bool DStorageStreamBuf::poll_block(block& dst)
+{
+    return pimpl_->next_landed(dst, false);
+}
+
+bool DStorageStreamBuf::wait_any_block(block& dst)
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::wait_any_block()");
+    return pimpl_->next_landed(dst, true);
+}
+
+bool DStorageStreamBuf::awaiter::await_ready() const
+{
+    // range needs the lock. checked in await_suspend().
+    return what != kind::range && buf->pimpl_->is_ready(*this);
+}
+
+bool DStorageStreamBuf::awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    auto& m = *buf->pimpl_;
+    std::unique_lock lock{ m.mutex_ };
+    if (m.is_ready(*this)) {
+        return false; // resume immediately
+    }
+    m.waiters_.push_back({ what, pos, size, h, std::move(exec) });
+    return true;
+}
+
+DStorageStreamBuf::block_awaiter DStorageStreamBuf::next_block(executor exec)
+{
+    return { this, awaiter::kind::block, pimpl_->block_pos_, 0, std::move(exec) };
+}
+
+DStorageStreamBuf::completion_awaiter DStorageStreamBuf::completed(executor exec)
+{
+    return { this, awaiter::kind::finish, 0, 0, std::move(exec) };
+}
+
+DStorageStreamBuf::range_awaiter DStorageStreamBuf::ready(size_t pos, size_t size, executor exec)
+{
+    return { this, awaiter::kind::range, pos, size, std::move(exec) };
+}
+
+void DStorageStreamBuf::set_expected_checksum(uint32_t crc)
+{
+    PImpl& m = *pimpl_;
+    std::unique_lock lock{ m.mutex_ };
+    status_code state = m.state_.load();
+    if (state == status_code::idle) {
+        // takes effect in the next prepare()
+        m.has_pending_checksum_ = true;
+        m.pending_checksum_ = crc;
+        return;
+    }
+    // in flight streams check it in check_checksum() or finish(). finished streams are re-checked here.
+    m.has_expected_checksum_ = true;
+    m.expected_checksum_ = crc;
+    if (state == status_code::completed && m.verify_ && !m.verify_checksum_locked()) {
+        m.state_ = status_code::error_checksum_mismatch;
+    }
+}
+
+uint32_t DStorageStreamBuf::checksum() const
+{
+    return pimpl_->checksum_;
+}
+
+DStorageStreamBuf::stream_stats DStorageStreamBuf::stats() const
+{
+    auto& m = *pimpl_;
+    stream_stats r;
+    r.probe_ns = m.probe_ns_;
+    r.open_file_ns = m.open_file_ns_.load();
+    r.submit_ns = m.submit_ns_.load();
+    r.first_block_ns = m.first_block_ns_.load();
+    r.total_ns = m.total_ns_.load();
+    r.bytes = m.bytes_.load();
+    return r;
+}
+
+std::span<const char> DStorageStreamBuf::view(size_t pos, size_t size)
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::view()");
+
+    auto& m = *pimpl_;
+    if (!m.buf_ || pos >= m.file_size_) {
+        return {};
+    }
+    if (m.streaming_) {
+        // only the current block is in the ring. doesn't wait.
+        uint64_t base = m.read_size_ - uint64_t(this->egptr() - this->eback());
+        if (pos < base || pos >= m.read_size_) {
+            return {};
+        }
+        return { this->eback() + (pos - base), std::min<size_t>(size, m.read_size_ - pos) };
+    }
+    size = std::min<size_t>(size, m.file_size_ - pos);
+    if (!m.wait_range(pos, size)) {
+        return {};
+    }
+    return { m.buf_.get() + pos, size };
+}
+
+const char* DStorageStreamBuf::data() const
+{
+    return pimpl_->streaming_ ? nullptr : pimpl_->buf_.get();
+}
+
+size_t DStorageStreamBuf::file_size() const
+{
+    return pimpl_->file_size_;
+}
+
+size_t DStorageStreamBuf::read_size() const
+{
+    return pimpl_->read_size_;
+}
+
+BufferPtr&& DStorageStreamBuf::extract()
+{
+    return std::move(pimpl_->buf_);
+}
+#pragma endregion DStorageStreamBuf
+
+
+#pragma region DStorageStream
+
+DStorageStream::DStorageStream()
+    : super(&buf_)
+{}
+
+DStorageStream::DStorageStream(DStorageStream&& v) noexcept
+    : DStorageStream()
+{
+    *this = std::move(v);
+}
+
+DStorageStream& DStorageStream::operator=(DStorageStream&& v) noexcept
+{
+    swap(v);
+    return *this;
+}
+
+bool DStorageStream::open(std::string_view path, std::ios::openmode mode)
+{
+    return open(ToWString(path), mode);
+}
+bool DStorageStream::open(const std::wstring& _path, std::ios::openmode mode)
+{
+    std::wstring path = _path;
+    return open(std::move(path), mode);
+}
+bool DStorageStream::open(std::wstring&& path, std::ios::openmode mode)
+{
+    return open(std::move(path), std::span<const range>{}, mode);
+}
+
+bool DStorageStream::open(std::string_view path, std::span<const range> ranges, std::ios::openmode mode)
+{
+    return open(ToWString(path), ranges, mode);
+}
+bool DStorageStream::open(const std::wstring& _path, std::span<const range> ranges, std::ios::openmode mode)
+{
+    std::wstring path = _path;
+    return open(std::move(path), ranges, mode);
+}
+bool DStorageStream::open(std::wstring&& path, std::span<const range> ranges, std::ios::openmode mode)
+{
+    return on_open(buf_.open(std::move(path), ranges, mode));
+}
+
+bool DStorageStream::open(std::string_view path, void* dst, size_t dst_size, std::span<const range> ranges, std::ios::openmode mode)
+{
+    return open(ToWString(path), dst, dst_size, ranges, mode);
+}
+bool DStorageStream::open(const std::wstring& _path, void* dst, size_t dst_size, std::span<const range> ranges, std::ios::openmode mode)
+{
+    std::wstring path = _path;
+    return open(std::move(path), dst, dst_size, ranges, mode);
+}
+bool DStorageStream::open(std::wstring&& path, void* dst, size_t dst_size, std::span<const range> ranges, std::ios::openmode mode)
+{
+    return on_open(buf_.open(std::move(path), dst, dst_size, ranges, mode));
+}
+
+bool DStorageStream::open_buffer(std::string_view path, ID3D12Resource* dst, uint64_t dst_offset, std::span<const range> ranges, std::ios::openmode mode)
+{
+    return open_buffer(ToWString(path), dst, dst_offset, ranges, mode);
+}
+bool DStorageStream::open_buffer(const std::wstring& _path, ID3D12Resource* dst, uint64_t dst_offset, std::span<const range> ranges, std::ios::openmode mode)
+{
+    std::wstring path = _path;
+    return open_buffer(std::move(path), dst, dst_offset, ranges, mode);
+}
+bool DStorageStream::open_buffer(std::wstring&& path, ID3D12Resource* dst, uint64_t dst_offset, std::span<const range> ranges, std::ios::openmode mode)
+{
+    return on_open(buf_.open_buffer(std::move(path), dst, dst_offset, ranges, mode));
+}
+
+bool DStorageStream::open_texture(std::string_view path, ID3D12Resource* dst, const texture_region& region, std::ios::openmode mode)
+{
+    return open_texture(ToWString(path), dst, region, mode);
+}
+bool DStorageStream::open_texture(const std::wstring& _path, ID3D12Resource* dst, const texture_region& region, std::ios::openmode mode)
+{
+    std::wstring path = _path;
+    return open_texture(std::move(path), dst, region, mode);
+}
+bool DStorageStream::open_texture(std::wstring&& path, ID3D12Resource* dst, const texture_region& region, std::ios::openmode mode)
+{
+    return on_open(buf_.open_texture(std::move(path), dst, region, mode));
+}
+
+bool DStorageStream::open_subresources(std::string_view path, ID3D12Resource* dst, uint32_t first_subresource, std::ios::openmode mode)
+{
+    return open_subresources(ToWString(path), dst, first_subresource, mode);
+}
+bool DStorageStream::open_subresources(const std::wstring& _path, ID3D12Resource* dst, uint32_t first_subresource, std::ios::openmode mode)
+{
+    std::wstring path = _path;
+    return open_subresources(std::move(path), dst, first_subresource, mode);
+}
+bool DStorageStream::open_subresources(std::wstring&& path, ID3D12Resource* dst, uint32_t first_subresource, std::ios::openmode mode)
+{
+    return on_open(buf_.open_subresources(std::move(path), dst, first_subresource, mode));
+}
+
+bool DStorageStream::on_open(bool ok)
+{
+    if (ok) {
+        this->clear();
+        return true;
+    }
+    else {
+        this->setstate(std::ios::failbit);
+        return false;
+    }
+}
+
+void DStorageStream::close()
+{
+    return buf_.close();
+}
+
+bool DStorageStream::is_open() const
+{
+    return buf_.is_open();
+}
+
+void DStorageStream::swap(DStorageStream& v) noexcept
+{
+    super::swap(v);
+    buf_.swap(v.buf_);
+}
+
+DStorageStreamBuf* DStorageStream::rdbuf() const
+{
+    return const_cast<DStorageStreamBuf*>(&buf_);
+}
+
+const char* DStorageStream::data() const
+{
+    return buf_.data();
+}
+
+size_t DStorageStream::file_size() const
+{
+    return buf_.file_size();
+}
+
+size_t DStorageStream::read_size() const
+{
+    return buf_.read_size();
+}
+
+BufferPtr&& DStorageStream::extract()
+{
+    return std::move(buf_.extract());
+}
 
-    auto& m = *pimpl_;
-    if (m.future_.valid()) {
-        m.future_.wait();
-    }
-    m = {};
+DStorageStream::status_code DStorageStream::state() const
+{
+    return buf_.state();
 }
 
-bool DStorageStreamBuf::is_open() const
+DStorageStream::error_info DStorageStream::error() const
 {
-    auto& m = *pimpl_;
-    return m.state_.load() >= status_code::launched;
+    return buf_.error();
 }
 
-DStorageStreamBuf::status_code DStorageStreamBuf::state() const
+void DStorageStream::cancel()
 {
-    return pimpl_->state_.load();
+    buf_.cancel();
 }
 
-bool DStorageStreamBuf::is_complete() const
+bool DStorageStream::is_complete() const
 {
-    return state() == status_code::completed;
+    return buf_.is_complete();
 }
 
-bool DStorageStreamBuf::wait()
+bool DStorageStream::wait()
 {
-    DS_PROFILE_SCOPE("DStorageStreamBuf::wait()");
+    return buf_.wait();
+}
 
-    auto& m = *pimpl_;
-    if (m.future_.valid()) {
-        m.future_.wait();
-        m.future_ = {};
-        while (wait_next_block()) {} // for setg() and advance event_pos_
+bool DStorageStream::wait_next_block()
+{
+    return buf_.wait_next_block();
+}
+
+void DStorageStream::set_block_callback(block_callback cb)
+{
+    buf_.set_block_callback(std::move(cb));
+}
+
+bool DStorageStream::poll_block(block& dst)
+{
+    return buf_.poll_block(dst);
+}
+
+bool DStorageStream::wait_any_block(block& dst)
+{
+    return buf_.wait_any_block(dst);
+}
+
+DStorageStreamBuf::block_awaiter DStorageStream::next_block(executor exec)
+{
+    return buf_.next_block(std::move(exec));
+}
+
+DStorageStreamBuf::completion_awaiter DStorageStream::completed(executor exec)
+{
+    return buf_.completed(std::move(exec));
+}
+
+DStorageStreamBuf::range_awaiter DStorageStream::ready(size_t pos, size_t size, executor exec)
+{
+    return buf_.ready(pos, size, std::move(exec));
+}
+
+void DStorageStream::set_expected_checksum(uint32_t crc)
+{
+    buf_.set_expected_checksum(crc);
+}
+
+uint32_t DStorageStream::checksum() const
+{
+    return buf_.checksum();
+}
+
+DStorageStream::stream_stats DStorageStream::stats() const
+{
+    return buf_.stats();
+}
+
+std::span<const char> DStorageStream::view(size_t pos, size_t size)
+{
+    return buf_.view(pos, size);
+}
+
+#pragma endregion DStorageStream
+
+
+#pragma region Compression
+#ifdef _WIN32
+
+// write compressed data at `base` of ofs. chunk offsets are relative to base.
+// written is the total size including the header and the chunk table. ofs is positioned at base + written on return.
+bool WriteCompressedData(MMapStream& ofs, uint64_t base, const void* data, size_t size, uint32_t chunk_size, uint64_t& written)
+{
+    DS_PROFILE_SCOPE("WriteCompressedData()");
+
+    InitializeDirectStorage();
+    if (!g_DStorageCreateCompressionCodec) {
+        return false;
     }
-    return m.state_.load() == status_code::completed;
+    if (chunk_size == 0) {
+        chunk_size = g_ds_staging_buffer_size;
+    }
+
+    CompressedFileHeader header;
+    header.uncompressed_size = size;
+    header.chunk_size = chunk_size;
+    header.chunk_count = uint32_t((size + chunk_size - 1) / chunk_size);
+    std::vector<CompressedChunk> chunks(header.chunk_count);
+
+    // reserve space for header and chunk table. these are written after all chunks are compressed.
+    uint64_t offset = sizeof(CompressedFileHeader) + sizeof(CompressedChunk) * chunks.size();
+    ofs.seekp(base + offset);
+
+    // compress multiple chunks in parallel, and write them in order.
+    const size_t parallelism = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    std::vector<std::vector<char>> compressed(std::min<size_t>(parallelism, chunks.size()));
+    std::atomic_bool ok = true;
+    for (size_t first = 0; first < chunks.size(); first += compressed.size()) {
+        size_t count = std::min(compressed.size(), chunks.size() - first);
+        concurrency::parallel_for(size_t(0), count, [&](size_t i) {
+            DS_PROFILE_SCOPE("WriteCompressedData(): compress");
+
+            com_ptr<IDStorageCompressionCodec> codec;
+            g_DStorageCreateCompressionCodec(DSTORAGE_COMPRESSION_FORMAT_GDEFLATE, 1, IID_PPV_ARGS(codec.put()));
+            if (!codec) {
+                ok = false;
+                return;
+            }
+
+            size_t chunk_pos = (first + i) * chunk_size;
+            size_t src_size = std::min<size_t>(chunk_size, size - chunk_pos);
+            const char* src = (const char*)data + chunk_pos;
+
+            auto& dst = compressed[i];
+            dst.resize(codec->CompressBufferBound(src_size));
+            size_t dst_size = 0;
+            HRESULT hr = codec->CompressBuffer(src, src_size, DSTORAGE_COMPRESSION_BEST_RATIO, dst.data(), dst.size(), &dst_size);
+
+            auto& chunk = chunks[first + i];
+            if (SUCCEEDED(hr) && dst_size < src_size) {
+                dst.resize(dst_size);
+                chunk.format = DSTORAGE_COMPRESSION_FORMAT_GDEFLATE;
+            }
+            else {
+                // incompressible. store as is.
+                dst.assign(src, src + src_size);
+                chunk.format = DSTORAGE_COMPRESSION_FORMAT_NONE;
+            }
+            chunk.size = (uint32_t)dst.size();
+            });
+        if (!ok) {
+            return false;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            auto& chunk = chunks[first + i];
+            chunk.offset = offset;
+            ofs.write(compressed[i].data(), compressed[i].size());
+            offset += chunk.size;
+        }
+    }
+
+    ofs.seekp(base);
+    ofs.write((const char*)&header, sizeof(header));
+    ofs.write((const char*)chunks.data(), sizeof(CompressedChunk) * chunks.size());
+    ofs.seekp(base + offset);
+    written = offset;
+    return ofs.good();
 }
 
-bool DStorageStreamBuf::wait_next_block()
+bool WriteCompressedFile(const char* path, const void* data, size_t size, uint32_t chunk_size)
 {
-    DS_PROFILE_SCOPE("DStorageStreamBuf::wait_next_block()");
+    DS_PROFILE_SCOPE("WriteCompressedFile()");
 
-    auto& m = *pimpl_;
-    if (m.state_.load() <= status_code::idle) {
+    MMapStream ofs;
+    if (!ofs.open(path, std::ios::out)) {
         return false;
     }
-    else if (m.event_pos_ < m.events_.size()) {
-        ::WaitForSingleObject(m.events_[m.event_pos_].get(), INFINITE);
-        m.read_size_ = m.fence_ ? m.fence_->GetCompletedValue() : 0;
-        m.event_pos_++;
+    uint64_t written = 0;
+    return WriteCompressedData(ofs, 0, data, size, chunk_size, written);
+}
 
-        char* gp = this->gptr();
-        this->setg(gp, gp, m.buf_.get() + m.read_size_);
-        return true;
+bool CompressFile(const char* src_path, const char* dst_path, uint32_t chunk_size)
+{
+    MemoryMappedFile src;
+    if (!src.open(src_path, std::ios::in | MemoryMappedFile::async_prefetch)) {
+        return false;
     }
-    return false;
+    return WriteCompressedFile(dst_path, src.data(), src.size(), chunk_size);
 }
 
-const char* DStorageStreamBuf::data() const
+#endif // _WIN32
+#pragma endregion Compression
+
+
+#pragma region DStorageBatch
+
+DStorageBatch::DStorageBatch()
 {
-    return pimpl_->buf_.get();
 }
 
-size_t DStorageStreamBuf::file_size() const
+DStorageBatch::~DStorageBatch()
 {
-    return pimpl_->file_size_;
+    clear();
 }
 
-size_t DStorageStreamBuf::read_size() const
+void DStorageBatch::add(std::string_view path)
 {
-    return pimpl_->read_size_;
+    paths_.push_back(ToWString(path));
 }
 
-BufferPtr&& DStorageStreamBuf::extract()
+void DStorageBatch::add(const std::wstring& path)
 {
-    return std::move(pimpl_->buf_);
+    paths_.push_back(path);
 }
-#pragma endregion DStorageStreamBuf
 
+void DStorageBatch::add(std::wstring&& path)
+{
+    paths_.push_back(std::move(path));
+}
 
-#pragma region DStorageStream
+bool DStorageBatch::submit(std::ios::openmode mode)
+{
+    DS_PROFILE_SCOPE("DStorageBatch::submit()");
+
+    std::vector<std::shared_ptr<DStorageStreamBuf::PImpl>> targets;
+    targets.reserve(paths_.size());
+
+    bool ok = true;
+    size_t first = streams_.size();
+    streams_.resize(first + paths_.size());
+    for (size_t i = 0; i < paths_.size(); ++i) {
+        DStorageStream& stream = streams_[first + i];
+        DStorageStreamBuf& buf = *stream.rdbuf();
+        if (buf.prepare(std::move(paths_[i]), {}, mode)) {
+            stream.clear();
+            if (buf.state() == status_code::launched) {
+                targets.push_back(buf.pimpl_);
+            }
+        }
+        else {
+            stream.setstate(std::ios::failbit);
+            ok = false;
+        }
+    }
+    paths_.clear();
 
-DStorageStream::DStorageStream()
-    : super(&buf_)
-{}
+    if (!targets.empty()) {
+        // all streams in the batch are passed to the engine at once, so their first requests go in one submission.
+        DStorageStreamBuf::PImpl::start(std::move(targets));
+    }
+    return ok;
+}
 
-DStorageStream::DStorageStream(DStorageStream&& v) noexcept
-    : DStorageStream()
+size_t DStorageBatch::size() const
 {
-    *this = std::move(v);
+    return streams_.size();
 }
 
-DStorageStream& DStorageStream::operator=(DStorageStream&& v) noexcept
+DStorageStream& DStorageBatch::operator[](size_t i)
 {
-    swap(v);
-    return *this;
+    return streams_[i];
 }
 
-bool DStorageStream::open(std::string_view path, std::ios::openmode mode)
+std::vector<DStorageStream>& DStorageBatch::streams()
 {
-    return open(ToWString(path), mode);
+    return streams_;
 }
-bool DStorageStream::open(const std::wstring& _path, std::ios::openmode mode)
+
+bool DStorageBatch::wait()
 {
-    std::wstring path = _path;
-    return open(std::move(path), mode);
+    DS_PROFILE_SCOPE("DStorageBatch::wait()");
+
+    bool ret = true;
+    for (auto& stream : streams_) {
+        if (stream.state() != status_code::idle && !stream.wait()) {
+            ret = false;
+        }
+    }
+    return ret;
 }
-bool DStorageStream::open(std::wstring&& path, std::ios::openmode mode)
+
+void DStorageBatch::clear()
 {
-    if (buf_.open(std::move(path), mode)) {
-        this->clear();
-        return true;
+    paths_.clear();
+    streams_.clear();
+}
+
+#pragma endregion DStorageBatch
+
+
+#pragma region DStoragePack
+
+DStoragePack::DStoragePack()
+{
+    pimpl_ = std::make_shared<PImpl>();
+}
+
+DStoragePack::~DStoragePack()
+{
+}
+
+DStoragePack::DStoragePack(DStoragePack&& v) noexcept
+    : DStoragePack()
+{
+    *this = std::move(v);
+}
+
+DStoragePack& DStoragePack::operator=(DStoragePack&& v) noexcept
+{
+    std::swap(pimpl_, v.pimpl_);
+    return *this;
+}
+
+#ifdef _WIN32
+bool DStoragePack::open(std::string_view path)
+{
+    DS_PROFILE_SCOPE("DStoragePack::open()");
+
+    close();
+    InitializeDirectStorage();
+    if (!g_ds_factory) {
+        return false;
     }
-    else {
-        this->setstate(std::ios::failbit);
+
+    auto& m = *pimpl_;
+    m.path_ = ToWString(path);
+    if (!m.mmap_.open(std::string(path).c_str(), std::ios::in)) {
+        close();
+        return false;
+    }
+
+    // validate header and index
+    const char* data = (const char*)m.mmap_.data();
+    uint64_t file_size = m.mmap_.size();
+    PackHeader header{};
+    if (file_size < sizeof(header)) {
+        close();
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != PackHeader::magic_value || header.version != PackHeader::current_version ||
+        header.index_offset + sizeof(PackEntry) * header.entry_count > file_size ||
+        header.names_offset + header.names_size > file_size) {
+        close();
+        return false;
+    }
+    m.entries_ = { (const PackEntry*)(data + header.index_offset), header.entry_count };
+    m.names_ = data + header.names_offset;
+    for (const PackEntry& e : m.entries_) {
+        if (e.offset + e.size > file_size || uint64_t(e.name_offset) + e.name_size > header.names_size) {
+            close();
+            return false;
+        }
+    }
+
+    // the only OpenFile() for all assets in this pack
+    if (FAILED(g_ds_factory->OpenFile(m.path_.c_str(), IID_PPV_ARGS(m.file_.put())))) {
+        close();
         return false;
     }
+    return true;
 }
+#endif // _WIN32
 
-void DStorageStream::close()
+void DStoragePack::close()
 {
-    return buf_.close();
+    // streams of assets keep the old one alive
+    pimpl_ = std::make_shared<PImpl>();
 }
 
-bool DStorageStream::is_open() const
+bool DStoragePack::is_open() const
 {
-    return buf_.is_open();
+    return (bool)pimpl_->file_;
 }
 
-void DStorageStream::swap(DStorageStream& v) noexcept
+size_t DStoragePack::size() const
 {
-    super::swap(v);
-    buf_.swap(v.buf_);
+    return pimpl_->entries_.size();
 }
 
-DStorageStreamBuf* DStorageStream::rdbuf() const
+DStoragePack::entry_info DStoragePack::entry(size_t i) const
 {
-    return const_cast<DStorageStreamBuf*>(&buf_);
+    auto& m = *pimpl_;
+    const PackEntry& e = m.entries_[i];
+    return { m.name(e), e.offset, e.size, e.uncompressed_size, (e.flags & PackEntry::flag_compressed) != 0,
+        (e.flags & PackEntry::flag_checksum) != 0, e.checksum };
 }
 
-const char* DStorageStream::data() const
+size_t DStoragePack::find(std::string_view name) const
 {
-    return buf_.data();
+    auto& m = *pimpl_;
+    uint64_t hash = HashName(name);
+    auto it = std::lower_bound(m.entries_.begin(), m.entries_.end(), hash,
+        [](const PackEntry& e, uint64_t h) { return e.name_hash < h; });
+    for (; it != m.entries_.end() && it->name_hash == hash; ++it) {
+        if (m.name(*it) == name) {
+            return size_t(it - m.entries_.begin());
+        }
+    }
+    return npos;
 }
 
-size_t DStorageStream::file_size() const
+bool DStoragePack::open_asset(DStorageStream& dst, std::string_view name, std::ios::openmode mode) const
 {
-    return buf_.file_size();
+    size_t i = find(name);
+    if (i == npos) {
+        dst.close();
+        dst.setstate(std::ios::failbit);
+        return false;
+    }
+    return open_asset(dst, i, mode);
 }
 
-size_t DStorageStream::read_size() const
+bool DStoragePack::open_asset(DStorageStream& dst, size_t index, std::ios::openmode mode) const
 {
-    return buf_.read_size();
+    DS_PROFILE_SCOPE("DStoragePack::open_asset()");
+
+    dst.close();
+    auto& m = *pimpl_;
+    DStorageStreamBuf& buf = *dst.rdbuf();
+    bool ok = false;
+    if (m.file_ && index < m.entries_.size()) {
+        const PackEntry& e = m.entries_[index];
+        buf.pimpl_->pack_ = pimpl_;
+        buf.pimpl_->pack_offset_ = e.offset;
+        buf.pimpl_->has_expected_checksum_ = (e.flags & PackEntry::flag_checksum) != 0;
+        buf.pimpl_->expected_checksum_ = e.checksum;
+        if (e.flags & PackEntry::flag_compressed) {
+            ok = buf.prepare(std::wstring(m.path_), {}, mode | DStorageStreamBuf::compressed);
+        }
+        else {
+            DStorageStreamBuf::range r{ e.offset, e.size };
+            ok = buf.prepare(std::wstring(m.path_), { &r, 1 }, mode & ~DStorageStreamBuf::compressed);
+        }
+        if (ok) {
+            buf.launch();
+        }
+    }
+
+    if (ok) {
+        dst.clear();
+    }
+    else {
+        dst.setstate(std::ios::failbit);
+    }
+    return ok;
 }
 
-BufferPtr&& DStorageStream::extract()
+
+struct DStoragePackBuilder::PImpl
 {
-    return std::move(buf_.extract());
+    MMapStream ofs_;
+    uint64_t pos_ = 0;
+    uint32_t alignment_ = 16;
+    std::vector<PackEntry> entries_;
+    std::string names_;
+    std::set<std::string, std::less<>> added_;
+};
+
+DStoragePackBuilder::DStoragePackBuilder()
+{
+    pimpl_ = std::make_unique<PImpl>();
 }
 
-DStorageStream::status_code DStorageStream::state() const
+DStoragePackBuilder::~DStoragePackBuilder()
 {
-    return buf_.state();
+    close();
 }
 
-bool DStorageStream::is_complete() const
+bool DStoragePackBuilder::open(const char* path, uint32_t alignment)
 {
-    return buf_.is_complete();
+    close();
+    auto& m = *pimpl_;
+    if (!m.ofs_.open(path, std::ios::out)) {
+        return false;
+    }
+    m.alignment_ = std::max<uint32_t>(alignment, 1);
+    m.pos_ = sizeof(PackHeader); // header is written on close()
+    return true;
 }
 
-bool DStorageStream::wait()
+bool DStoragePackBuilder::add(std::string_view name, const void* data, size_t size, bool compress, uint32_t chunk_size)
 {
-    return buf_.wait();
+    DS_PROFILE_SCOPE("DStoragePackBuilder::add()");
+
+    auto& m = *pimpl_;
+    if (!m.ofs_.is_open() || m.added_.contains(name)) {
+        return false;
+    }
+
+    PackEntry e;
+    e.name_hash = HashName(name);
+    e.offset = (m.pos_ + m.alignment_ - 1) / m.alignment_ * m.alignment_;
+    e.uncompressed_size = size;
+    e.name_offset = (uint32_t)m.names_.size();
+    e.name_size = (uint32_t)name.size();
+    e.flags |= PackEntry::flag_checksum;
+    e.checksum = Crc32c(data, size);
+    if (compress) {
+        e.flags |= PackEntry::flag_compressed;
+        if (!WriteCompressedData(m.ofs_, e.offset, data, size, chunk_size, e.size)) {
+            return false;
+        }
+    }
+    else {
+        m.ofs_.seekp(e.offset);
+        m.ofs_.write((const char*)data, size);
+        e.size = size;
+    }
+    if (!m.ofs_.good()) {
+        return false;
+    }
+
+    m.pos_ = e.offset + e.size;
+    m.entries_.push_back(e);
+    m.names_ += name;
+    m.added_.emplace(name);
+    return true;
 }
 
-bool DStorageStream::wait_next_block()
+bool DStoragePackBuilder::add_file(std::string_view name, const char* path, bool compress, uint32_t chunk_size)
 {
-    return buf_.wait_next_block();
+    MemoryMappedFile src;
+    if (!src.open(path, std::ios::in | MemoryMappedFile::async_prefetch)) {
+        return false;
+    }
+    return add(name, src.data(), src.size(), compress, chunk_size);
 }
 
-#pragma endregion DStorageStream
+bool DStoragePackBuilder::close()
+{
+    DS_PROFILE_SCOPE("DStoragePackBuilder::close()");
+
+    auto& m = *pimpl_;
+    if (!m.ofs_.is_open()) {
+        return false;
+    }
+
+    std::stable_sort(m.entries_.begin(), m.entries_.end(),
+        [](const PackEntry& a, const PackEntry& b) { return a.name_hash < b.name_hash; });
+
+    PackHeader header;
+    header.entry_count = (uint32_t)m.entries_.size();
+    header.index_offset = (m.pos_ + alignof(PackEntry) - 1) / alignof(PackEntry) * alignof(PackEntry);
+    header.names_offset = header.index_offset + sizeof(PackEntry) * m.entries_.size();
+    header.names_size = m.names_.size();
+
+    m.ofs_.seekp(header.index_offset);
+    m.ofs_.write((const char*)m.entries_.data(), sizeof(PackEntry) * m.entries_.size());
+    m.ofs_.write(m.names_.data(), m.names_.size());
+    m.ofs_.seekp(0);
+    m.ofs_.write((const char*)&header, sizeof(header));
+    bool ok = m.ofs_.good();
+
+    // MMapStream truncates the file to the written size on destruction
+    m = {};
+    return ok;
+}
+
+#pragma endregion DStoragePack
 
 } // namespace ist
@@ -2,8 +2,15 @@
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <span>
+#include <functional>
+#include <coroutine>
+#include <map>
+#include <mutex>
+#include <string_view>
 
 struct ID3D12Device;
+struct ID3D12Resource;
 struct IDStorageFactory;
 struct IDStorageQueue;
 
@@ -13,7 +20,90 @@ namespace ist {
 using BufferPtr = std::shared_ptr<char[]>;
 
 // huge buffer can take long time to free. async_free can take advantage in such case.
-BufferPtr CreateBuffer(size_t size, bool async_free = true, bool prefetch = true);
+// if buffer pool is enabled, buffer may be taken from the pool. in that case contents are not zero-cleared.
+// large_pages: use MEM_LARGE_PAGES (MAP_HUGETLB on POSIX) if available (see IsLargePageAvailable()). fallback to normal pages if not.
+// numa_node: preferred NUMA node of the physical memory. -1 means no preference.
+BufferPtr CreateBuffer(size_t size, bool async_free = true, bool prefetch = true, bool large_pages = false, int numa_node = -1);
+
+// large pages require SeLockMemoryPrivilege to be granted to the user. this tries to enable it on the first call.
+// on POSIX, huge pages must be reserved by the system (vm.nr_hugepages).
+bool IsLargePageAvailable();
+
+// buffers created by CreateBuffer() are returned to the pool when released, and reused by later CreateBuffer().
+// this saves VirtualAlloc() / VirtualFree() and page faults when files of similar size are opened repeatedly.
+// capacity is the max total size of pooled buffers. 0 disables the pool. (default)
+void SetBufferPoolCapacity(size_t size);
+size_t GetBufferPoolCapacity();
+void ClearBufferPool();
+
+// IDStorageFile handles and file sizes are cached by path, so that repeated open() of the same file skips
+// IDStorageFactory::OpenFile() (which can be very slow). least recently used ones are released when exceeding capacity.
+// capacity is the max number of cached files. 0 disables the cache. (default)
+// validate: check size and last write time of the file on each open() and reopen if changed. costs one GetFileAttributesExW().
+// without validation, a cache hit doesn't touch the file system at all.
+// cached files keep their handles open. call ClearFileCache() before modifying or deleting them.
+void SetFileCacheCapacity(size_t count, bool validate = true);
+size_t GetFileCacheCapacity();
+void ClearFileCache();
+
+// write GDeflate compressed file that can be read by DStorageStream with `compressed` flag.
+// data is split into chunks of chunk_size and each chunk is compressed independently.
+// chunk_size must be <= staging buffer size of the reader. 0 means current staging buffer size.
+bool WriteCompressedFile(const char* path, const void* data, size_t size, uint32_t chunk_size = 0);
+bool CompressFile(const char* src_path, const char* dst_path, uint32_t chunk_size = 0);
+
+// CRC32C (Castagnoli). uses SSE4.2 if available. pass the previous result as crc to continue.
+uint32_t Crc32c(const void* data, size_t size, uint32_t crc = 0);
+// CRC32C of concatenated data from CRC32C of each part. size2 is the size of the second part.
+uint32_t Crc32cCombine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+// process-wide counters. open_streams and inflight_* are current values, others are totals since the process started.
+struct Stats
+{
+    uint64_t open_streams = 0;      // launched and not finished yet
+    uint64_t inflight_requests = 0; // enqueued and not completed yet. (queue depth)
+    uint64_t inflight_bytes = 0;    // file bytes of inflight_requests
+    uint64_t total_streams = 0;     // finished streams
+    uint64_t total_bytes = 0;       // read from files
+    uint64_t errors = 0;            // streams finished with error_* states
+    uint64_t cancelled = 0;
+    uint64_t buffer_pool_hits = 0;
+    uint64_t buffer_pool_misses = 0;
+};
+Stats GetStats();
+
+enum class TraceEventType
+{
+    open,            // DStorageStreamBuf::open() on the calling thread. file size query, blocks and buffer allocation
+    open_file,       // IDStorageFactory::OpenFile(). not recorded if the file is cached or read synchronously
+    submit,          // instant. requests are enqueued to the queue. value: number of requests
+    first_block,     // instant. the first block landed
+    complete,        // instant. the stream finished. value: status_code
+    wait_next_block, // the consumer is waiting for blocks. value: number of blocks already consumed
+    create_buffer,   // CreateBuffer(). value: size. stream is null
+};
+
+enum class TracePhase
+{
+    begin,
+    end,
+    instant,
+};
+
+struct TraceEvent
+{
+    TraceEventType type;
+    TracePhase phase;
+    const void* stream; // identifies the stream. begin / end of the same type and stream are paired.
+    int64_t value;
+    uint64_t time_ns; // steady clock
+};
+using TraceHook = std::function<void(const TraceEvent&)>;
+
+// the hook is called on the thread that records the event. keep it short. null removes it.
+void SetTraceHook(TraceHook hook);
+// write the events to ETW with TraceLogging. provider: "ist.DirectStorageStream" {6e0ac3b4-2f5d-4c8e-9a71-3d4b8f2e6c15}
+void EnableTraceLogging(bool enable);
 
 
 class DStorageStreamBuf : public std::streambuf
@@ -21,17 +111,77 @@ class DStorageStreamBuf : public std::streambuf
     using super = std::streambuf;
 
 public:
-    static constexpr std::ios::openmode async_free = 0x2000;
+    static constexpr std::ios::openmode async_free = std::ios::openmode(0x2000);
+    static constexpr std::ios::openmode compressed = std::ios::openmode(0x4000); // file is made by WriteCompressedFile()
+    static constexpr std::ios::openmode large_pages = std::ios::openmode(0x8000); // allocate buffer with large pages. see CreateBuffer().
+    static constexpr std::ios::openmode verify = std::ios::openmode(0x40000); // compute CRC32C of each block as it lands. see checksum().
+    // read through a fixed ring of blocks instead of a buffer of the whole file, so memory use doesn't depend on the file size.
+    // the block after the ring is read only when the consumer moves past the oldest one. see DStorageStream::set_streaming_ring_size().
+    // forward reads through std::istream (read(), get(), seekg() forward, tellg()) work as usual, and the get area is the current block.
+    // data() is null, view() only covers the current block, wait_next_block() moves to the next block and wait() cancels the reads of the rest.
+    // wait() returns true only if no block was left unread by then.
+    // applies to whole-file reads to owned memory larger than the ring. ignored for others (ranges, caller-provided memory, GPU,
+    // compressed files, and pack assets on Windows). on Windows these streams are read by overlapped I/O even with DirectStorage.
+    static constexpr std::ios::openmode streaming = std::ios::openmode(0x80000);
+    // allocate buffer on the specified NUMA node. can be combined with other flags. (e.g. async_free | numa_node(1))
+    static constexpr std::ios::openmode numa_node(int node) { return std::ios::openmode(((node + 1) & 0x7f) << 24); }
+    static int get_numa_node(std::ios::openmode mode);
+    // priority of the requests. each priority has its own queue, so urgent reads are not queued behind bulk reads.
+    // default is normal priority.
+    static constexpr std::ios::openmode low_priority = std::ios::openmode(0x10000);
+    static constexpr std::ios::openmode high_priority = std::ios::openmode(0x20000);
+    static constexpr std::ios::openmode realtime_priority = std::ios::openmode(0x30000);
+    // returns DSTORAGE_PRIORITY. (-1: low, 0: normal, 1: high, 2: realtime)
+    static int get_priority(std::ios::openmode mode);
 
     enum class status_code {
         idle,
         launched,
         reading,
         completed,
+        cancelled, // by cancel() or close(). data may be partially read.
 
         error_dll_not_found = -10000,
         error_file_open_failed,
         error_unknown,
+        error_out_of_range,
+        error_invalid_format,
+        error_read_failed, // see error() for details
+        error_checksum_mismatch, // verify mode
+    };
+
+    // first failure of the stream.
+    struct error_info
+    {
+        long hresult = 0; // HRESULT. 0 (S_OK) if no error. negated errno on POSIX
+        uint64_t file_offset = 0; // offset and size of the failed request in the file. (compressed size for compressed files)
+        uint64_t size = 0;
+    };
+
+    // region of the file to read. for ranged read.
+    struct range
+    {
+        static constexpr uint64_t packed = ~0ull;
+
+        uint64_t file_offset = 0;
+        uint64_t size = 0;
+        uint64_t buffer_offset = packed; // packed: placed right after the previous range
+    };
+
+    // completed block. offset is the position in the buffer (or in the destination resource), size is uncompressed size.
+    struct block
+    {
+        uint64_t offset = 0;
+        uint64_t size = 0;
+    };
+    using block_callback = std::function<void(const block&)>;
+
+    // destination of open_texture(). equivalent to subresource index + D3D12_BOX.
+    struct texture_region
+    {
+        uint32_t subresource = 0;
+        uint32_t left = 0, top = 0, front = 0;
+        uint32_t right = 0, bottom = 0, back = 0;
     };
 
 public:
@@ -52,26 +202,113 @@ public:
     using super::gptr;
 
     bool open(std::wstring&& path, std::ios::openmode mode);
+    // read only specified ranges. buffer is allocated only for them. empty ranges means the whole file.
+    // ranges are read in order, and read_size() reports the end of the last completed range in the buffer.
+    bool open(std::wstring&& path, std::span<const range> ranges, std::ios::openmode mode);
+    // read into caller-provided memory. dst must be alive until the stream is closed.
+    // fails with error_out_of_range if dst_size is not enough.
+    bool open(std::wstring&& path, void* dst, size_t dst_size, std::span<const range> ranges, std::ios::openmode mode);
+
+    // read directly into GPU resources. these need the device given to DirectStorageStream::set_device() (or internally created one).
+    // no CPU memory is allocated, so data() is null and read through std::istream is not available.
+    // wait_next_block() / wait() / read_size() work as usual.
+    // open_buffer(): dst_offset + buffer offset of each range is the destination offset in the buffer.
+    bool open_buffer(std::wstring&& path, ID3D12Resource* dst, uint64_t dst_offset, std::span<const range> ranges, std::ios::openmode mode);
+    // open_texture() / open_subresources(): whole (uncompressed) data must fit in the staging buffer. (DirectStorage's limitation)
+    bool open_texture(std::wstring&& path, ID3D12Resource* dst, const texture_region& region, std::ios::openmode mode);
+    bool open_subresources(std::wstring&& path, ID3D12Resource* dst, uint32_t first_subresource, std::ios::openmode mode);
+    // requests in flight are cancelled and close() returns without waiting for them.
+    // (except for caller-provided memory and GPU destinations. in these cases it waits for cancellation to complete)
     void close();
     bool is_open() const;
 
     void swap(DStorageStreamBuf& v) noexcept;
+    // zero-copy access. blocks only until the blocks covering [pos, pos + size) are completed.
+    // size is clamped to file_size(). returns empty span if reading the range failed or the destination is GPU.
+    std::span<const char> view(size_t pos, size_t size);
     const char* data() const;
-    size_t file_size() const; // == size of buffer, but potentially data is not read yet.
+    size_t file_size() const; // == size of buffer (total size of ranges for ranged read), but potentially data is not read yet.
     size_t read_size() const; // size of data actually read.
     BufferPtr&& extract();
 
     // state and wait methods. these are called internally on read(), so you do not need to care about usually.
     status_code state() const;
+    error_info error() const;
     bool is_complete() const;
     bool wait();
     bool wait_next_block();
+    // cancel requests in flight. state becomes `cancelled` unless all requests are already done.
+    // returns immediately. wait() waits for the cancellation to complete.
+    void cancel();
+
+    // blocks are reported in completion order as soon as they land, regardless of wait_next_block().
+    // callback is called from a library thread (keep it short), and is kept across open() / close().
+    // it must be set before open(). all callbacks are done when wait() returns.
+    void set_block_callback(block_callback cb);
+    // take the next completed block that is not reported yet. poll_block() returns false if none has landed yet.
+    // wait_any_block() blocks until a block lands, and returns false when there are no more blocks.
+    bool poll_block(block& dst);
+    bool wait_any_block(block& dst);
+
+    // awaitable versions of wait_next_block(), wait() and view() for coroutines. no thread is blocked while waiting.
+    // the coroutine is resumed through the executor on a library thread when the blocks land or the stream finishes.
+    // without executor, it is resumed directly on that thread. it must not block (e.g. wait()) then, as it stalls other streams.
+    //   while (co_await stream.next_block(ex)) { ... }
+    //   bool ok = co_await stream.completed(ex);
+    //   std::span<const char> data = co_await stream.ready(pos, size, ex); // same as view()
+    using executor = std::function<void(std::coroutine_handle<>)>;
+    struct awaiter
+    {
+        enum class kind { block, finish, range };
+
+        DStorageStreamBuf* buf = nullptr;
+        kind what = kind::finish;
+        uint64_t pos = 0; // block: number of blocks already seen. range: position in the buffer
+        uint64_t size = 0;
+        executor exec;
+
+        bool await_ready() const;
+        bool await_suspend(std::coroutine_handle<> h);
+    };
+    struct block_awaiter : awaiter { bool await_resume() { return buf->wait_next_block(); } };
+    struct completion_awaiter : awaiter { bool await_resume() { return buf->wait(); } };
+    struct range_awaiter : awaiter { std::span<const char> await_resume() { return buf->view(pos, size); } };
+    block_awaiter next_block(executor exec = {});
+    completion_awaiter completed(executor exec = {});
+    range_awaiter ready(size_t pos, size_t size, executor exec = {});
+
+    // timing of this stream in nanoseconds from open(). 0 if not reached (yet).
+    struct stream_stats
+    {
+        uint64_t probe_ns = 0;       // file size is known (FileCache, GetFileAttributesExW() or the pack index)
+        uint64_t open_file_ns = 0;   // duration of IDStorageFactory::OpenFile(). 0 if cached or read synchronously
+        uint64_t submit_ns = 0;      // requests are enqueued
+        uint64_t first_block_ns = 0;
+        uint64_t total_ns = 0;       // finished
+        uint64_t bytes = 0;          // read from the file so far. compressed size for compressed files
+    };
+    stream_stats stats() const;
+
+    // verify mode. blocks in memory are hashed on a worker thread as they land, so hashing overlaps with I/O.
+    // checksum() is CRC32C of the data read (in block order), valid when the stream is complete.
+    // the state becomes error_checksum_mismatch if it doesn't match the expected value.
+    // on an idle stream, the expected value applies to the next open() only. on an open stream, it applies to the
+    // current one, and a completed stream is re-checked immediately. DStoragePack::open_asset() sets it from the pack index.
+    void set_expected_checksum(uint32_t crc);
+    uint32_t checksum() const;
 
 private:
-    long do_read();
+    friend class DStorageBatch;
+    friend class DStoragePack;
+    friend class Submitter;
+    friend class OverlappedEngine;
+    friend class IoUringEngine;
+    bool prepare(std::wstring&& path, std::span<const range> ranges, std::ios::openmode mode);
+    void launch();
+    pos_type seekoff_streaming(off_type off, std::ios::seekdir dir);
 
     struct PImpl;
-    std::unique_ptr<PImpl> pimpl_;
+    std::shared_ptr<PImpl> pimpl_;
 };
 
 
@@ -81,7 +318,10 @@ class DStorageStream : public std::istream
 
 public:
     // call this if you want to share existing device/factory/queue, otherwise these will be created internally.
+    // queue is used for normal priority.
     static void set_device(ID3D12Device* device, IDStorageFactory* factory = nullptr, IDStorageQueue* queue = nullptr);
+    // queues for each priority: { low, normal, high, realtime }. null or missing ones will be created internally.
+    static void set_device(ID3D12Device* device, IDStorageFactory* factory, std::span<IDStorageQueue* const> queues);
     static void release_device();
 
     // staging buffer size is the maximum read size per request.
@@ -89,18 +329,70 @@ public:
     static void set_staging_buffer_size(uint32_t size);
     static uint32_t get_staging_buffer_size();
 
+    // files (total size of ranges for ranged read) <= threshold are read synchronously by ReadFile() in open(),
+    // bypassing DirectStorage. the stream is already completed when open() returns. 0 disables this. (default: 64KiB)
+    // compressed files and GPU destinations always go through DirectStorage.
+    static void set_small_file_threshold(uint32_t size);
+    static uint32_t get_small_file_threshold();
+
+    // number of blocks in the ring of `streaming` mode. at least 2. (default: 8)
+    // the ring takes this many times the request size (1MiB without DirectStorage, capped by the staging buffer size).
+    static void set_streaming_ring_size(uint32_t blocks);
+    static uint32_t get_streaming_ring_size();
+
+    // if DirectStorage is not available (dstorage.dll / d3d12.dll are missing or failed to initialize),
+    // uncompressed files to memory are read by Win32 overlapped I/O through an IOCP, with multiple outstanding reads
+    // and FILE_FLAG_NO_BUFFERING where blocks are sector-aligned. block and event semantics are the same.
+    // compressed files, pack files and GPU destinations still fail with error_dll_not_found.
+    // force_overlapped_io() uses this path even if DirectStorage is available.
+    // on POSIX, there is no DirectStorage. files are read by io_uring with registered buffers, and O_DIRECT where blocks
+    // are sector-aligned (pread() if io_uring is not available). pack files work as well. error_info::hresult is negated errno.
+    static void force_overlapped_io(bool v);
+    static bool is_direct_storage_available();
+
     // disable Bypass IO even if the drive supports.
     static void disable_bypassio(bool v);
 
     // enable file buffering. this may improve performance on HDD, but may worsen on SSD.
-    // this implicitly disables Bypass IO.
+    // this implicitly disables Bypass IO. on POSIX, this disables O_DIRECT.
     static void force_file_buffering(bool v);
 
     static void enable_debug(bool v);
 
+    // adaptive request sizing. when enabled, files are read with small leading requests for fast first block,
+    // followed by requests doubling up to the max request size, which is tuned from measured throughput of the drive.
+    // (the largest power of two readable within ~8ms. capped by the staging buffer size)
+    // staging buffer size itself is not changed automatically.
+    static void enable_adaptive_request_size(bool v);
+
+    struct request_size_info
+    {
+        bool adaptive = false;
+        uint32_t staging_buffer_size = 0;
+        uint32_t first_request_size = 0;
+        uint32_t max_request_size = 0;
+        double throughput = 0.0; // measured throughput in bytes per second. 0 if not measured yet.
+    };
+    static request_size_info get_request_size_info();
+
 public:
     static constexpr std::ios::openmode async_free = DStorageStreamBuf::async_free;
+    static constexpr std::ios::openmode compressed = DStorageStreamBuf::compressed;
+    static constexpr std::ios::openmode large_pages = DStorageStreamBuf::large_pages;
+    static constexpr std::ios::openmode verify = DStorageStreamBuf::verify;
+    static constexpr std::ios::openmode streaming = DStorageStreamBuf::streaming;
+    static constexpr std::ios::openmode numa_node(int node) { return DStorageStreamBuf::numa_node(node); }
+    static constexpr std::ios::openmode low_priority = DStorageStreamBuf::low_priority;
+    static constexpr std::ios::openmode high_priority = DStorageStreamBuf::high_priority;
+    static constexpr std::ios::openmode realtime_priority = DStorageStreamBuf::realtime_priority;
     using status_code = DStorageStreamBuf::status_code;
+    using error_info = DStorageStreamBuf::error_info;
+    using range = DStorageStreamBuf::range;
+    using texture_region = DStorageStreamBuf::texture_region;
+    using block = DStorageStreamBuf::block;
+    using block_callback = DStorageStreamBuf::block_callback;
+    using stream_stats = DStorageStreamBuf::stream_stats;
+    using executor = DStorageStreamBuf::executor;
 
     // movable but non-copyable
     DStorageStream(DStorageStream&& v) noexcept;
@@ -110,27 +402,208 @@ public:
 
     DStorageStream();
 
-    // mode: all except `async_free` flags are ignored. always behave as std::ios::in | std::ios::binary.
+    // mode: all except `async_free`, `compressed`, `large_pages`, `numa_node()`, priority flags, `verify` and `streaming` are ignored. always behave as std::ios::in | std::ios::binary.
+    // with `compressed`, file_size() and read_size() are uncompressed size.
     bool open(std::string_view path, std::ios::openmode mode = async_free);
     bool open(const std::wstring& path, std::ios::openmode mode = async_free);
     bool open(std::wstring&& path, std::ios::openmode mode = async_free);
+    // ranged read. see DStorageStreamBuf::open().
+    bool open(std::string_view path, std::span<const range> ranges, std::ios::openmode mode = async_free);
+    bool open(const std::wstring& path, std::span<const range> ranges, std::ios::openmode mode = async_free);
+    bool open(std::wstring&& path, std::span<const range> ranges, std::ios::openmode mode = async_free);
+    // caller-provided memory. see DStorageStreamBuf::open().
+    bool open(std::string_view path, void* dst, size_t dst_size, std::span<const range> ranges = {}, std::ios::openmode mode = {});
+    bool open(const std::wstring& path, void* dst, size_t dst_size, std::span<const range> ranges = {}, std::ios::openmode mode = {});
+    bool open(std::wstring&& path, void* dst, size_t dst_size, std::span<const range> ranges = {}, std::ios::openmode mode = {});
+    // GPU destinations. see DStorageStreamBuf::open_buffer() etc.
+    bool open_buffer(std::string_view path, ID3D12Resource* dst, uint64_t dst_offset = 0, std::span<const range> ranges = {}, std::ios::openmode mode = {});
+    bool open_buffer(const std::wstring& path, ID3D12Resource* dst, uint64_t dst_offset = 0, std::span<const range> ranges = {}, std::ios::openmode mode = {});
+    bool open_buffer(std::wstring&& path, ID3D12Resource* dst, uint64_t dst_offset = 0, std::span<const range> ranges = {}, std::ios::openmode mode = {});
+    bool open_texture(std::string_view path, ID3D12Resource* dst, const texture_region& region, std::ios::openmode mode = {});
+    bool open_texture(const std::wstring& path, ID3D12Resource* dst, const texture_region& region, std::ios::openmode mode = {});
+    bool open_texture(std::wstring&& path, ID3D12Resource* dst, const texture_region& region, std::ios::openmode mode = {});
+    bool open_subresources(std::string_view path, ID3D12Resource* dst, uint32_t first_subresource = 0, std::ios::openmode mode = {});
+    bool open_subresources(const std::wstring& path, ID3D12Resource* dst, uint32_t first_subresource = 0, std::ios::openmode mode = {});
+    bool open_subresources(std::wstring&& path, ID3D12Resource* dst, uint32_t first_subresource = 0, std::ios::openmode mode = {});
     void close();
     bool is_open() const;
 
     void swap(DStorageStream& v) noexcept;
     DStorageStreamBuf* rdbuf() const;
+    std::span<const char> view(size_t pos, size_t size); // see DStorageStreamBuf::view()
     const char* data() const;
     size_t file_size() const;
     size_t read_size() const;
     BufferPtr&& extract();
 
     status_code state() const;
+    error_info error() const;
     bool is_complete() const;
     bool wait();
     bool wait_next_block();
+    void cancel();
+
+    // see DStorageStreamBuf::set_block_callback() etc.
+    void set_block_callback(block_callback cb);
+    bool poll_block(block& dst);
+    bool wait_any_block(block& dst);
+
+    // see DStorageStreamBuf::next_block() etc.
+    DStorageStreamBuf::block_awaiter next_block(executor exec = {});
+    DStorageStreamBuf::completion_awaiter completed(executor exec = {});
+    DStorageStreamBuf::range_awaiter ready(size_t pos, size_t size, executor exec = {});
+
+    // see DStorageStreamBuf::checksum()
+    void set_expected_checksum(uint32_t crc);
+    uint32_t checksum() const;
+
+    stream_stats stats() const; // see DStorageStreamBuf::stats()
 
 private:
+    bool on_open(bool ok);
+
     DStorageStreamBuf buf_;
 };
 
+
+// calls fn(block, data) for each block of the stream on worker threads as soon as it lands, so that processing scales
+// across cores while reading. calls are concurrent and in completion order. data is the block in the buffer.
+// returns when the stream is finished and all calls are done. false if reading failed (landed blocks are processed anyway)
+// or the destination is GPU (or `streaming`). blocks are taken by wait_any_block(). fn must not call ForEachBlockParallel() itself.
+bool ForEachBlockParallel(DStorageStream& stream, const std::function<void(const DStorageStream::block&, std::span<const char>)>& fn);
+
+// ordered reduction on ForEachBlockParallel(). map(data) runs on worker threads, and reduce(acc, map's result) runs on the
+// calling thread in buffer order. so, the result doesn't depend on the order blocks land.
+//   double total = ReduceBlocksParallel(ifs, 0.0, [](std::span<const char> data) { return Sum(data); }, std::plus<>());
+template<class T, class Map, class Reduce>
+T ReduceBlocksParallel(DStorageStream& stream, T init, Map&& map, Reduce&& reduce)
+{
+    using mapped_type = std::decay_t<std::invoke_result_t<Map&, std::span<const char>>>;
+    std::mutex mutex;
+    std::map<uint64_t, mapped_type> mapped; // by offset in the buffer
+    ForEachBlockParallel(stream, [&](const DStorageStream::block& b, std::span<const char> data) {
+        mapped_type v = map(data);
+        std::unique_lock lock{ mutex };
+        mapped.emplace(b.offset, std::move(v));
+        });
+    for (auto& kv : mapped) {
+        init = reduce(std::move(init), std::move(kv.second));
+    }
+    return init;
+}
+
+// opens multiple files at once.
+// all files are opened by one task and their requests are submitted together by one Submit(), so it is much more efficient than
+// opening files one by one when there are many small files.
+// resulting streams behave the same as ones opened by DStorageStream::open(). they can be moved out of the batch.
+class DStorageBatch
+{
+public:
+    static constexpr std::ios::openmode async_free = DStorageStreamBuf::async_free;
+    using status_code = DStorageStreamBuf::status_code;
+
+    // non-copyable
+    DStorageBatch(const DStorageBatch& v) = delete;
+    DStorageBatch& operator=(const DStorageBatch& rhs) = delete;
+
+    DStorageBatch();
+    ~DStorageBatch();
+
+    void add(std::string_view path);
+    void add(const std::wstring& path);
+    void add(std::wstring&& path);
+
+    // opens all added files. streams are appended to streams() in the same order as add().
+    // returns false if any of files failed to open. failed streams have failbit.
+    bool submit(std::ios::openmode mode = async_free);
+
+    size_t size() const;
+    DStorageStream& operator[](size_t i);
+    std::vector<DStorageStream>& streams();
+
+    // wait for all streams. returns false if any of them failed.
+    bool wait();
+    void clear();
+
+private:
+    std::vector<std::wstring> paths_;
+    std::vector<DStorageStream> streams_;
+};
+
+
+// archive of many assets in one file. made by DStoragePackBuilder.
+// the index is memory-mapped, and all assets are read through one IDStorageFile with ranged requests.
+// so, opening an asset costs no OpenFile() and no file system metadata lookup.
+class DStoragePack
+{
+public:
+    static constexpr std::ios::openmode async_free = DStorageStreamBuf::async_free;
+    static constexpr size_t npos = ~size_t(0);
+
+    struct entry_info
+    {
+        std::string_view name;
+        uint64_t offset = 0; // in the pack file
+        uint64_t size = 0; // in the pack file
+        uint64_t uncompressed_size = 0; // == size if not compressed
+        bool compressed = false;
+        bool has_checksum = false;
+        uint32_t checksum = 0; // CRC32C of the uncompressed data
+    };
+
+    // movable but non-copyable
+    DStoragePack(DStoragePack&& v) noexcept;
+    DStoragePack& operator=(DStoragePack&& v) noexcept;
+    DStoragePack(const DStoragePack& v) = delete;
+    DStoragePack& operator=(const DStoragePack& rhs) = delete;
+
+    DStoragePack();
+    ~DStoragePack();
+
+    bool open(std::string_view path);
+    // the pack can be closed while streams of its assets are alive.
+    void close();
+    bool is_open() const;
+
+    size_t size() const; // number of assets
+    entry_info entry(size_t i) const;
+    // returns npos if not found
+    size_t find(std::string_view name) const;
+
+    // mode: same as DStorageStream::open(). `compressed` is determined by the entry.
+    // with `verify`, the asset is checked against the checksum in the index.
+    bool open_asset(DStorageStream& dst, std::string_view name, std::ios::openmode mode = async_free) const;
+    bool open_asset(DStorageStream& dst, size_t index, std::ios::openmode mode = async_free) const;
+
+private:
+    struct PImpl;
+    std::shared_ptr<PImpl> pimpl_;
+    friend class DStorageStreamBuf;
+};
+
+// writes pack files through MMapStream.
+class DStoragePackBuilder
+{
+public:
+    // non-copyable
+    DStoragePackBuilder(const DStoragePackBuilder& v) = delete;
+    DStoragePackBuilder& operator=(const DStoragePackBuilder& rhs) = delete;
+
+    DStoragePackBuilder();
+    ~DStoragePackBuilder(); // calls close()
+
+    // alignment: alignment of the offset of each asset in the pack file.
+    bool open(const char* path, uint32_t alignment = 16);
+    // compress: store GDeflate compressed data. chunk_size is the same as WriteCompressedFile().
+    // returns false if the name is already added.
+    bool add(std::string_view name, const void* data, size_t size, bool compress = false, uint32_t chunk_size = 0);
+    bool add_file(std::string_view name, const char* path, bool compress = false, uint32_t chunk_size = 0);
+    // writes the index and closes the file.
+    bool close();
+
+private:
+    struct PImpl;
+    std::unique_ptr<PImpl> pimpl_;
+};
+
 } // namespace ist
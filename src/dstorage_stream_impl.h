@@ -0,0 +1,502 @@
+﻿#pragma once
+// shared by dstorage_stream.cpp and dstorage_stream_posix.cpp.
+// platform-independent parts of DStorageStreamBuf live in dstorage_stream.cpp, and each platform provides
+// the engine (reading files into the buffer), file probing and buffer allocation declared here.
+#include "dstorage_stream.h"
+#include "mmap_stream.h"
+#include "internal.h"
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <span>
+#include <string>
+#ifdef _WIN32
+#include <dstorage.h>
+#include <winrt/base.h>
+#endif
+
+
+namespace ist {
+
+#ifdef _WIN32
+using winrt::check_hresult;
+using winrt::com_ptr;
+#endif
+
+#pragma region Stats
+extern std::atomic<uint64_t> g_stat_open_streams;
+extern std::atomic<uint64_t> g_stat_inflight_requests;
+extern std::atomic<uint64_t> g_stat_inflight_bytes;
+extern std::atomic<uint64_t> g_stat_total_streams;
+extern std::atomic<uint64_t> g_stat_total_bytes;
+extern std::atomic<uint64_t> g_stat_errors;
+extern std::atomic<uint64_t> g_stat_cancelled;
+extern std::atomic<uint64_t> g_stat_buffer_pool_hits;
+extern std::atomic<uint64_t> g_stat_buffer_pool_misses;
+
+inline uint64_t NowNS()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace(TraceEventType type, TracePhase phase, const void* stream, int64_t value = 0);
+
+// records begin on construction and end on destruction
+class TraceScope
+{
+public:
+    TraceScope(TraceEventType type, const void* stream, int64_t value = 0)
+        : type_(type), stream_(stream), value_(value)
+    {
+        Trace(type_, TracePhase::begin, stream_, value_);
+    }
+
+    ~TraceScope()
+    {
+        Trace(type_, TracePhase::end, stream_, value_);
+    }
+
+private:
+    TraceEventType type_;
+    const void* stream_;
+    int64_t value_;
+};
+
+// calls f on scope exit
+template<class F>
+class ScopeExit
+{
+public:
+    ScopeExit(F&& f) : f_(std::move(f)) {}
+    ~ScopeExit() { f_(); }
+
+private:
+    F f_;
+};
+#pragma endregion Stats
+
+
+#pragma region Misc
+// settings shared by all platforms. see DStorageStream::set_staging_buffer_size() etc.
+extern uint32_t g_ds_staging_buffer_size;
+extern uint32_t g_ds_small_file_threshold;
+extern uint32_t g_ds_streaming_ring_size;
+extern std::atomic_bool g_ds_adaptive; // see DStorageStream::enable_adaptive_request_size()
+static constexpr uint32_t g_ds_first_request_size = 256 * 1024;
+static constexpr uint64_t g_sector_size = 4096; // alignment for unbuffered reads. covers both 512e and 4Kn drives
+
+// platform layer. defined in dstorage_stream.cpp on Windows and in dstorage_stream_posix.cpp elsewhere.
+size_t GetPageSize();
+size_t GetLargePageSize(); // 0 if large pages are not available
+char* AllocateMemory(size_t size, bool large_pages, int numa_node);
+void FreeMemory(char* p, size_t size);
+void PrefetchMemory(char* p, size_t size); // commits pages in background
+std::wstring ToWString(std::string_view str);
+bool WriteCompressedData(MMapStream& ofs, uint64_t base, const void* data, size_t size, uint32_t chunk_size, uint64_t& written);
+
+struct DStoragePack::PImpl
+{
+    std::wstring path_;
+    MemoryMappedFile mmap_; // only header, index and chunk tables are touched
+#ifdef _WIN32
+    com_ptr<IDStorageFile> file_; // shared by all streams of assets in this pack
+#else
+    std::shared_ptr<ScopedFD> file_; // shared by all streams of assets in this pack
+#endif
+    std::span<const PackEntry> entries_;
+    const char* names_ = nullptr;
+
+    std::string_view name(const PackEntry& e) const { return { names_ + e.name_offset, e.name_size }; }
+};
+#pragma endregion Misc
+
+
+#pragma region FileCache
+
+// LRU cache of opened files and file size keyed by path.
+class FileCache
+{
+public:
+#ifdef _WIN32
+    using path_type = std::wstring;
+    using file_ptr = com_ptr<IDStorageFile>;
+#else
+    using path_type = std::string; // UTF-8
+    using file_ptr = std::shared_ptr<ScopedFD>;
+#endif
+
+    struct FileInfo
+    {
+        uint64_t size = 0;
+        uint64_t last_write_time = 0; // FILETIME on Windows, st_mtim in nanoseconds elsewhere
+        file_ptr file; // null if not cached
+    };
+
+    static FileCache& instance()
+    {
+        static FileCache s_instance;
+        return s_instance;
+    }
+
+    // get file size and cached file if exists. returns false if the file does not exist.
+    // GetLastError() (errno on POSIX) tells the reason in that case.
+    bool query(const path_type& path, FileInfo& dst)
+    {
+        if (capacity_ > 0 && !validate_) {
+            // no validation. a cache hit doesn't touch the file system at all.
+            std::unique_lock lock{ mutex_ };
+            auto it = entries_.find(path);
+            if (it != entries_.end()) {
+                touch(it);
+                dst = it->second.info;
+                return true;
+            }
+        }
+
+        if (!probe(path, dst)) {
+            if (capacity_ > 0) {
+                std::unique_lock lock{ mutex_ };
+                erase(path);
+            }
+            return false;
+        }
+        dst.file = {};
+
+        if (capacity_ > 0) {
+            std::unique_lock lock{ mutex_ };
+            auto it = entries_.find(path);
+            if (it != entries_.end()) {
+                const FileInfo& cached = it->second.info;
+                if (cached.size == dst.size && cached.last_write_time == dst.last_write_time) {
+                    touch(it);
+                    dst.file = cached.file;
+                }
+                else {
+                    // file has been changed
+                    erase(path);
+                }
+            }
+        }
+        return true;
+    }
+
+    // called after the file is opened.
+    void store(const path_type& path, const FileInfo& info)
+    {
+        if (capacity_ == 0) {
+            return;
+        }
+        std::unique_lock lock{ mutex_ };
+        auto it = entries_.find(path);
+        if (it != entries_.end()) {
+            it->second.info = info;
+            touch(it);
+        }
+        else {
+            lru_.push_front(path);
+            entries_.emplace(path, Entry{ info, lru_.begin() });
+            trim();
+        }
+    }
+
+    void set_capacity(size_t v, bool validate)
+    {
+        std::unique_lock lock{ mutex_ };
+        capacity_ = v;
+        validate_ = validate;
+        trim();
+    }
+
+    size_t get_capacity() const
+    {
+        return capacity_;
+    }
+
+    void clear()
+    {
+        std::unique_lock lock{ mutex_ };
+        entries_.clear();
+        lru_.clear();
+    }
+
+private:
+    struct Entry
+    {
+        FileInfo info;
+        std::list<path_type>::iterator lru_pos;
+    };
+    using Entries = std::unordered_map<path_type, Entry>;
+
+    // fills size and last_write_time. returns false if the file does not exist or is a directory. platform layer.
+    static bool probe(const path_type& path, FileInfo& dst);
+
+    // mutex_ must be locked for these
+    void touch(Entries::iterator it)
+    {
+        lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+    }
+
+    void erase(const path_type& path)
+    {
+        auto it = entries_.find(path);
+        if (it != entries_.end()) {
+            lru_.erase(it->second.lru_pos);
+            entries_.erase(it);
+        }
+    }
+
+    void trim()
+    {
+        while (entries_.size() > capacity_) {
+            entries_.erase(lru_.back());
+            lru_.pop_back();
+        }
+    }
+
+    std::mutex mutex_;
+    Entries entries_;
+    std::list<path_type> lru_; // most recently used first
+    std::atomic<size_t> capacity_{ 0 };
+    std::atomic_bool validate_{ true };
+};
+
+#pragma endregion FileCache
+
+
+#pragma region DStorageStreamBuf
+
+#ifdef _WIN32
+// something that waits for fence signals.
+class CompletionTarget
+{
+public:
+    virtual ~CompletionTarget() {}
+
+    // called from the reactor thread when wake event is signaled.
+    // must call ID3D12Fence::SetEventOnCompletion() with wake_event for the next value to wait.
+    // landed_bytes: add bytes read from the file since the last call. for throughput measurement.
+    // returns true if completed and no longer needs to be watched.
+    virtual bool update(HANDLE wake_event, uint64_t& landed_bytes) = 0;
+};
+#else
+class IoUringEngine;
+#endif
+
+struct DStorageStreamBuf::PImpl
+#ifdef _WIN32
+    : public CompletionTarget
+#endif
+{
+    using PImplPtr = std::shared_ptr<PImpl>;
+
+    // one block == one request (DSTORAGE_REQUEST or one read of the fallback engines)
+    struct Block
+    {
+        uint64_t file_offset = 0;
+        uint64_t buffer_offset = 0;
+        uint32_t size = 0; // uncompressed size
+#ifdef _WIN32
+        uint32_t source_size = 0; // compressed size. == size if not compressed
+        uint8_t compression = DSTORAGE_COMPRESSION_FORMAT_NONE;
+        uint64_t fence_value = 0; // relative to fence_base_
+#endif
+    };
+
+    BufferPtr buf_;
+    FileCache::path_type path_;
+
+    // caller-provided destination memory. buf_ points to it if set.
+    char* user_buffer_ = nullptr;
+    size_t user_buffer_size_ = 0;
+
+    // set if reading an asset in a pack file. the file and file size are taken from it.
+    std::shared_ptr<DStoragePack::PImpl> pack_;
+    uint64_t pack_offset_ = 0; // offset of the asset. compressed chunk offsets are relative to this.
+
+    uint64_t file_size_on_disk_ = 0; // for FileCache
+    uint64_t file_time_ = 0; // last write time. for FileCache
+    std::vector<Block> blocks_;
+    uint64_t file_size_ = 0; // size of buffer. == file size unless ranged read.
+    std::ios::openmode mode_{};
+    std::atomic<status_code> state_{ status_code::idle };
+    std::atomic_bool cancel_requested_{ false };
+    block_callback on_block_;
+
+    // consumer side
+    uint64_t read_size_ = 0;
+    size_t block_pos_ = 0; // number of blocks reflected to read_size_
+    size_t polled_blocks_ = 0; // number of blocks reported by poll_block() / wait_any_block()
+
+    // engine side
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::atomic<size_t> completed_blocks_{ 0 }; // all blocks before this are completed
+    std::vector<uint32_t> landed_; // indices of completed blocks in completion order. guarded by mutex_
+    std::vector<bool> done_; // completion flag of each block. guarded by mutex_
+    error_info error_{}; // first failure. guarded by mutex_
+
+    // coroutines suspended by awaiter. resumed by notify(). guarded by mutex_
+    struct Waiter
+    {
+        awaiter::kind what;
+        uint64_t pos, size;
+        std::coroutine_handle<> handle;
+        executor exec;
+    };
+    std::vector<Waiter> waiters_;
+
+    // verify mode
+    bool verify_ = false; // memory destination with `verify`
+    bool has_expected_checksum_ = false; // guarded by mutex_ once launched. set_expected_checksum() may race with the engine
+    uint32_t expected_checksum_ = 0;
+    bool has_pending_checksum_ = false; // set by set_expected_checksum() on an idle stream for the next open()
+    uint32_t pending_checksum_ = 0;
+    uint32_t checksum_ = 0;
+    std::vector<uint32_t> block_checksums_;
+
+    // streaming mode. buf_ is a ring of ring_slots_ slots, and block i is read into slot i % ring_slots_.
+    // block i is issued only after the consumer released block i - ring_slots_.
+    bool streaming_ = false;
+    size_t ring_slots_ = 0;
+    uint64_t slot_size_ = 0;
+    std::atomic<size_t> released_blocks_{ 0 }; // the consumer is done with blocks before this
+
+    // stats. see stream_stats. times are relative to open_time_.
+    uint64_t open_time_ = 0;
+    uint64_t probe_ns_ = 0;
+    std::atomic<uint64_t> open_file_ns_{ 0 };
+    std::atomic<uint64_t> submit_ns_{ 0 };
+    std::atomic<uint64_t> first_block_ns_{ 0 };
+    std::atomic<uint64_t> total_ns_{ 0 };
+    std::atomic<uint64_t> bytes_{ 0 };
+
+    // members below are touched only by the engine thread once pushed.
+    bool unbuffered_ = false; // FILE_FLAG_NO_BUFFERING / O_DIRECT. all blocks are sector-aligned
+    size_t next_request_ = 0;
+    size_t outstanding_ = 0;
+    bool io_failed_ = false;
+    bool cancel_issued_ = false;
+
+#ifdef _WIN32
+    enum class destination
+    {
+        memory,
+        buffer,
+        texture_region,
+        multiple_subresources,
+    };
+
+    // GPU destinations. buf_ is null in these cases.
+    destination destination_ = destination::memory;
+    com_ptr<ID3D12Resource> resource_;
+    uint64_t resource_offset_ = 0;
+    texture_region region_{};
+
+    com_ptr<IDStorageFile> file_; // taken from FileCache or the pack, or opened by open_file()
+    com_ptr<IDStorageQueue> queue_;
+    com_ptr<IDStorageStatusArray> status_; // one entry per block
+    com_ptr<ID3D12Fence> fence_;
+    uint64_t fence_base_ = 0; // fence value before the first request. fence is shared with other streams.
+    size_t armed_block_ = ~size_t(0);
+    std::atomic<int> hash_pending_{ 0 }; // number of hashing tasks in flight
+
+    // Win32 overlapped I/O fallback. streaming mode is always read by it.
+    bool overlapped_ = false; // read by OverlappedEngine instead of DirectStorage
+    ScopedHandle handle_;
+    std::vector<OVERLAPPED> requests_; // one per block
+#else
+    // one per block. its address is the user_data of the SQE.
+    struct Request
+    {
+        PImpl* owner = nullptr;
+        uint32_t block = 0;
+        uint32_t done = 0; // bytes read so far. short reads are resubmitted for the rest
+        bool pending = false; // submitted and not completed yet
+    };
+
+    // GPU destinations need DirectStorage. open fails with error_dll_not_found.
+    bool gpu_ = false;
+
+    std::shared_ptr<ScopedFD> file_; // taken from FileCache or the pack, or opened by open_file()
+    std::shared_ptr<ScopedFD> cached_file_; // from FileCache. used unless reading with O_DIRECT
+    int priority_ = 0;
+
+    std::vector<Request> requests_; // one per block
+    std::vector<uint32_t> retries_; // blocks to resubmit after short reads
+    int buffer_slot_ = -1; // index in the registered buffer table. -1 if not registered
+#endif
+
+    // requests are in flight (or about to be). idle streams are never opened and never become finished.
+    static bool is_busy(status_code v) { return v == status_code::launched || v == status_code::reading; }
+
+    // opens files of launched streams and passes them to the engine.
+    // PImpl is passed instead of DStorageStreamBuf because the stream can be moved (swapped) while reading.
+    static void start(std::vector<PImplPtr>&& targets);
+
+    bool build_blocks(std::span<const range> ranges, uint64_t file_size);
+    bool is_small() const;
+    status_code read_small();
+    bool can_read_unbuffered() const;
+    void setup_streaming(); // decides streaming_ after build_blocks()
+
+    // can be called from any thread
+    void cancel();
+    uint64_t elapsed() const { return NowNS() - open_time_; }
+
+    // called from the engine thread (or worker thread on error)
+    void finish(status_code state);
+    void hash_blocks(size_t first, size_t last);
+    bool check_checksum(); // combines block checksums. sets error_ on mismatch.
+    bool verify_checksum_locked(); // compares checksum_ with the expected value. sets error_ on mismatch. mutex_ must be held
+    void record_landed(uint64_t bytes);
+    void record_finish(status_code state);
+
+    // called from consumer thread
+    size_t wait_blocks(size_t current);
+    bool covered(uint64_t pos, uint64_t size) const; // mutex_ must be locked
+    bool is_ready(const awaiter& a) const; // mutex_ must be locked for range
+    void notify(); // wakes wait methods and resumes coroutines of which conditions are met
+    void wait_finish();
+    bool next_landed(block& dst, bool wait);
+    bool wait_range(uint64_t pos, uint64_t size);
+    void release_blocks(size_t n); // streaming mode. lets the engine reuse slots of blocks before n
+
+    block get_block(size_t i) const { return { blocks_[i].buffer_offset, blocks_[i].size }; }
+    char* block_data(size_t i) const { return buf_.get() + (streaming_ ? (i % ring_slots_) * slot_size_ : blocks_[i].buffer_offset); }
+    uint64_t buffer_size() const { return streaming_ ? ring_slots_ * slot_size_ : file_size_; }
+
+#ifdef _WIN32
+    bool has_caller_destination() const { return user_buffer_ || resource_; } // must not be written after close()
+    status_code build_compressed_blocks(uint64_t file_size);
+
+    // called from worker thread
+    HRESULT open_file();
+    // called from the submitter thread
+    bool enqueue_requests(); // g_ds_mutex must be locked
+    uint64_t tag() const { return (uint64_t)this; } // for CancelRequestsWithTag()
+
+    // called from the reactor thread
+    bool update(HANDLE wake_event, uint64_t& landed_bytes) override;
+
+    // called from the overlapped engine thread
+    void on_read(OVERLAPPED* ov, DWORD bytes, DWORD error);
+    bool pump(); // issues reads up to the queue depth. returns true if finished.
+#else
+    bool has_caller_destination() const { return user_buffer_ != nullptr; } // must not be written after close()
+    long open_file(); // returns negated errno on failure
+
+    // called from the engine thread
+    void on_read(Request& r, int result);
+    bool pump(IoUringEngine& engine); // issues reads up to the queue depth. returns true if finished.
+    void issue(IoUringEngine& engine, Request& r);
+#endif
+};
+
+#pragma endregion DStorageStreamBuf
+
+} // namespace ist
@@ -0,0 +1,1200 @@
+﻿// POSIX engine of DStorageStreamBuf. see dstorage_stream.cpp for Windows and the platform-independent parts.
+// there is no DirectStorage. files are read by io_uring (or pread() where it is not available) into memory.
+// GDeflate and GPU destinations fail with error_dll_not_found.
+#ifndef _WIN32
+#include "dstorage_stream_impl.h"
+
+#include <algorithm>
+#include <thread>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define DS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/mempolicy.h>)
+#define DS_MBIND
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+
+namespace ist {
+
+#pragma region Misc
+
+// global variables
+static bool g_ds_force_file_buffering = false;
+
+// io_uring engine. see IoUringEngine.
+static constexpr uint32_t g_io_request_size = 1024 * 1024;
+static constexpr size_t g_io_queue_depth = 16; // outstanding reads per stream
+static constexpr unsigned g_io_ring_entries = 256;
+static constexpr unsigned g_io_buffer_slots = 256; // registered buffer table
+static constexpr size_t g_io_max_registered_size = 1024 * 1024 * 1024; // limit of the kernel for one registered buffer
+#ifdef O_DIRECT
+static constexpr int g_io_direct_flag = O_DIRECT;
+#else
+static constexpr int g_io_direct_flag = 0; // not available. reads are always buffered
+#endif
+
+
+// there is no D3D12 device on POSIX. these are kept for source compatibility.
+void DStorageStream::set_device(ID3D12Device*, IDStorageFactory*, IDStorageQueue*)
+{
+}
+
+void DStorageStream::set_device(ID3D12Device*, IDStorageFactory*, std::span<IDStorageQueue* const>)
+{
+}
+
+void DStorageStream::release_device()
+{
+    ClearFileCache();
+}
+
+void DStorageStream::force_overlapped_io(bool)
+{
+    // reads always go through IoUringEngine
+}
+
+bool DStorageStream::is_direct_storage_available()
+{
+    return false;
+}
+
+void DStorageStream::disable_bypassio(bool)
+{
+}
+
+void DStorageStream::force_file_buffering(bool v)
+{
+    // disables O_DIRECT
+    g_ds_force_file_buffering = v;
+}
+
+void DStorageStream::enable_debug(bool)
+{
+}
+
+DStorageStream::request_size_info DStorageStream::get_request_size_info()
+{
+    // requests are smaller than the staging buffer to keep many of them in flight.
+    // with adaptive sizing, they start small and grow up to that. throughput is not measured.
+    request_size_info r;
+    r.adaptive = g_ds_adaptive;
+    r.staging_buffer_size = g_ds_staging_buffer_size;
+    r.max_request_size = std::min(g_io_request_size, g_ds_staging_buffer_size);
+    r.first_request_size = r.adaptive ? std::min(g_ds_first_request_size, r.max_request_size) : r.max_request_size;
+    return r;
+}
+
+size_t GetPageSize()
+{
+    static const size_t page_size = (size_t)::sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+// huge pages must be reserved by the system (vm.nr_hugepages), otherwise MAP_HUGETLB fails.
+// returns 0 if huge pages are not available.
+size_t GetLargePageSize()
+{
+    static const size_t large_page_size = []() -> size_t {
+#ifdef MAP_HUGETLB
+        size_t size = 0;
+        if (FILE* f = ::fopen("/proc/meminfo", "r")) {
+            char line[256];
+            size_t kb = 0;
+            while (::fgets(line, sizeof(line), f)) {
+                if (::sscanf(line, "Hugepagesize: %zu kB", &kb) == 1) {
+                    size = kb * 1024;
+                    break;
+                }
+            }
+            ::fclose(f);
+        }
+        if (size == 0) {
+            return 0;
+        }
+
+        // see if any huge page is actually reserved
+        void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            return 0;
+        }
+        ::munmap(p, size);
+        return size;
+#else
+        return 0;
+#endif
+        }();
+    return large_page_size;
+}
+
+char* AllocateMemory(size_t size, bool large_pages, int numa_node)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_HUGETLB
+    if (large_pages) {
+        flags |= MAP_HUGETLB;
+    }
+#endif
+    void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) {
+        return nullptr;
+    }
+#ifdef DS_MBIND
+    if (numa_node >= 0 && numa_node < 64) {
+        // preferred node. pages are allocated on it when they are first touched, and on other nodes if it is full.
+        unsigned long mask = 1ul << numa_node;
+        ::syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+#endif
+    return (char*)p;
+}
+
+void FreeMemory(char* p, size_t size)
+{
+    ::munmap(p, size);
+}
+
+void PrefetchMemory(char* p, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+    RunAsync([p, size]() {
+        DS_PROFILE_SCOPE("AsyncBufferPrefetch");
+        // anonymous pages are allocated on the first touch. this populates them without writing,
+        // so it can race with reads landing in the buffer. (Linux 5.14+. no-op on older kernels)
+        ::madvise(p, size, MADV_POPULATE_WRITE);
+        });
+#else
+    (void)p;
+    (void)size;
+#endif
+}
+
+// paths are UTF-8 on POSIX. wchar_t is UTF-32.
+std::wstring ToWString(std::string_view str)
+{
+    std::wstring r;
+    r.reserve(str.size());
+    for (size_t i = 0; i < str.size(); ) {
+        uint8_t c = (uint8_t)str[i++];
+        int n = c < 0x80 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : 3;
+        uint32_t cp = n == 0 ? c : c & (0x3f >> n);
+        for (; n > 0 && i < str.size(); --n) {
+            cp = (cp << 6) | (str[i++] & 0x3f);
+        }
+        r.push_back((wchar_t)cp);
+    }
+    return r;
+}
+
+static std::string ToUTF8(std::wstring_view str)
+{
+    std::string r;
+    r.reserve(str.size());
+    for (wchar_t wc : str) {
+        uint32_t c = (uint32_t)wc;
+        if (c < 0x80) {
+            r += (char)c;
+        }
+        else if (c < 0x800) {
+            r += (char)(0xc0 | (c >> 6));
+            r += (char)(0x80 | (c & 0x3f));
+        }
+        else if (c < 0x10000) {
+            r += (char)(0xe0 | (c >> 12));
+            r += (char)(0x80 | ((c >> 6) & 0x3f));
+            r += (char)(0x80 | (c & 0x3f));
+        }
+        else {
+            r += (char)(0xf0 | (c >> 18));
+            r += (char)(0x80 | ((c >> 12) & 0x3f));
+            r += (char)(0x80 | ((c >> 6) & 0x3f));
+            r += (char)(0x80 | (c & 0x3f));
+        }
+    }
+    return r;
+}
+
+// pread() until size bytes are read. errno is ENODATA if the file ends before that.
+static bool PReadFull(int fd, char* dst, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = ::pread(fd, dst, size, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = ENODATA;
+            }
+            return false;
+        }
+        dst += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+#pragma endregion Misc
+
+#pragma region FileCache
+
+bool FileCache::probe(const path_type& path, FileInfo& dst)
+{
+    struct stat st {};
+    if (::stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        errno = EISDIR;
+        return false;
+    }
+    dst.size = (uint64_t)st.st_size;
+    dst.last_write_time = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+#pragma endregion FileCache
+
+#pragma region DStorageStreamBuf
+
+// one library-owned thread issues reads of all streams and reaps their completions through one io_uring.
+// SQEs of all streams are batched into one io_uring_enter() per iteration, and each stream keeps multiple reads in flight.
+// buffers of multi-block streams are registered to the ring while reading, so that the kernel doesn't pin the pages per read.
+// if io_uring is not available (old kernel, seccomp in containers, or not Linux), reads are done by pread() on the same thread.
+class IoUringEngine
+{
+public:
+    using PImplPtr = std::shared_ptr<DStorageStreamBuf::PImpl>;
+    using Request = DStorageStreamBuf::PImpl::Request;
+
+    static IoUringEngine& instance()
+    {
+        static IoUringEngine s_instance;
+        return s_instance;
+    }
+
+    // files of the streams must be opened
+    void push(std::span<PImplPtr> targets)
+    {
+        if (targets.empty()) {
+            return;
+        }
+        {
+            std::unique_lock lock{ mutex_ };
+            for (auto& t : targets) {
+                added_.push_back(std::move(t));
+            }
+        }
+        kick();
+    }
+
+    // wakes the engine thread. all streams are pumped, and cancelled ones see cancel_requested_.
+    void kick()
+    {
+        char c = 0;
+        (void)!::write(wake_[1].get(), &c, 1);
+    }
+
+    // called from the engine thread
+    bool can_issue() const
+    {
+#ifdef DS_IO_URING
+        // keep completions within the CQ ring. one entry is for the wake read.
+        if (ring_) {
+            return inflight_ + 1 < cq_entries_;
+        }
+#endif
+        return true;
+    }
+
+    void read(Request& r, int fd, char* dst, uint32_t size, uint64_t offset, int buf_index)
+    {
+#ifdef DS_IO_URING
+        if (ring_) {
+            bool queued = prep([&](io_uring_sqe& sqe) {
+                sqe.opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                sqe.fd = fd;
+                sqe.off = offset;
+                sqe.addr = (uint64_t)dst;
+                sqe.len = size;
+                sqe.buf_index = (uint16_t)std::max(buf_index, 0);
+                sqe.user_data = (uint64_t)&r;
+                });
+            if (queued) {
+                return;
+            }
+        }
+#endif
+        // synchronous. the completion is handled in the next iteration of run() in the same way as CQEs.
+        ssize_t n;
+        do {
+            n = ::pread(fd, dst, size, (off_t)offset);
+        } while (n < 0 && errno == EINTR);
+        completions_.push_back({ &r, n >= 0 ? (int)n : -errno });
+    }
+
+    void cancel(Request& r)
+    {
+#ifdef DS_IO_URING
+        if (ring_) {
+            prep([&](io_uring_sqe& sqe) {
+                sqe.opcode = IORING_OP_ASYNC_CANCEL;
+                sqe.fd = -1;
+                sqe.addr = (uint64_t)&r;
+                sqe.user_data = cancel_tag;
+                });
+        }
+#endif
+    }
+
+private:
+    static constexpr uint64_t wake_tag = 0;
+    static constexpr uint64_t cancel_tag = 1;
+
+    struct Completion
+    {
+        Request* request;
+        int result; // bytes read or negated errno
+    };
+
+    IoUringEngine()
+    {
+        int fds[2];
+        if (::pipe(fds) == 0) {
+            wake_[0].reset(fds[0]);
+            wake_[1].reset(fds[1]);
+            ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+            ::fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        }
+#ifdef DS_IO_URING
+        setup_ring();
+#endif
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    ~IoUringEngine()
+    {
+        stop_ = true;
+        kick();
+        thread_.join();
+#ifdef DS_IO_URING
+        teardown_ring();
+#endif
+    }
+
+    void run()
+    {
+        std::vector<PImplPtr> added;
+        while (!stop_) {
+            wait();
+
+            DS_PROFILE_SCOPE("IoUringEngine::run()");
+            for (auto& c : completions_) {
+                c.request->owner->on_read(*c.request, c.result);
+            }
+            completions_.clear();
+
+            {
+                std::unique_lock lock{ mutex_ };
+                added.swap(added_);
+            }
+            for (auto& m : added) {
+                m->requests_.resize(m->blocks_.size());
+                if (m->blocks_.size() > 1) {
+                    // the tail of O_DIRECT reads goes beyond file_size_ up to the sector boundary
+                    // (slots of the ring are sector-aligned)
+                    size_t size = m->unbuffered_ ? (m->buffer_size() + g_sector_size - 1) & ~(g_sector_size - 1) : m->buffer_size();
+                    m->buffer_slot_ = register_buffer(m->buf_.get(), size);
+                }
+                // higher priority first. streams of the same priority are served in FIFO order.
+                auto pos = std::find_if(active_.begin(), active_.end(), [&](auto& a) { return a->priority_ < m->priority_; });
+                active_.insert(pos, std::move(m));
+            }
+            added.clear();
+
+            std::erase_if(active_, [this](auto& m) {
+                if (!m->pump(*this)) {
+                    return false;
+                }
+                if (m->buffer_slot_ >= 0) {
+                    unregister_buffer(m->buffer_slot_);
+                    m->buffer_slot_ = -1;
+                }
+                return true;
+                });
+        }
+    }
+
+    // wait for completions or wake up.
+    void wait()
+    {
+#ifdef DS_IO_URING
+        if (ring_) {
+            if (!wake_armed_) {
+                wake_armed_ = prep([&](io_uring_sqe& sqe) {
+                    sqe.opcode = IORING_OP_READ;
+                    sqe.fd = wake_[0].get();
+                    sqe.addr = (uint64_t)wake_buf_;
+                    sqe.len = sizeof(wake_buf_);
+                    sqe.user_data = wake_tag;
+                    });
+            }
+            // submit all SQEs prepared by pump() at once. the wake read is always in flight, so waiting can't hang.
+            submit(completions_.empty() ? 1 : 0);
+            reap();
+            return;
+        }
+#endif
+        // reads are synchronous here. active streams without completions are waiting for kick() (e.g. released ring slots).
+        pollfd pfd{ wake_[0].get(), POLLIN, 0 };
+        if (::poll(&pfd, 1, completions_.empty() ? -1 : 0) > 0) {
+            (void)!::read(wake_[0].get(), wake_buf_, sizeof(wake_buf_));
+        }
+    }
+
+#ifdef DS_IO_URING
+    bool setup_ring()
+    {
+        io_uring_params p{};
+        int fd = (int)::syscall(__NR_io_uring_setup, g_io_ring_entries, &p);
+        if (fd < 0) {
+            return false;
+        }
+        ring_.reset(fd);
+
+        sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mmap ? sq_ring_ :
+            ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+            sqes_ = sqes == MAP_FAILED ? nullptr : (io_uring_sqe*)sqes;
+            teardown_ring();
+            return false;
+        }
+        sqes_ = (io_uring_sqe*)sqes;
+
+        char* sq = (char*)sq_ring_;
+        sq_head_ = (unsigned*)(sq + p.sq_off.head);
+        sq_tail_ = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask_ = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array_ = (unsigned*)(sq + p.sq_off.array);
+        sq_entries_ = p.sq_entries;
+        char* cq = (char*)cq_ring_;
+        cq_head_ = (unsigned*)(cq + p.cq_off.head);
+        cq_tail_ = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask_ = *(unsigned*)(cq + p.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        cq_entries_ = p.cq_entries;
+
+#ifdef IORING_RSRC_REGISTER_SPARSE
+        // empty table for registered buffers. slots are filled by register_buffer(). (Linux 5.19+)
+        io_uring_rsrc_register reg{};
+        reg.nr = g_io_buffer_slots;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0) {
+            for (unsigned i = g_io_buffer_slots; i > 0; --i) {
+                free_buffer_slots_.push_back(int(i - 1));
+            }
+        }
+#endif
+        return true;
+    }
+
+    void teardown_ring()
+    {
+        if (sqes_) {
+            ::munmap(sqes_, sqes_size_);
+        }
+        if (cq_ring_ && cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+            ::munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sq_ring_ && sq_ring_ != MAP_FAILED) {
+            ::munmap(sq_ring_, sq_ring_size_);
+        }
+        sqes_ = nullptr;
+        sq_ring_ = cq_ring_ = nullptr;
+        ring_.reset();
+    }
+
+    // fills an SQE by f. submits prepared ones if the SQ ring is full. returns false if no SQE is available.
+    template<class F>
+    bool prep(F&& f)
+    {
+        unsigned tail = *sq_tail_; // only this thread writes it
+        if (tail - std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire) >= sq_entries_) {
+            submit(0);
+            if (tail - std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire) >= sq_entries_) {
+                return false;
+            }
+        }
+        unsigned i = tail & sq_mask_;
+        io_uring_sqe& sqe = sqes_[i];
+        std::memset(&sqe, 0, sizeof(sqe));
+        f(sqe);
+        sq_array_[i] = i;
+        std::atomic_ref<unsigned>(*sq_tail_).store(tail + 1, std::memory_order_release);
+        ++sq_pending_;
+        ++inflight_;
+        return true;
+    }
+
+    void submit(unsigned wait_nr)
+    {
+        if (sq_pending_ == 0 && wait_nr == 0) {
+            return;
+        }
+        int r;
+        do {
+            r = (int)::syscall(__NR_io_uring_enter, ring_.get(), sq_pending_, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while (r < 0 && errno == EINTR);
+        if (r > 0) {
+            sq_pending_ -= std::min<unsigned>(r, sq_pending_);
+        }
+    }
+
+    void reap()
+    {
+        unsigned head = *cq_head_; // only this thread writes it
+        unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+        for (; head != tail; ++head) {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            --inflight_;
+            if (cqe.user_data == wake_tag) {
+                wake_armed_ = false;
+            }
+            else if (cqe.user_data != cancel_tag) {
+                completions_.push_back({ (Request*)cqe.user_data, cqe.res });
+            }
+        }
+        std::atomic_ref<unsigned>(*cq_head_).store(head, std::memory_order_release);
+    }
+#endif // DS_IO_URING
+
+    // returns the slot in the registered buffer table, or -1 if not registered. the pages are pinned while registered.
+    int register_buffer(char* data, size_t size)
+    {
+#if defined(DS_IO_URING) && defined(IORING_RSRC_REGISTER_SPARSE)
+        if (!ring_ || !data || free_buffer_slots_.empty() || size > g_io_max_registered_size) {
+            return -1;
+        }
+        int slot = free_buffer_slots_.back();
+        iovec iov{ data, size };
+        io_uring_rsrc_update2 up{};
+        up.offset = (unsigned)slot;
+        up.data = (uint64_t)&iov;
+        up.nr = 1;
+        // fails for file-backed memory, or if exceeding RLIMIT_MEMLOCK. plain reads are used in that case.
+        if (::syscall(__NR_io_uring_register, ring_.get(), IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) != 1) {
+            return -1;
+        }
+        free_buffer_slots_.pop_back();
+        return slot;
+#else
+        return -1;
+#endif
+    }
+
+    void unregister_buffer(int slot)
+    {
+#if defined(DS_IO_URING) && defined(IORING_RSRC_REGISTER_SPARSE)
+        iovec iov{};
+        io_uring_rsrc_update2 up{};
+        up.offset = (unsigned)slot;
+        up.data = (uint64_t)&iov;
+        up.nr = 1;
+        ::syscall(__NR_io_uring_register, ring_.get(), IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+        free_buffer_slots_.push_back(slot);
+#endif
+    }
+
+    ScopedFD wake_[2]; // pipe. [0] is the read end
+    char wake_buf_[64];
+    std::thread thread_;
+    std::mutex mutex_;
+    std::vector<PImplPtr> added_; // guarded by mutex_
+    std::atomic_bool stop_{ false };
+
+    // engine thread only
+    std::vector<PImplPtr> active_; // keeps streams alive while reading. higher priority first
+    std::vector<Completion> completions_;
+    std::vector<int> free_buffer_slots_;
+
+#ifdef DS_IO_URING
+    ScopedFD ring_;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned cq_mask_ = 0;
+    unsigned cq_entries_ = 0;
+    unsigned sq_pending_ = 0; // prepared and not submitted yet
+    unsigned inflight_ = 0;   // prepared and not reaped yet
+    bool wake_armed_ = false;
+#endif
+};
+
+// split ranges into blocks. empty ranges means the whole file.
+bool DStorageStreamBuf::PImpl::build_blocks(std::span<const range> ranges, uint64_t file_size)
+{
+    range whole{ 0, file_size, 0 };
+    if (ranges.empty()) {
+        ranges = { &whole, 1 };
+    }
+
+    // smaller requests to keep multiple reads outstanding.
+    // with adaptive request sizing, requests start small for fast first block and grow up to max_request_size.
+    const uint32_t max_request_size = std::min(g_ds_staging_buffer_size, g_io_request_size);
+    uint32_t request_size = g_ds_adaptive ? std::min(g_ds_first_request_size, max_request_size) : max_request_size;
+
+    uint64_t buffer_pos = 0;
+    uint64_t buffer_size = 0;
+    for (const range& r : ranges) {
+        if (r.file_offset + r.size > file_size) {
+            return false;
+        }
+        if (r.buffer_offset != range::packed) {
+            buffer_pos = r.buffer_offset;
+        }
+
+        uint64_t remain = r.size;
+        uint64_t progress = 0;
+        while (remain > 0) {
+            uint32_t read_size = (uint32_t)std::min<uint64_t>(request_size, remain);
+            request_size = (uint32_t)std::min<uint64_t>(uint64_t(request_size) * 2, max_request_size);
+
+            Block block;
+            block.file_offset = r.file_offset + progress;
+            block.buffer_offset = buffer_pos + progress;
+            block.size = read_size;
+            blocks_.push_back(block);
+
+            remain -= read_size;
+            progress += read_size;
+        }
+        buffer_pos += r.size;
+        buffer_size = std::max(buffer_size, buffer_pos);
+    }
+    file_size_ = buffer_size;
+    return true;
+}
+
+// small files are read by pread() on the calling thread.
+// for them, waking the engine thread costs more than the transfer itself.
+bool DStorageStreamBuf::PImpl::is_small() const
+{
+    return file_size_ <= g_ds_small_file_threshold;
+}
+
+// O_DIRECT requires sector-aligned offsets, sizes and addresses.
+// the last block of the file is read with the size rounded up, which fits in the page-aligned buffer of CreateBuffer().
+bool DStorageStreamBuf::PImpl::can_read_unbuffered() const
+{
+    if (g_io_direct_flag == 0 || user_buffer_ || pack_ || g_ds_force_file_buffering) {
+        return false;
+    }
+    for (const Block& b : blocks_) {
+        bool aligned = b.file_offset % g_sector_size == 0 && b.buffer_offset % g_sector_size == 0;
+        bool tail = b.file_offset + b.size == file_size_on_disk_ && b.buffer_offset + b.size == file_size_;
+        if (!aligned || (b.size % g_sector_size != 0 && !tail)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+DStorageStreamBuf::status_code DStorageStreamBuf::PImpl::read_small()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::PImpl::read_small()");
+
+    if (pack_) {
+        // just copy from the mapped pack file
+        const char* src = (const char*)pack_->mmap_.data();
+        for (size_t i = 0; i < blocks_.size(); ++i) {
+            const Block& block = blocks_[i];
+            std::memcpy(buf_.get() + block.buffer_offset, src + block.file_offset, block.size);
+            record_landed(block.size);
+            landed_.push_back((uint32_t)i);
+            done_[i] = true;
+            completed_blocks_ = i + 1;
+            if (on_block_) {
+                on_block_(get_block(i));
+            }
+        }
+        if (verify_) {
+            hash_blocks(0, blocks_.size());
+            return check_checksum() ? status_code::completed : status_code::error_checksum_mismatch;
+        }
+        return status_code::completed;
+    }
+
+    ScopedFD opened;
+    int fd = cached_file_ ? cached_file_->get() : -1;
+    if (fd < 0) {
+        opened.reset(::open(path_.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!opened) {
+            error_ = { -errno, 0, 0 };
+            return status_code::error_file_open_failed;
+        }
+        fd = opened.get();
+    }
+
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        const Block& block = blocks_[i];
+        if (!PReadFull(fd, buf_.get() + block.buffer_offset, block.size, block.file_offset)) {
+            error_ = { -errno, block.file_offset, block.size };
+            return status_code::error_read_failed;
+        }
+
+        // no other threads see this stream yet. no need to lock.
+        record_landed(block.size);
+        landed_.push_back((uint32_t)i);
+        done_[i] = true;
+        completed_blocks_ = i + 1;
+        if (on_block_) {
+            on_block_(get_block(i));
+        }
+    }
+    if (verify_) {
+        hash_blocks(0, blocks_.size());
+        return check_checksum() ? status_code::completed : status_code::error_checksum_mismatch;
+    }
+    return status_code::completed;
+}
+
+long DStorageStreamBuf::PImpl::open_file()
+{
+    DS_PROFILE_SCOPE("DStorageStreamBuf::PImpl::open_file()");
+
+    if (cancel_requested_) {
+        finish(status_code::cancelled);
+        return -ECANCELED;
+    }
+    if (pack_) {
+        file_ = pack_->file_;
+        return 0;
+    }
+    if (!unbuffered_ && cached_file_) {
+        // taken from FileCache
+        file_ = std::move(cached_file_);
+        return 0;
+    }
+
+    long err = 0;
+    {
+        TraceScope trace{ TraceEventType::open_file, this };
+        uint64_t begin = NowNS();
+        int fd = -1;
+        if (unbuffered_) {
+            fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC | g_io_direct_flag);
+            if (fd < 0 && errno == EINVAL) {
+                // the file system doesn't support O_DIRECT (e.g. tmpfs)
+                unbuffered_ = false;
+            }
+        }
+        if (fd < 0 && !unbuffered_) {
+            fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        if (fd >= 0) {
+            file_ = std::make_shared<ScopedFD>(fd);
+        }
+        else {
+            err = -errno;
+        }
+        open_file_ns_ = NowNS() - begin;
+    }
+    if (err) {
+        {
+            std::unique_lock lock{ mutex_ };
+            error_ = { err, 0, 0 };
+        }
+        finish(status_code::error_file_open_failed);
+    }
+    else if (!unbuffered_) {
+        // O_DIRECT descriptors are not shared
+        FileCache::instance().store(path_, { file_size_on_disk_, file_time_, file_ });
+    }
+    return err;
+}
+
+void DStorageStreamBuf::PImpl::cancel()
+{
+    cancel_requested_ = true;
+    if (is_busy(state_.load())) {
+        IoUringEngine::instance().kick();
+    }
+}
+
+void DStorageStreamBuf::PImpl::issue(IoUringEngine& engine, Request& r)
+{
+    const Block& b = blocks_[r.block];
+    uint32_t size = unbuffered_ ? uint32_t((b.size + g_sector_size - 1) & ~(g_sector_size - 1)) : b.size;
+    r.pending = true;
+    ++outstanding_;
+    engine.read(r, file_->get(), block_data(r.block) + r.done, size - r.done, b.file_offset + r.done, buffer_slot_);
+}
+
+void DStorageStreamBuf::PImpl::on_read(Request& r, int result)
+{
+    const Block& b = blocks_[r.block];
+    r.pending = false;
+    --outstanding_;
+
+    // 0: the file ends before the block is filled. it was truncated.
+    if (result <= 0) {
+        --g_stat_inflight_requests;
+        g_stat_inflight_bytes -= b.size;
+        std::unique_lock lock{ mutex_ };
+        if (error_.hresult == 0) {
+            error_ = { result < 0 ? result : -ENODATA, b.file_offset, b.size };
+        }
+        io_failed_ = true;
+        return;
+    }
+
+    // O_DIRECT reads of the last block end at the end of the file, which is before the rounded up size.
+    r.done += (uint32_t)result;
+    if (r.done < b.size) {
+        if (unbuffered_) {
+            // O_DIRECT needs the offset and the address sector aligned. re-read the partial sector.
+            r.done &= ~uint32_t(g_sector_size - 1);
+        }
+        retries_.push_back(r.block);
+        return;
+    }
+    --g_stat_inflight_requests;
+    g_stat_inflight_bytes -= b.size;
+
+    if (verify_) {
+        hash_blocks(r.block, r.block + 1);
+    }
+    {
+        // reads complete out of order. completed_blocks_ advances over the contiguous completed prefix.
+        std::unique_lock lock{ mutex_ };
+        landed_.push_back(r.block);
+        done_[r.block] = true;
+        size_t n = completed_blocks_.load();
+        while (n < blocks_.size() && done_[n]) {
+            ++n;
+        }
+        completed_blocks_ = n;
+    }
+    record_landed(b.size);
+    notify();
+    if (on_block_ && !cancel_requested_) {
+        on_block_(get_block(r.block));
+    }
+}
+
+bool DStorageStreamBuf::PImpl::pump(IoUringEngine& engine)
+{
+    if (cancel_requested_ || io_failed_) {
+        // outstanding reads complete with -ECANCELED (or as usual if they are already done)
+        if (outstanding_ > 0 && !cancel_issued_) {
+            for (size_t i = 0; i < next_request_; ++i) {
+                if (requests_[i].pending) {
+                    engine.cancel(requests_[i]);
+                }
+            }
+            cancel_issued_ = true;
+        }
+    }
+    else {
+        bool first = next_request_ == 0;
+        while (!retries_.empty() && engine.can_issue()) {
+            issue(engine, requests_[retries_.back()]);
+            retries_.pop_back();
+        }
+        // in streaming mode, the slot of the next block may still be in use by the consumer. release_blocks() kicks the engine.
+        size_t issuable = streaming_ ? std::min(blocks_.size(), released_blocks_.load() + ring_slots_) : blocks_.size();
+        while (outstanding_ < g_io_queue_depth && next_request_ < issuable && engine.can_issue()) {
+            size_t i = next_request_++;
+            Request& r = requests_[i];
+            r = { this, (uint32_t)i };
+            ++g_stat_inflight_requests;
+            g_stat_inflight_bytes += blocks_[i].size;
+            issue(engine, r);
+        }
+        if (first && next_request_ > 0) {
+            state_ = status_code::reading;
+            submit_ns_ = elapsed();
+            Trace(TraceEventType::submit, TracePhase::instant, this, (int64_t)blocks_.size());
+        }
+    }
+
+    bool stopped = cancel_requested_ || io_failed_;
+    if (outstanding_ > 0 || (!stopped && (next_request_ < blocks_.size() || !retries_.empty()))) {
+        return false;
+    }
+    for (uint32_t i : retries_) {
+        --g_stat_inflight_requests;
+        g_stat_inflight_bytes -= blocks_[i].size;
+    }
+    retries_.clear();
+    file_.reset();
+    if (completed_blocks_.load() != blocks_.size()) {
+        finish(cancel_requested_ ? status_code::cancelled : status_code::error_read_failed);
+    }
+    else if (verify_ && !check_checksum()) {
+        finish(status_code::error_checksum_mismatch);
+    }
+    else {
+        finish(status_code::completed);
+    }
+    return true;
+}
+
+void DStorageStreamBuf::PImpl::release_blocks(size_t n)
+{
+    released_blocks_ = n;
+    if (is_busy(state_.load())) {
+        IoUringEngine::instance().kick();
+    }
+}
+
+// unlike IDStorageFactory::OpenFile(), open() costs about the same as stat() done by prepare().
+// so, files are opened on the calling thread and the streams go to IoUringEngine directly.
+// all targets are pushed at once, so their first reads go in one io_uring_enter().
+void DStorageStreamBuf::PImpl::start(std::vector<PImplPtr>&& targets)
+{
+    std::erase_if(targets, [](auto& m) { return m->open_file() != 0; });
+    IoUringEngine::instance().push(targets);
+}
+
+int DStorageStreamBuf::get_priority(std::ios::openmode mode)
+{
+    // same values as DSTORAGE_PRIORITY. IoUringEngine serves higher priority streams first.
+    // openmode is an enum. switch on int to avoid -Wswitch for flags that are not its enumerators.
+    switch (int(mode & realtime_priority)) {
+    case int(low_priority): return -1;
+    case int(high_priority): return 1;
+    case int(realtime_priority): return 2;
+    default: return 0;
+    }
+}
+
+bool DStorageStreamBuf::prepare(std::wstring&& path, std::span<const range> ranges, std::ios::openmode mode)
+{
+    auto& m = *pimpl_;
+    m.open_time_ = NowNS();
+    TraceScope trace{ TraceEventType::open, &m };
+    ScopeExit on_exit{ [&m]() {
+        status_code state = m.state_.load();
+        if (state == status_code::launched) {
+            ++g_stat_open_streams;
+        }
+        else {
+            // finished (or failed) without going to the engine
+            m.record_finish(state);
+        }
+    } };
+    if (m.has_pending_checksum_) {
+        m.has_expected_checksum_ = true;
+        m.expected_checksum_ = m.pending_checksum_;
+        m.has_pending_checksum_ = false;
+    }
+
+    // GDeflate and GPU destinations need DirectStorage
+    if (m.gpu_ || (mode & compressed)) {
+        m.state_ = status_code::error_dll_not_found;
+        return false;
+    }
+
+    m.path_ = ToUTF8(path);
+    m.mode_ = mode;
+    m.priority_ = get_priority(mode);
+    {
+        // get file size
+        uint64_t file_size = 0;
+        if (m.pack_) {
+            file_size = m.pack_->mmap_.size();
+        }
+        else {
+            FileCache::FileInfo info;
+            if (!FileCache::instance().query(m.path_, info)) {
+                m.error_ = { -errno, 0, 0 };
+                m.state_ = status_code::error_file_open_failed;
+                return false;
+            }
+            file_size = info.size;
+            m.file_size_on_disk_ = info.size;
+            m.file_time_ = info.last_write_time;
+            m.cached_file_ = std::move(info.file);
+        }
+        m.probe_ns_ = m.elapsed();
+
+        if (!m.build_blocks(ranges, file_size)) {
+            m.state_ = status_code::error_out_of_range;
+            return false;
+        }
+        if (m.blocks_.empty()) {
+            m.state_ = status_code::completed;
+            return true;
+        }
+        if ((mode & streaming) && ranges.empty() && !m.user_buffer_ && !m.is_small()) {
+            m.setup_streaming();
+        }
+
+        if (m.user_buffer_) {
+            if (m.file_size_ > m.user_buffer_size_) {
+                m.state_ = status_code::error_out_of_range;
+                return false;
+            }
+            // caller owns the memory. no-op deleter.
+            m.buf_ = BufferPtr(m.user_buffer_, [](char*) {});
+        }
+        else if (m.is_small()) {
+            // mmap() and prefetch are overkill for small buffers
+            m.buf_ = BufferPtr(new char[m.file_size_]);
+        }
+        else {
+            // allocate buffer
+            m.buf_ = CreateBuffer(m.buffer_size(), m.mode_ & async_free, true, m.mode_ & large_pages, get_numa_node(m.mode_));
+        }
+        char* gp = m.buf_.get();
+        this->setg(gp, gp, gp);
+
+        m.done_.resize(m.blocks_.size());
+        m.unbuffered_ = !m.is_small() && m.can_read_unbuffered();
+        m.verify_ = (m.mode_ & verify) != 0;
+        if (m.verify_) {
+            m.block_checksums_.resize(m.blocks_.size());
+        }
+
+        if (m.is_small()) {
+            m.state_ = m.read_small();
+            if (m.state_.load() != status_code::completed) {
+                return false;
+            }
+            wait_next_block(); // reflect all blocks to read_size() and the get area
+            return true;
+        }
+    }
+    m.state_ = status_code::launched;
+    return true;
+}
+
+bool DStorageStreamBuf::open_buffer(std::wstring&& path, ID3D12Resource*, uint64_t, std::span<const range> ranges, std::ios::openmode mode)
+{
+    close();
+    pimpl_->gpu_ = true;
+    return prepare(std::move(path), ranges, mode);
+}
+
+bool DStorageStreamBuf::open_texture(std::wstring&& path, ID3D12Resource*, const texture_region&, std::ios::openmode mode)
+{
+    close();
+    pimpl_->gpu_ = true;
+    return prepare(std::move(path), {}, mode);
+}
+
+bool DStorageStreamBuf::open_subresources(std::wstring&& path, ID3D12Resource*, uint32_t, std::ios::openmode mode)
+{
+    close();
+    pimpl_->gpu_ = true;
+    return prepare(std::move(path), {}, mode);
+}
+#pragma endregion DStorageStreamBuf
+
+#pragma region Compression
+
+// the GDeflate codec is a part of DirectStorage
+bool WriteCompressedData(MMapStream&, uint64_t, const void*, size_t, uint32_t, uint64_t&)
+{
+    return false;
+}
+
+bool WriteCompressedFile(const char*, const void*, size_t, uint32_t)
+{
+    return false;
+}
+
+bool CompressFile(const char*, const char*, uint32_t)
+{
+    return false;
+}
+
+#pragma endregion Compression
+
+#pragma region DStoragePack
+
+bool DStoragePack::open(std::string_view path)
+{
+    DS_PROFILE_SCOPE("DStoragePack::open()");
+
+    close();
+
+    auto& m = *pimpl_;
+    std::string upath(path); // UTF-8
+    m.path_ = ToWString(path);
+    if (!m.mmap_.open(upath.c_str(), std::ios::in)) {
+        close();
+        return false;
+    }
+
+    // validate header and index
+    const char* data = (const char*)m.mmap_.data();
+    uint64_t file_size = m.mmap_.size();
+    PackHeader header{};
+    if (file_size < sizeof(header)) {
+        close();
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != PackHeader::magic_value || header.version != PackHeader::current_version ||
+        header.index_offset + sizeof(PackEntry) * header.entry_count > file_size ||
+        header.names_offset + header.names_size > file_size) {
+        close();
+        return false;
+    }
+    m.entries_ = { (const PackEntry*)(data + header.index_offset), header.entry_count };
+    m.names_ = data + header.names_offset;
+    for (const PackEntry& e : m.entries_) {
+        if (e.offset + e.size > file_size || uint64_t(e.name_offset) + e.name_size > header.names_size) {
+            close();
+            return false;
+        }
+    }
+
+    // the only open() for all assets in this pack
+    ScopedFD fd(::open(upath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd) {
+        close();
+        return false;
+    }
+    m.file_ = std::make_shared<ScopedFD>(std::move(fd));
+    return true;
+}
+
+#pragma endregion DStoragePack
+
+} // namespace ist
+#endif // _WIN32
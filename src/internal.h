@@ -1,12 +1,22 @@
 ﻿#pragma once
+#ifdef _WIN32
 #define NOMINMAX
+#endif
 
 #include <cstring>
 #include <cassert>
 #include <cstdarg>
+#include <cstdint>
 #include <memory>
 #include <vector>
+#include <string_view>
+#ifdef _WIN32
 #include <windows.h>
+#include <ppltasks.h>
+#else
+#include <unistd.h>
+#include <functional>
+#endif
 
 // VTune
 #if __has_include(<ittnotify.h>)
@@ -49,6 +59,26 @@ private:
 
 namespace ist {
 
+#ifndef _WIN32
+// queues f to the worker threads of RunAsync(). see parallel.cpp
+void RunOnWorkerThread(std::function<void()>&& f);
+#endif
+
+// runs f in background. PPL's thread pool on Windows, a fixed-size pool of worker threads elsewhere.
+template<class F>
+inline void RunAsync(F&& f)
+{
+#ifdef _WIN32
+    concurrency::create_task(std::forward<F>(f));
+#else
+    // std::function needs copyable callables, but f may capture move-only objects.
+    auto shared = std::make_shared<std::decay_t<F>>(std::forward<F>(f));
+    RunOnWorkerThread([shared]() { (*shared)(); });
+#endif
+}
+
+#ifdef _WIN32
+
 class ScopedHandle
 {
 public:
@@ -94,5 +124,96 @@ private:
     HANDLE value_ = INVALID_HANDLE_VALUE;
 };
 
+#else // _WIN32
+
+// ScopedHandle for file descriptors
+class ScopedFD
+{
+public:
+    ScopedFD(const ScopedFD&) = delete;
+    ScopedFD& operator=(const ScopedFD&) = delete;
+    ScopedFD(ScopedFD&& v) noexcept { *this = std::move(v); }
+    ScopedFD& operator=(ScopedFD&& v) noexcept { swap(v); return *this; }
+
+    ScopedFD() {}
+    ScopedFD(int v) { reset(v); }
+
+    ~ScopedFD() { reset(); }
+
+    void swap(ScopedFD& v) noexcept
+    {
+        std::swap(value_, v.value_);
+    }
+
+    void reset(int v = -1)
+    {
+        if (value_ >= 0) {
+            ::close(value_);
+        }
+        value_ = v;
+    }
+
+    int release()
+    {
+        int r = value_;
+        value_ = -1;
+        return r;
+    }
+
+    int get() const { return value_; }
+
+    operator bool() const { return value_ >= 0; }
+
+private:
+    int value_ = -1;
+};
+
+#endif // _WIN32
+
+
+// pack file format. shared by the Windows and POSIX implementations of DStoragePack.
+//   PackHeader
+//   asset data... (raw bytes, or the compressed file format if compressed)
+//   PackEntry[entry_count] (sorted by name_hash)
+//   names (concatenated, not null-terminated)
+struct PackHeader
+{
+    static constexpr uint32_t magic_value = 0x4B505344; // "DSPK"
+    static constexpr uint32_t current_version = 1;
+
+    uint32_t magic = magic_value;
+    uint32_t version = current_version;
+    uint32_t entry_count = 0;
+    uint32_t reserved = 0;
+    uint64_t index_offset = 0;
+    uint64_t names_offset = 0;
+    uint64_t names_size = 0;
+};
+
+struct PackEntry
+{
+    static constexpr uint32_t flag_compressed = 0x1;
+    static constexpr uint32_t flag_checksum = 0x2; // checksum is valid. not set in packs of older builders.
+
+    uint64_t name_hash = 0;
+    uint64_t offset = 0; // from the beginning of the pack file
+    uint64_t size = 0; // size in the pack file
+    uint64_t uncompressed_size = 0;
+    uint32_t name_offset = 0; // from names_offset
+    uint32_t name_size = 0;
+    uint32_t flags = 0;
+    uint32_t checksum = 0; // CRC32C of the uncompressed data
+};
+
+// FNV-1a
+inline uint64_t HashName(std::string_view name)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (char c : name) {
+        h = (h ^ (uint8_t)c) * 0x100000001b3ull;
+    }
+    return h;
+}
+
 } // namespace ist
 
@@ -1,14 +1,49 @@
 ﻿#include "mmap_stream.h"
 #include "internal.h"
 
-#include <windows.h>
-#include <ppltasks.h>
+#include <vector>
+#include <algorithm>
+#include <mutex>
 
 
 namespace ist {
 
+// Windows implementation of MemoryMappedFile. see mmap_stream_posix.cpp for other platforms.
+// MMapStreamBuf and MMapStream are built on top of MemoryMappedFile and shared by all platforms.
+#ifdef _WIN32
 #pragma region MemoryMappedFile
 
+// placeholder APIs (Windows 10 1803+). resolved at runtime to keep working on older systems.
+using VirtualAlloc2_t = PVOID(WINAPI*)(HANDLE process, PVOID base, SIZE_T size, ULONG type, ULONG protect, void* params, ULONG param_count);
+using MapViewOfFile3_t = PVOID(WINAPI*)(HANDLE mapping, HANDLE process, PVOID base, ULONG64 offset, SIZE_T size, ULONG type, ULONG protect, void* params, ULONG param_count);
+static VirtualAlloc2_t g_VirtualAlloc2;
+static MapViewOfFile3_t g_MapViewOfFile3;
+static size_t g_mmap_reserve_size = size_t(64) * 1024 * 1024 * 1024;
+static size_t g_mmap_window_size = 1024 * 1024 * 64;
+static size_t g_mmap_window_count = 2;
+
+static bool ResolvePlaceholderAPI()
+{
+    static const bool s_available = []() {
+        if (HMODULE kernelbase = ::LoadLibraryA("kernelbase.dll")) {
+            (void*&)g_VirtualAlloc2 = ::GetProcAddress(kernelbase, "VirtualAlloc2");
+            (void*&)g_MapViewOfFile3 = ::GetProcAddress(kernelbase, "MapViewOfFile3");
+        }
+        return g_VirtualAlloc2 && g_MapViewOfFile3;
+        }();
+    return s_available;
+}
+
+static size_t GetAllocationGranularity()
+{
+    static const size_t s_granularity = []() {
+        SYSTEM_INFO si{};
+        ::GetSystemInfo(&si);
+        return (size_t)si.dwAllocationGranularity;
+        }();
+    return s_granularity;
+}
+
 struct MemoryMappedFile::PImpl
 {
     ScopedHandle file_;
@@ -17,7 +52,42 @@ struct MemoryMappedFile::PImpl
     size_t size_ = 0;
     std::ios::openmode mode_ = 0;
 
+    // growable mapping for write.
+    // a large placeholder is reserved, and sections for the grown part are mapped into it in place.
+    // so, data_ doesn't change on growth and existing views are not unmapped.
+    struct Segment
+    {
+        ScopedHandle mapping;
+        void* view = nullptr;
+        size_t size = 0;
+    };
+    std::vector<Segment> segments_;
+    size_t reserved_ = 0; // size of the placeholder. 0 if not used.
+    size_t mapped_ = 0;   // mapped part of the placeholder. aligned to the allocation granularity.
+
+    // windowed mode for read.
+    // only a few fixed-size views are mapped. the view is unmapped when the last reference is released.
+    struct Window
+    {
+        void* view = nullptr;
+        size_t pos = 0;
+        size_t size = 0;
+
+        ~Window() { ::UnmapViewOfFile(view); }
+    };
+    using WindowPtr = std::shared_ptr<Window>;
+    std::vector<WindowPtr> windows_; // least recently used first
+    size_t window_size_ = 0;
+    size_t window_count_ = 0;
+
+    // guards views from background flush. unmap() and grow() must be called with it locked.
+    std::mutex mutex_;
+
     void unmap();
+    bool grow(size_t capacity);
+    bool flush(size_t pos, size_t size, bool durable);
+    WindowPtr map_window(size_t pos);
+    WindowPtr get_window(size_t pos);
 };
 
 
@@ -83,6 +153,8 @@ bool MemoryMappedFile::open(const char* path, std::ios::openmode mode)
 
     m.mode_ = mode;
     if (mode & std::ios::out) {
+        // windowed mode is for read only
+        m.mode_ &= ~windowed;
         // open for write
         m.file_ = ScopedHandle(::CreateFileA(path,
             GENERIC_READ | GENERIC_WRITE,
@@ -110,6 +182,13 @@ bool MemoryMappedFile::open(const char* path, std::ios::openmode mode)
                 LARGE_INTEGER size;
                 ::GetFileSizeEx(m.file_.get(), &size);
                 m.size_ = size.QuadPart;
+                if (m.mode_ & windowed) {
+                    // views are mapped on demand by window()
+                    const size_t granularity = GetAllocationGranularity();
+                    m.window_size_ = std::max((g_mmap_window_size + granularity - 1) / granularity * granularity, granularity);
+                    m.window_count_ = std::max(g_mmap_window_count, size_t(2));
+                    return true;
+                }
                 m.data_ = ::MapViewOfFile(m.mapping_.get(), FILE_MAP_READ, 0, 0, 0);
                 if (m.data_) {
                     if (m.mode_ & async_prefetch) {
@@ -134,7 +213,10 @@ void MemoryMappedFile::close()
         auto& m = *pimpl_;
         auto do_close = [pimpl_ = std::move(pimpl_)]() {
             auto& m = *pimpl_;
-            m.unmap();
+            {
+                std::lock_guard lock(m.mutex_);
+                m.unmap();
+            }
             m.file_.reset();
             m.mode_ = 0;
             };
@@ -155,7 +237,10 @@ void MemoryMappedFile::close_with_truncation(size_t filesize)
     if (is_open() && m.mode_ & std::ios::out) {
         auto do_close = [pimpl_ = std::move(pimpl_), filesize]() {
             auto& m = *pimpl_;
-            m.unmap();
+            {
+                std::lock_guard lock(m.mutex_);
+                m.unmap();
+            }
 
             LARGE_INTEGER pos;
             pos.QuadPart = filesize;
@@ -176,6 +261,62 @@ void MemoryMappedFile::close_with_truncation(size_t filesize)
     }
 }
 
+void MemoryMappedFile::set_reserve_size(size_t size)
+{
+    g_mmap_reserve_size = size;
+}
+
+size_t MemoryMappedFile::get_reserve_size()
+{
+    return g_mmap_reserve_size;
+}
+
+void MemoryMappedFile::set_window_size(size_t size)
+{
+    g_mmap_window_size = size;
+}
+
+size_t MemoryMappedFile::get_window_size()
+{
+    return g_mmap_window_size;
+}
+
+void MemoryMappedFile::set_window_count(size_t count)
+{
+    g_mmap_window_count = count;
+}
+
+size_t MemoryMappedFile::get_window_count()
+{
+    return g_mmap_window_count;
+}
+
+std::span<const char> MemoryMappedFile::window(size_t pos, size_t& window_pos) const
+{
+    std::shared_ptr<const void> holder;
+    return window(pos, window_pos, holder);
+}
+
+std::span<const char> MemoryMappedFile::window(size_t pos, size_t& window_pos, std::shared_ptr<const void>& holder) const
+{
+    window_pos = 0;
+    holder.reset();
+    if (!is_open() || pos >= pimpl_->size_) {
+        return {};
+    }
+
+    auto& m = *pimpl_;
+    if (!(m.mode_ & windowed)) {
+        return { (const char*)m.data_, m.size_ };
+    }
+    if (auto w = m.get_window(pos)) {
+        window_pos = w->pos;
+        holder = w;
+        return { (const char*)w->view, w->size };
+    }
+    return {};
+}
+
 void* MemoryMappedFile::map(size_t capacity)
 {
     if (!is_open()) {
@@ -184,6 +325,12 @@ void* MemoryMappedFile::map(size_t capacity)
 
     DS_PROFILE_SCOPE("MemoryMappedFile::map()");
     auto& m = *pimpl_;
+    std::lock_guard lock(m.mutex_);
+    if ((m.mode_ & std::ios::out) && m.grow(capacity)) {
+        return m.data_;
+    }
+
+    // fallback: remap whole file. data_ is changed.
     m.unmap();
 
     LARGE_INTEGER size;
@@ -196,16 +343,203 @@ void* MemoryMappedFile::map(size_t capacity)
     return m.data_;
 }
 
+bool MemoryMappedFile::PImpl::grow(size_t capacity)
+{
+    if (g_mmap_reserve_size == 0 || !ResolvePlaceholderAPI()) {
+        return false;
+    }
+    if (mapping_) {
+        // already mapped by the fallback path
+        return false;
+    }
+
+    if (capacity <= mapped_) {
+        size_ = std::max(size_, capacity);
+        return true;
+    }
+    const size_t granularity = GetAllocationGranularity();
+    const size_t aligned = (capacity + granularity - 1) / granularity * granularity;
+
+    if (!data_) {
+        size_t reserve = std::max(g_mmap_reserve_size, aligned);
+        reserve = (reserve + granularity - 1) / granularity * granularity;
+        data_ = g_VirtualAlloc2(nullptr, nullptr, reserve, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0);
+        if (!data_) {
+            return false;
+        }
+        reserved_ = reserve;
+        mapped_ = size_ = 0;
+    }
+    if (aligned > reserved_) {
+        // exceeds the reservation. fallback to remap.
+        unmap();
+        return false;
+    }
+
+    DS_PROFILE_SCOPE("MemoryMappedFile::PImpl::grow()");
+
+    char* addr = (char*)data_ + mapped_;
+    size_t size = aligned - mapped_;
+    if (aligned < reserved_) {
+        // split the placeholder. [addr, addr + size) is to be replaced by the view.
+        if (!::VirtualFree(addr, size, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER)) {
+            return false;
+        }
+    }
+
+    // the section extends the file. views of different sections of the same file are coherent.
+    LARGE_INTEGER max_size;
+    max_size.QuadPart = aligned;
+    ScopedHandle mapping(::CreateFileMapping(file_.get(), NULL, PAGE_READWRITE, max_size.HighPart, max_size.LowPart, NULL));
+    void* view = nullptr;
+    if (mapping) {
+        view = g_MapViewOfFile3(mapping.get(), ::GetCurrentProcess(), addr, mapped_, size, MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0);
+    }
+    if (!view) {
+        if (aligned < reserved_) {
+            ::VirtualFree(addr, reserved_ - mapped_, MEM_RELEASE | MEM_COALESCE_PLACEHOLDERS);
+        }
+        return false;
+    }
+    segments_.push_back({ std::move(mapping), view, size });
+    mapped_ = aligned;
+    size_ = capacity;
+    return true;
+}
+
 void MemoryMappedFile::PImpl::unmap()
 {
     DS_PROFILE_SCOPE("MemoryMappedFile::unmap()");
 
     if (mapping_) {
-        ::UnmapViewOfFile(data_);
+        windows_.clear();
+        if (data_) {
+            ::UnmapViewOfFile(data_);
+        }
         data_ = nullptr;
         size_ = 0;
         mapping_.reset();
     }
+    else if (reserved_) {
+        for (auto& seg : segments_) {
+            ::UnmapViewOfFile(seg.view);
+        }
+        segments_.clear();
+        if (mapped_ < reserved_) {
+            // remaining placeholder
+            ::VirtualFree((char*)data_ + mapped_, 0, MEM_RELEASE);
+        }
+        data_ = nullptr;
+        size_ = 0;
+        reserved_ = mapped_ = 0;
+    }
+}
+
+MemoryMappedFile::PImpl::WindowPtr MemoryMappedFile::PImpl::map_window(size_t pos)
+{
+    DS_PROFILE_SCOPE("MemoryMappedFile::PImpl::map_window()");
+
+    LARGE_INTEGER offset;
+    offset.QuadPart = pos;
+    size_t size = std::min(window_size_, size_ - pos);
+    void* view = ::MapViewOfFile(mapping_.get(), FILE_MAP_READ, offset.HighPart, offset.LowPart, size);
+    if (!view) {
+        return nullptr;
+    }
+    auto ret = std::make_shared<Window>();
+    ret->view = view;
+    ret->pos = pos;
+    ret->size = size;
+    return ret;
+}
+
+MemoryMappedFile::PImpl::WindowPtr MemoryMappedFile::PImpl::get_window(size_t pos)
+{
+    auto find = [this](size_t wpos) {
+        return std::find_if(windows_.begin(), windows_.end(), [wpos](auto& w) { return w->pos == wpos; });
+        };
+
+    size_t wpos = pos / window_size_ * window_size_;
+    WindowPtr ret;
+    auto it = find(wpos);
+    if (it != windows_.end()) {
+        ret = *it;
+        windows_.erase(it);
+    }
+    else if (!(ret = map_window(wpos))) {
+        return nullptr;
+    }
+    windows_.push_back(ret);
+
+    // map the next window and prefetch it in background.
+    // inserted before the current one to release it first when going backward.
+    size_t next = wpos + window_size_;
+    if (next < size_ && find(next) == windows_.end()) {
+        if (auto w = map_window(next)) {
+            windows_.insert(windows_.end() - 1, w);
+            concurrency::create_task([w]() {
+                prefetch(w->view, w->size);
+                });
+        }
+    }
+
+    // release the least recently used ones. the current and the next are always kept.
+    while (windows_.size() > window_count_) {
+        windows_.erase(windows_.begin());
+    }
+    return ret;
+}
+
+bool MemoryMappedFile::PImpl::flush(size_t pos, size_t size, bool durable)
+{
+    DS_PROFILE_SCOPE("MemoryMappedFile::PImpl::flush()");
+
+    std::lock_guard lock(mutex_);
+    if (!data_ || !(mode_ & std::ios::out)) {
+        return false;
+    }
+
+    size_t end = std::min(pos + size, size_);
+    bool ret = true;
+    if (reserved_) {
+        // FlushViewOfFile() can't cross views. flush each segment.
+        for (auto& seg : segments_) {
+            size_t seg_pos = size_t((char*)seg.view - (char*)data_);
+            size_t first = std::max(pos, seg_pos);
+            size_t last = std::min(end, seg_pos + seg.size);
+            if (first < last) {
+                ret &= ::FlushViewOfFile((char*)data_ + first, last - first) != 0;
+            }
+        }
+    }
+    else if (pos < end) {
+        ret &= ::FlushViewOfFile((char*)data_ + pos, end - pos) != 0;
+    }
+
+    if (durable) {
+        ret &= ::FlushFileBuffers(file_.get()) != 0;
+    }
+    return ret;
+}
+
+bool MemoryMappedFile::flush(size_t pos, size_t size, bool durable)
+{
+    return is_open() && pimpl_->flush(pos, size, durable);
+}
+
+std::future<bool> MemoryMappedFile::flush_async(size_t pos, size_t size, bool durable)
+{
+    auto promise = std::make_shared<std::promise<bool>>();
+    auto ret = promise->get_future();
+    if (!is_open()) {
+        promise->set_value(false);
+        return ret;
+    }
+    // the task holds the PImpl. close() on the caller's side just waits the mutex if it is in progress.
+    concurrency::create_task([m = pimpl_, promise, pos, size, durable]() {
+        promise->set_value(m->flush(pos, size, durable));
+        });
+    return ret;
 }
 
 bool MemoryMappedFile::prefetch(void* ptr, size_t size)
@@ -221,13 +555,21 @@ bool MemoryMappedFile::prefetch(void* ptr, size_t size)
 bool MemoryMappedFile::prefetch(size_t pos, size_t size)
 {
     auto& m = *pimpl_;
+    if (!m.data_) {
+        // windowed mode. windows are prefetched by window().
+        return false;
+    }
     return prefetch((char*)m.data_ + pos, size);
 }
 #pragma endregion MemoryMappedFile
+#endif // _WIN32
 
 
 #pragma region MMapStreamBuf
 
+static size_t g_mmap_write_back_size = 1024 * 1024 * 32;
+static size_t g_mmap_read_ahead_size = 1024 * 1024 * 8;
+
 MMapStreamBuf::MMapStreamBuf()
 {
 }
@@ -239,6 +581,9 @@ MMapStreamBuf::MMapStreamBuf(MMapStreamBuf&& v) noexcept
 
 MMapStreamBuf::~MMapStreamBuf()
 {
+    if (write_back_.valid()) {
+        write_back_.wait();
+    }
     if (mmap_.is_open() && mmap_.mode() & std::ios::out) {
         size_t filesize = std::max(pmax_, size_t(this->pptr() - data()));
         mmap_.close_with_truncation(filesize);
@@ -256,6 +601,14 @@ void MMapStreamBuf::swap(MMapStreamBuf& v)
     super::swap(v);
     mmap_.swap(v.mmap_);
     std::swap(pmax_, v.pmax_);
+    std::swap(gbase_, v.gbase_);
+    std::swap(window_, v.window_);
+    std::swap(flushed_, v.flushed_);
+    std::swap(write_back_, v.write_back_);
+    std::swap(ra_last_end_, v.ra_last_end_);
+    std::swap(ra_stride_, v.ra_stride_);
+    std::swap(ra_hits_, v.ra_hits_);
+    std::swap(ra_end_, v.ra_end_);
 }
 
 bool MMapStreamBuf::open(const char* path, std::ios::openmode mode)
@@ -279,8 +632,16 @@ bool MMapStreamBuf::open(const std::string& path, std::ios::openmode mode)
 
 void MMapStreamBuf::close()
 {
+    if (write_back_.valid()) {
+        write_back_.wait();
+        write_back_ = {};
+    }
     mmap_.close();
+    window_.reset();
     pmax_ = 0;
+    gbase_ = 0;
+    flushed_ = 0;
+    ra_last_end_ = ra_stride_ = ra_hits_ = ra_end_ = 0;
 }
 
 bool MMapStreamBuf::is_open() const
@@ -308,6 +669,18 @@ MMapStreamBuf::pos_type MMapStreamBuf::seekoff(off_type off, std::ios::seekdir d
         this->setp(current, tail);
         return pos_type(current - head);
     }
+    else if (mode & MemoryMappedFile::windowed) {
+        size_t current = gbase_ + size_t(this->gptr() - this->eback());
+        if (dir == std::ios::beg)
+            current = off;
+        else if (dir == std::ios::cur)
+            current += off;
+        else if (dir == std::ios::end)
+            current = mmap_.size() - off;
+
+        seek_window(current);
+        return pos_type(current);
+    }
     else if (mode & std::ios::in) {
         char* current = this->gptr();
         if (dir == std::ios::beg)
@@ -357,11 +730,36 @@ int MMapStreamBuf::overflow(int c)
         *current++ = (char)c;
         this->setp(current, tail);
     }
+    write_back();
     return c;
 }
 
+void MMapStreamBuf::seek_window(size_t pos)
+{
+    size_t window_pos = 0;
+    // holds the window. other window() calls on the file may release it from the LRU list while it is the get area.
+    auto w = mmap_.window(pos, window_pos, window_);
+    if (w.empty()) {
+        // end of file
+        gbase_ = pos;
+        this->setg(nullptr, nullptr, nullptr);
+        return;
+    }
+    char* head = (char*)w.data();
+    gbase_ = window_pos;
+    this->setg(head, head + (pos - window_pos), head + w.size());
+}
+
 int MMapStreamBuf::underflow()
 {
+    if (mmap_.mode() & MemoryMappedFile::windowed) {
+        if (this->gptr() == this->egptr()) {
+            // slide to the next window
+            seek_window(gbase_ + size_t(this->egptr() - this->eback()));
+        }
+        return this->gptr() != this->egptr() ? traits_type::to_int_type(*this->gptr()) : traits_type::eof();
+    }
+
     char* head = (char*)mmap_.data();
     char* tail = head + mmap_.size();
     char* current = this->gptr();
@@ -380,9 +778,27 @@ int MMapStreamBuf::underflow()
 
 std::streamsize MMapStreamBuf::xsgetn(char* ptr, std::streamsize count)
 {
+    if (mmap_.mode() & MemoryMappedFile::windowed) {
+        std::streamsize total = 0;
+        while (total < count) {
+            if (this->gptr() == this->egptr()) {
+                seek_window(gbase_ + size_t(this->egptr() - this->eback()));
+                if (this->gptr() == this->egptr()) {
+                    break;
+                }
+            }
+            size_t readSize = std::min<size_t>(count - total, size_t(this->egptr() - this->gptr()));
+            std::memcpy(ptr + total, this->gptr(), readSize);
+            this->setg(this->eback(), this->gptr() + readSize, this->egptr());
+            total += readSize;
+        }
+        return total;
+    }
+
     char* head = (char*)mmap_.data();
     char* tail = head + mmap_.size();
     char* current = this->gptr();
+    read_ahead(size_t(current - head), size_t(count));
     size_t remaining = size_t(tail - current);
     size_t readSize = std::min<size_t>(count, remaining);
     std::memcpy(ptr, current, readSize);
@@ -407,6 +823,7 @@ std::streamsize MMapStreamBuf::xsputn(const char* ptr, std::streamsize count)
 
     current += count;
     this->setp(current, tail);
+    write_back();
     return count;
 }
 
@@ -422,11 +839,137 @@ char* MMapStreamBuf::reserve(size_t size)
     return (char*)mmap_.data();
 }
 
+void MMapStreamBuf::set_write_back_size(size_t size)
+{
+    g_mmap_write_back_size = size;
+}
+
+size_t MMapStreamBuf::get_write_back_size()
+{
+    return g_mmap_write_back_size;
+}
+
+void MMapStreamBuf::set_read_ahead_size(size_t size)
+{
+    g_mmap_read_ahead_size = size;
+}
+
+size_t MMapStreamBuf::get_read_ahead_size()
+{
+    return g_mmap_read_ahead_size;
+}
+
+void MMapStreamBuf::read_ahead(size_t pos, size_t size)
+{
+    if (!(mmap_.mode() & read_ahead_mode) || g_mmap_read_ahead_size == 0) {
+        return;
+    }
+
+    // detect sequential (stride 0) or strided (same gap as the last time) access.
+    // anything else is considered random and stops read-ahead until the pattern is seen again.
+    size_t stride = pos - ra_last_end_;
+    bool forward = pos >= ra_last_end_;
+    ra_last_end_ = pos + size;
+    if (!forward || (stride != ra_stride_ && ra_hits_ > 0)) {
+        ra_stride_ = forward ? stride : 0;
+        ra_hits_ = 0;
+        ra_end_ = 0;
+        return;
+    }
+    ra_stride_ = stride;
+    if (++ra_hits_ < 2) {
+        return;
+    }
+
+    char* head = (char*)mmap_.data();
+    size_t file_size = mmap_.size();
+    std::vector<std::pair<char*, size_t>> ranges;
+    if (stride == 0) {
+        // sequential. keep read_ahead_size ahead of the cursor, issued in half-size steps.
+        size_t begin = std::max(ra_end_, pos + size);
+        size_t end = std::min(pos + size + g_mmap_read_ahead_size, file_size);
+        if (begin < end && (end - begin >= g_mmap_read_ahead_size / 2 || end == file_size)) {
+            ranges.push_back({ head + begin, end - begin });
+            ra_end_ = end;
+        }
+    }
+    else {
+        // strided. prefetch the next records only, not the gaps.
+        constexpr size_t max_records = 16;
+        size_t step = size + stride;
+        size_t n = std::min(std::max(g_mmap_read_ahead_size / step, size_t(1)), max_records);
+        for (size_t i = 1; i <= n; ++i) {
+            size_t begin = pos + step * i;
+            if (begin >= file_size) {
+                break;
+            }
+            ranges.push_back({ head + begin, std::min(size, file_size - begin) });
+        }
+    }
+    if (!ranges.empty()) {
+        RunAsync([ranges = std::move(ranges)]() {
+            for (auto& r : ranges) {
+                MemoryMappedFile::prefetch(r.first, r.second);
+            }
+            });
+    }
+}
+
+void MMapStreamBuf::write_back()
+{
+    if (!(mmap_.mode() & write_back_mode)) {
+        return;
+    }
+
+    // flush the range behind the write cursor in background.
+    // only one flush is in flight. if the writer gets too far ahead, wait for it to keep dirty pages bounded.
+    size_t pos = size_t(this->pptr() - data());
+    if (pos < flushed_ + g_mmap_write_back_size) {
+        return;
+    }
+    if (write_back_.valid() && write_back_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        if (pos < flushed_ + g_mmap_write_back_size * 2) {
+            return;
+        }
+        DS_PROFILE_SCOPE("MMapStreamBuf::write_back() wait");
+        write_back_.wait();
+    }
+    write_back_ = mmap_.flush_async(flushed_, pos - flushed_, false);
+    flushed_ = pos;
+}
+
+std::future<bool> MMapStreamBuf::flush_async()
+{
+    if (!(mmap_.mode() & std::ios::out)) {
+        std::promise<bool> promise;
+        promise.set_value(false);
+        return promise.get_future();
+    }
+    size_t filesize = std::max(pmax_, size_t(this->pptr() - data()));
+    return mmap_.flush_async(0, filesize, true);
+}
+
+bool MMapStreamBuf::checkpoint()
+{
+    return flush_async().get();
+}
+
 bool MMapStreamBuf::prefetch(size_t position, size_t size)
 {
     return mmap_.prefetch(position, size);
 }
 
+std::span<const char> MMapStreamBuf::view(size_t pos, size_t size) const
+{
+    size_t window_pos = 0;
+    auto w = mmap_.window(pos, window_pos);
+    if (w.empty()) {
+        return {};
+    }
+    size_t offset = pos - window_pos;
+    return { w.data() + offset, std::min(size, w.size() - offset) };
+}
+
 char* MMapStreamBuf::data()
 {
     return (char*)mmap_.data();
@@ -524,11 +1067,26 @@ char* MMapStream::reserve(size_t size)
     return buf_.reserve(size);
 }
 
+std::future<bool> MMapStream::flush_async()
+{
+    return buf_.flush_async();
+}
+
+bool MMapStream::checkpoint()
+{
+    return buf_.checkpoint();
+}
+
 bool MMapStream::prefetch(size_t position, size_t size)
 {
     return buf_.prefetch(position, size);
 }
 
+std::span<const char> MMapStream::view(size_t pos, size_t size) const
+{
+    return buf_.view(pos, size);
+}
+
 char* MMapStream::data()
 {
     return buf_.data();
@@ -1,14 +1,25 @@
 ﻿#pragma once
 #include <iostream>
 #include <memory>
+#include <span>
+#include <future>
+#include <functional>
 
 namespace ist {
 
+// on POSIX, this is mmap() with madvise() prefetch, and MAP_POPULATE for windows.
 class MemoryMappedFile
 {
 public:
-    static constexpr std::ios::openmode async_prefetch  = 0x1000;
-    static constexpr std::ios::openmode async_unmap     = 0x2000;
+    static constexpr std::ios::openmode async_prefetch  = std::ios::openmode(0x1000);
+    static constexpr std::ios::openmode async_unmap     = std::ios::openmode(0x2000);
+    // read only. maps a few fixed-size windows instead of the whole file to keep memory use bounded.
+    // data() is null in this mode. use window() or MMapStream.
+    static constexpr std::ios::openmode windowed        = std::ios::openmode(0x40000);
+    // write only. flushes dirty pages behind the write cursor in background. (MMapStreamBuf)
+    static constexpr std::ios::openmode write_back      = std::ios::openmode(0x80000);
+    // read only. prefetches ahead of the read cursor in background on sequential or strided reads. (MMapStreamBuf)
+    static constexpr std::ios::openmode read_ahead      = std::ios::openmode(0x100000);
 
 public:
     // movable but non-copyable
@@ -25,10 +36,35 @@ public:
     void close();
     void close_with_truncation(size_t filesize);
 
+    // for write mode, the file is mapped into a large reserved address range and grown in place.
+    // so, data() doesn't change when map() is called with larger size. (unless exceeding the reserve size)
+    // falls back to unmap and remap if the placeholder APIs (Windows 10 1803+) are not available.
     void* map(size_t size);
+    // size of the address range reserved for write mode. 0 disables growing in place. (default: 64GiB)
+    static void set_reserve_size(size_t size);
+    static size_t get_reserve_size();
     bool prefetch(size_t pos, size_t size);
     static bool prefetch(void* ptr, size_t size);
 
+    // returns the mapped range that contains pos. window_pos receives its file position.
+    // in windowed mode, the next window is mapped and prefetched in background, and the least recently used ones are released.
+    // the returned range is valid until it is released. without windowed mode, it is the whole file.
+    std::span<const char> window(size_t pos, size_t& window_pos) const;
+    // holder keeps the window mapped while it is alive, even after it is released from the list.
+    std::span<const char> window(size_t pos, size_t& window_pos, std::shared_ptr<const void>& holder) const;
+    // window size is rounded up to the allocation granularity. (default: 64MiB)
+    // window count is the max number of windows kept mapped at once. at least 2. (default: 2)
+    // applied to files opened after the call.
+    static void set_window_size(size_t size);
+    static size_t get_window_size();
+    static void set_window_count(size_t count);
+    static size_t get_window_count();
+
+    // writes dirty pages of [pos, pos + size) to the file. if durable, also waits the device with FlushFileBuffers().
+    // flush_async() runs in background and can be called from any thread. close() waits for the flush in progress.
+    bool flush(size_t pos, size_t size, bool durable = false);
+    std::future<bool> flush_async(size_t pos, size_t size, bool durable = false);
+
     bool is_open() const;
     void* data();
     const void* data() const;
@@ -47,6 +83,8 @@ class MMapStreamBuf : public std::streambuf
 
 public:
     static constexpr size_t default_reserve_size = 1024 * 1024 * 16;
+    static constexpr std::ios::openmode write_back_mode = MemoryMappedFile::write_back;
+    static constexpr std::ios::openmode read_ahead_mode = MemoryMappedFile::read_ahead;
 
     // movable but non-copyable
     MMapStreamBuf(const MemoryMappedFile& v) = delete;
@@ -75,7 +113,21 @@ public:
     std::streamsize xsputn(const char* ptr, std::streamsize count) final override;
 
     char* reserve(size_t size);
+    // write_back mode issues a flush each time this size is written. (default: 32MiB)
+    static void set_write_back_size(size_t size);
+    static size_t get_write_back_size();
+    // read_ahead mode keeps this size prefetched ahead of the cursor. (default: 8MiB)
+    // with windowed mode, the next window is prefetched instead.
+    static void set_read_ahead_size(size_t size);
+    static size_t get_read_ahead_size();
+    // flushes everything written so far and FlushFileBuffers(). the data is durable when the future becomes true.
+    std::future<bool> flush_async();
+    bool checkpoint(); // flush_async().get()
     bool prefetch(size_t position, size_t size);
+    // zero-copy access to [pos, pos + size). size is clamped to size().
+    // pages are loaded on access. prefetch() beforehand may help for large ranges.
+    // in windowed mode, size is also clamped to the end of the window and the range is valid until the window slides away.
+    std::span<const char> view(size_t pos, size_t size) const;
     char* data();
     const char* data() const;
     size_t size() const;
@@ -84,6 +136,20 @@ public:
 public:
     MemoryMappedFile mmap_;
     size_t pmax_ = 0;
+    size_t gbase_ = 0; // file position of eback(). used in windowed mode.
+    std::shared_ptr<const void> window_; // window of the get area. used in windowed mode.
+    size_t flushed_ = 0; // write_back mode. flush is issued up to here.
+    std::future<bool> write_back_;
+    // read_ahead mode
+    size_t ra_last_end_ = 0; // end of the last read
+    size_t ra_stride_ = 0;   // gap between the last two reads
+    size_t ra_hits_ = 0;     // number of consecutive reads matched the pattern
+    size_t ra_end_ = 0;      // sequential read-ahead is issued up to here
+
+private:
+    void seek_window(size_t pos);
+    void write_back();
+    void read_ahead(size_t pos, size_t size);
 };
 
 
@@ -94,6 +160,9 @@ class MMapStream : public std::iostream
 public:
     static constexpr std::ios::openmode async_prefetch = MemoryMappedFile::async_prefetch;
     static constexpr std::ios::openmode async_unmap = MemoryMappedFile::async_unmap;
+    static constexpr std::ios::openmode windowed = MemoryMappedFile::windowed;
+    static constexpr std::ios::openmode write_back = MemoryMappedFile::write_back;
+    static constexpr std::ios::openmode read_ahead = MemoryMappedFile::read_ahead;
 
 public:
     // movable but non-copyable
@@ -115,7 +184,10 @@ public:
     bool is_open() const;
 
     char* reserve(size_t size);
+    std::future<bool> flush_async(); // see MMapStreamBuf::flush_async()
+    bool checkpoint();
     bool prefetch(size_t position, size_t size);
+    std::span<const char> view(size_t pos, size_t size) const; // see MMapStreamBuf::view()
     char* data();
     const char* data() const;
     size_t size() const;
@@ -125,4 +197,11 @@ private:
     MMapStreamBuf buf_;
 };
 
+
+// splits the file into chunks and calls fn(offset, data) for them on worker threads, so that parsing scales across cores
+// while pages are loaded. returns after all calls are done. false if the file is not open for read.
+// the file is prefetched before dispatching. in windowed mode, windows are processed one by one and chunks don't cross them.
+bool ForEachChunkParallel(const MemoryMappedFile& file, size_t chunk_size, const std::function<void(uint64_t, std::span<const char>)>& fn);
+bool ForEachChunkParallel(MMapStream& stream, size_t chunk_size, const std::function<void(uint64_t, std::span<const char>)>& fn);
+
 } // namespace ist
@@ -0,0 +1,494 @@
+﻿// POSIX implementation of MemoryMappedFile. see mmap_stream.cpp for Windows.
+// MMapStreamBuf and MMapStream in mmap_stream.cpp are shared by all platforms.
+#ifndef _WIN32
+#include "mmap_stream.h"
+#include "internal.h"
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0 // Linux only. pages are faulted in on access instead
+#endif
+
+
+namespace ist {
+
+#pragma region MemoryMappedFile
+
+static size_t g_mmap_reserve_size = size_t(64) * 1024 * 1024 * 1024;
+static size_t g_mmap_window_size = 1024 * 1024 * 64;
+static size_t g_mmap_window_count = 2;
+
+static size_t GetPageSize()
+{
+    static const size_t s_page_size = (size_t)::sysconf(_SC_PAGESIZE);
+    return s_page_size;
+}
+
+struct MemoryMappedFile::PImpl
+{
+    ScopedFD file_;
+    void* data_ = nullptr;
+    size_t size_ = 0;
+    std::ios::openmode mode_{};
+
+    // growable mapping for write.
+    // a large range is reserved with PROT_NONE, and the grown part of the file is mapped over it with MAP_FIXED.
+    // so, data_ doesn't change on growth and existing pages are not unmapped.
+    size_t reserved_ = 0; // size of the reserved range. 0 if not used.
+    size_t mapped_ = 0;   // size of the mapping. (for the reserved range, part of it mapped to the file) aligned to the page size.
+
+    // windowed mode for read.
+    // only a few fixed-size views are mapped. the view is unmapped when the last reference is released.
+    struct Window
+    {
+        void* view = nullptr;
+        size_t pos = 0;
+        size_t size = 0;
+
+        ~Window() { ::munmap(view, size); }
+    };
+    using WindowPtr = std::shared_ptr<Window>;
+    std::vector<WindowPtr> windows_; // least recently used first
+    size_t window_size_ = 0;
+    size_t window_count_ = 0;
+
+    // guards views from background flush. unmap() and grow() must be called with it locked.
+    std::mutex mutex_;
+
+    void unmap();
+    bool grow(size_t capacity);
+    bool flush(size_t pos, size_t size, bool durable);
+    WindowPtr map_window(size_t pos, bool populate);
+    WindowPtr get_window(size_t pos);
+};
+
+
+MemoryMappedFile::MemoryMappedFile(MemoryMappedFile&& v) noexcept
+    : MemoryMappedFile()
+{
+    swap(v);
+}
+
+MemoryMappedFile& MemoryMappedFile::operator=(MemoryMappedFile&& v) noexcept
+{
+    swap(v);
+    return *this;
+}
+
+MemoryMappedFile::MemoryMappedFile()
+{
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+    close();
+}
+
+void MemoryMappedFile::swap(MemoryMappedFile& v)
+{
+    std::swap(pimpl_, v.pimpl_);
+}
+
+bool MemoryMappedFile::is_open() const
+{
+    return pimpl_ && pimpl_->file_;
+}
+
+void* MemoryMappedFile::data()
+{
+    return pimpl_ ? pimpl_->data_ : nullptr;
+}
+
+const void* MemoryMappedFile::data() const
+{
+    return pimpl_ ? pimpl_->data_ : nullptr;
+}
+
+size_t MemoryMappedFile::size() const
+{
+    return pimpl_ ? pimpl_->size_ : 0;
+}
+
+std::ios::openmode MemoryMappedFile::mode() const
+{
+    return pimpl_ ? pimpl_->mode_ : std::ios::openmode{};
+}
+
+bool MemoryMappedFile::open(const char* path, std::ios::openmode mode)
+{
+    close();
+
+    DS_PROFILE_SCOPE("MemoryMappedFile::open()");
+
+    pimpl_ = std::make_shared<PImpl>();
+    auto& m = *pimpl_;
+
+    m.mode_ = mode;
+    if (mode & std::ios::out) {
+        // windowed mode is for read only
+        m.mode_ &= ~windowed;
+        // open for write
+        m.file_ = ScopedFD(::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (m.file_) {
+            return true;
+        }
+    }
+    else if (mode & std::ios::in) {
+        // open for read
+        m.file_ = ScopedFD(::open(path, O_RDONLY | O_CLOEXEC));
+        struct stat st {};
+        if (m.file_ && ::fstat(m.file_.get(), &st) == 0) {
+            // equivalent of FILE_FLAG_SEQUENTIAL_SCAN. larger read-ahead of the page cache.
+            ::posix_fadvise(m.file_.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+            m.size_ = (size_t)st.st_size;
+            if (m.mode_ & windowed) {
+                // views are mapped on demand by window()
+                const size_t granularity = GetPageSize();
+                m.window_size_ = std::max((g_mmap_window_size + granularity - 1) / granularity * granularity, granularity);
+                m.window_count_ = std::max(g_mmap_window_count, size_t(2));
+                return true;
+            }
+            void* data = m.size_ ? ::mmap(nullptr, m.size_, PROT_READ, MAP_SHARED, m.file_.get(), 0) : MAP_FAILED;
+            if (data != MAP_FAILED) {
+                m.data_ = data;
+                m.mapped_ = m.size_;
+                if (m.mode_ & async_prefetch) {
+                    RunAsync([data = m.data_, size = m.size_]() {
+                        prefetch(data, size);
+                        });
+                }
+
+                return true;
+            }
+        }
+    }
+
+    close();
+    return false;
+}
+
+void MemoryMappedFile::close()
+{
+    if (is_open()) {
+        auto& m = *pimpl_;
+        auto do_close = [pimpl_ = std::move(pimpl_)]() {
+            auto& m = *pimpl_;
+            {
+                std::lock_guard lock(m.mutex_);
+                m.unmap();
+            }
+            m.file_.reset();
+            m.mode_ = {};
+            };
+
+        if (m.mode_ & async_unmap) {
+            RunAsync(std::move(do_close));
+        }
+        else {
+            do_close();
+        }
+        pimpl_ = {};
+    }
+}
+
+void MemoryMappedFile::close_with_truncation(size_t filesize)
+{
+    auto& m = *pimpl_;
+    if (is_open() && m.mode_ & std::ios::out) {
+        auto do_close = [pimpl_ = std::move(pimpl_), filesize]() {
+            auto& m = *pimpl_;
+            {
+                std::lock_guard lock(m.mutex_);
+                m.unmap();
+            }
+
+            (void)::ftruncate(m.file_.get(), (off_t)filesize);
+
+            m.file_.reset();
+            m.mode_ = {};
+            };
+
+        if (m.mode_ & async_unmap) {
+            RunAsync(std::move(do_close));
+        }
+        else {
+            do_close();
+        }
+        pimpl_ = {};
+    }
+}
+
+void MemoryMappedFile::set_reserve_size(size_t size)
+{
+    g_mmap_reserve_size = size;
+}
+
+size_t MemoryMappedFile::get_reserve_size()
+{
+    return g_mmap_reserve_size;
+}
+
+void MemoryMappedFile::set_window_size(size_t size)
+{
+    g_mmap_window_size = size;
+}
+
+size_t MemoryMappedFile::get_window_size()
+{
+    return g_mmap_window_size;
+}
+
+void MemoryMappedFile::set_window_count(size_t count)
+{
+    g_mmap_window_count = count;
+}
+
+size_t MemoryMappedFile::get_window_count()
+{
+    return g_mmap_window_count;
+}
+
+std::span<const char> MemoryMappedFile::window(size_t pos, size_t& window_pos) const
+{
+    std::shared_ptr<const void> holder;
+    return window(pos, window_pos, holder);
+}
+
+std::span<const char> MemoryMappedFile::window(size_t pos, size_t& window_pos, std::shared_ptr<const void>& holder) const
+{
+    window_pos = 0;
+    holder.reset();
+    if (!is_open() || pos >= pimpl_->size_) {
+        return {};
+    }
+
+    auto& m = *pimpl_;
+    if (!(m.mode_ & windowed)) {
+        return { (const char*)m.data_, m.size_ };
+    }
+    if (auto w = m.get_window(pos)) {
+        window_pos = w->pos;
+        holder = w;
+        return { (const char*)w->view, w->size };
+    }
+    return {};
+}
+
+void* MemoryMappedFile::map(size_t capacity)
+{
+    if (!is_open()) {
+        return nullptr;
+    }
+
+    DS_PROFILE_SCOPE("MemoryMappedFile::map()");
+    auto& m = *pimpl_;
+    std::lock_guard lock(m.mutex_);
+    if ((m.mode_ & std::ios::out) && m.grow(capacity)) {
+        return m.data_;
+    }
+
+    // fallback: remap whole file. data_ is changed.
+    m.unmap();
+
+    // pages beyond the end of the file raise SIGBUS. extend the file first.
+    if (capacity > 0 && ::ftruncate(m.file_.get(), (off_t)capacity) == 0) {
+        void* data = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m.file_.get(), 0);
+        if (data != MAP_FAILED) {
+            m.data_ = data;
+            m.size_ = m.mapped_ = capacity;
+        }
+    }
+    return m.data_;
+}
+
+bool MemoryMappedFile::PImpl::grow(size_t capacity)
+{
+    if (g_mmap_reserve_size == 0) {
+        return false;
+    }
+    if (data_ && !reserved_) {
+        // already mapped by the fallback path
+        return false;
+    }
+
+    if (capacity <= mapped_) {
+        size_ = std::max(size_, capacity);
+        return true;
+    }
+    const size_t granularity = GetPageSize();
+    const size_t aligned = (capacity + granularity - 1) / granularity * granularity;
+
+    if (!data_) {
+        size_t reserve = std::max(g_mmap_reserve_size, aligned);
+        reserve = (reserve + granularity - 1) / granularity * granularity;
+        void* addr = ::mmap(nullptr, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        data_ = addr;
+        reserved_ = reserve;
+        mapped_ = size_ = 0;
+    }
+    if (aligned > reserved_) {
+        // exceeds the reservation. fallback to remap.
+        unmap();
+        return false;
+    }
+
+    DS_PROFILE_SCOPE("MemoryMappedFile::PImpl::grow()");
+
+    // the grown part replaces the reservation in place. mappings of the same file are coherent.
+    if (::ftruncate(file_.get(), (off_t)aligned) != 0) {
+        return false;
+    }
+    void* view = ::mmap((char*)data_ + mapped_, aligned - mapped_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+        file_.get(), (off_t)mapped_);
+    if (view == MAP_FAILED) {
+        return false;
+    }
+    mapped_ = aligned;
+    size_ = capacity;
+    return true;
+}
+
+void MemoryMappedFile::PImpl::unmap()
+{
+    DS_PROFILE_SCOPE("MemoryMappedFile::unmap()");
+
+    windows_.clear();
+    if (data_) {
+        // for the reserved range, this also releases the file mappings placed over it.
+        ::munmap(data_, reserved_ ? reserved_ : mapped_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    reserved_ = mapped_ = 0;
+}
+
+MemoryMappedFile::PImpl::WindowPtr MemoryMappedFile::PImpl::map_window(size_t pos, bool populate)
+{
+    DS_PROFILE_SCOPE("MemoryMappedFile::PImpl::map_window()");
+
+    // populate is for the window the caller reads right away. saves a page fault per page.
+    size_t size = std::min(window_size_, size_ - pos);
+    void* view = ::mmap(nullptr, size, PROT_READ, MAP_SHARED | (populate ? MAP_POPULATE : 0), file_.get(), (off_t)pos);
+    if (view == MAP_FAILED) {
+        return nullptr;
+    }
+    auto ret = std::make_shared<Window>();
+    ret->view = view;
+    ret->pos = pos;
+    ret->size = size;
+    return ret;
+}
+
+MemoryMappedFile::PImpl::WindowPtr MemoryMappedFile::PImpl::get_window(size_t pos)
+{
+    auto find = [this](size_t wpos) {
+        return std::find_if(windows_.begin(), windows_.end(), [wpos](auto& w) { return w->pos == wpos; });
+        };
+
+    size_t wpos = pos / window_size_ * window_size_;
+    WindowPtr ret;
+    auto it = find(wpos);
+    if (it != windows_.end()) {
+        ret = *it;
+        windows_.erase(it);
+    }
+    else if (!(ret = map_window(wpos, true))) {
+        return nullptr;
+    }
+    windows_.push_back(ret);
+
+    // map the next window and prefetch it in background.
+    // inserted before the current one to release it first when going backward.
+    size_t next = wpos + window_size_;
+    if (next < size_ && find(next) == windows_.end()) {
+        if (auto w = map_window(next, false)) {
+            windows_.insert(windows_.end() - 1, w);
+            RunAsync([w]() {
+                prefetch(w->view, w->size);
+                });
+        }
+    }
+
+    // release the least recently used ones. the current and the next are always kept.
+    while (windows_.size() > window_count_) {
+        windows_.erase(windows_.begin());
+    }
+    return ret;
+}
+
+bool MemoryMappedFile::PImpl::flush(size_t pos, size_t size, bool durable)
+{
+    DS_PROFILE_SCOPE("MemoryMappedFile::PImpl::flush()");
+
+    std::lock_guard lock(mutex_);
+    if (!data_ || !(mode_ & std::ios::out)) {
+        return false;
+    }
+
+    size_t end = std::min(pos + size, size_);
+    bool ret = true;
+    if (pos < end) {
+        // unlike FlushViewOfFile(), msync() requires a page-aligned address. one mapping covers the whole range.
+        size_t first = pos / GetPageSize() * GetPageSize();
+        ret &= ::msync((char*)data_ + first, end - first, MS_SYNC) == 0;
+    }
+
+    if (durable) {
+        ret &= ::fsync(file_.get()) == 0;
+    }
+    return ret;
+}
+
+bool MemoryMappedFile::flush(size_t pos, size_t size, bool durable)
+{
+    return is_open() && pimpl_->flush(pos, size, durable);
+}
+
+std::future<bool> MemoryMappedFile::flush_async(size_t pos, size_t size, bool durable)
+{
+    auto promise = std::make_shared<std::promise<bool>>();
+    auto ret = promise->get_future();
+    if (!is_open()) {
+        promise->set_value(false);
+        return ret;
+    }
+    // the task holds the PImpl. close() on the caller's side just waits the mutex if it is in progress.
+    RunAsync([m = pimpl_, promise, pos, size, durable]() {
+        promise->set_value(m->flush(pos, size, durable));
+        });
+    return ret;
+}
+
+bool MemoryMappedFile::prefetch(void* ptr, size_t size)
+{
+    DS_PROFILE_SCOPE("MemoryMappedFile::prefetch()");
+
+    // starts read-ahead of the range into the page cache. pages are mapped on access without I/O.
+    size_t page = GetPageSize();
+    char* first = (char*)(uintptr_t(ptr) / page * page);
+    return ::madvise(first, size + ((char*)ptr - first), MADV_WILLNEED) == 0;
+}
+
+bool MemoryMappedFile::prefetch(size_t pos, size_t size)
+{
+    auto& m = *pimpl_;
+    if (!m.data_) {
+        // windowed mode. windows are prefetched by window().
+        return false;
+    }
+    return prefetch((char*)m.data_ + pos, size);
+}
+#pragma endregion MemoryMappedFile
+
+} // namespace ist
+#endif // _WIN32
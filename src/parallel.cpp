@@ -0,0 +1,194 @@
+﻿#include "dstorage_stream.h"
+#include "mmap_stream.h"
+#include "internal.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <algorithm>
+
+
+namespace ist {
+
+#pragma region WorkerPool
+#ifndef _WIN32
+
+// fixed-size pool for RunAsync(). PPL plays this role on Windows.
+class WorkerPool
+{
+public:
+    static WorkerPool& instance()
+    {
+        static WorkerPool s_instance;
+        return s_instance;
+    }
+
+    void push(std::function<void()>&& f)
+    {
+        {
+            std::unique_lock lock{ mutex_ };
+            tasks_.push_back(std::move(f));
+        }
+        cond_.notify_one();
+    }
+
+private:
+    WorkerPool()
+    {
+        size_t n = std::max(std::thread::hardware_concurrency(), 2u);
+        for (size_t i = 0; i < n; ++i) {
+            threads_.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::unique_lock lock{ mutex_ };
+            stop_ = true;
+        }
+        cond_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    void run()
+    {
+        for (;;) {
+            std::function<void()> f;
+            {
+                std::unique_lock lock{ mutex_ };
+                cond_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return; // stopped
+                }
+                f = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            f();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> tasks_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
+
+void RunOnWorkerThread(std::function<void()>&& f)
+{
+    WorkerPool::instance().push(std::move(f));
+}
+
+#endif // _WIN32
+#pragma endregion WorkerPool
+
+
+#pragma region Parallel
+
+// tracks tasks started by RunAsync() and waits for all of them
+class TaskGroup
+{
+public:
+    ~TaskGroup()
+    {
+        wait();
+    }
+
+    template<class F>
+    void run(F&& f)
+    {
+        {
+            std::unique_lock lock{ mutex_ };
+            ++pending_;
+        }
+        RunAsync([this, f = std::forward<F>(f)]() {
+            f();
+            // notify under the lock. wait() may return and destroy this as soon as the lock is released.
+            std::unique_lock lock{ mutex_ };
+            --pending_;
+            cond_.notify_all();
+            });
+    }
+
+    void wait()
+    {
+        std::unique_lock lock{ mutex_ };
+        cond_.wait(lock, [this]() { return pending_ == 0; });
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    size_t pending_ = 0;
+};
+
+bool ForEachBlockParallel(DStorageStream& stream, const std::function<void(const DStorageStream::block&, std::span<const char>)>& fn)
+{
+    DS_PROFILE_SCOPE("ForEachBlockParallel()");
+
+    const char* data = stream.data();
+    if (!data) {
+        // not opened, GPU destination or streaming mode
+        stream.wait();
+        return false;
+    }
+
+    TaskGroup group;
+    DStorageStream::block b;
+    while (stream.wait_any_block(b)) {
+        group.run([&fn, b, data]() {
+            DS_PROFILE_SCOPE("ForEachBlockParallel() task");
+            fn(b, { data + b.offset, b.size });
+            });
+    }
+    bool ok = stream.wait();
+    group.wait();
+    return ok;
+}
+
+bool ForEachChunkParallel(const MemoryMappedFile& file, size_t chunk_size, const std::function<void(uint64_t, std::span<const char>)>& fn)
+{
+    DS_PROFILE_SCOPE("ForEachChunkParallel()");
+
+    if (!file.is_open() || !(file.mode() & std::ios::in) || chunk_size == 0) {
+        return false;
+    }
+
+    TaskGroup group;
+    const size_t size = file.size();
+    for (size_t pos = 0; pos < size; ) {
+        size_t window_pos = 0;
+        std::span<const char> window = file.window(pos, window_pos);
+        if (window.empty()) {
+            return false;
+        }
+        // page faults in workers are serialized by the kernel to some extent. let the read ahead run in parallel.
+        MemoryMappedFile::prefetch((void*)(window.data() + (pos - window_pos)), window.size() - (pos - window_pos));
+
+        const size_t window_end = window_pos + window.size();
+        for (; pos < window_end; pos += chunk_size) {
+            std::span<const char> chunk = window.subspan(pos - window_pos, std::min(chunk_size, window_end - pos));
+            group.run([&fn, pos, chunk]() {
+                DS_PROFILE_SCOPE("ForEachChunkParallel() task");
+                fn(pos, chunk);
+                });
+        }
+        pos = window_end;
+        // the window may be released when the next one is mapped
+        group.wait();
+    }
+    return true;
+}
+
+bool ForEachChunkParallel(MMapStream& stream, size_t chunk_size, const std::function<void(uint64_t, std::span<const char>)>& fn)
+{
+    return ForEachChunkParallel(stream.get_memory_mapped_file(), chunk_size, fn);
+}
+
+#pragma endregion Parallel
+
+} // namespace ist
@@ -0,0 +1,806 @@
+﻿#include "mmap_stream.h"
+#include "dstorage_stream.h"
+#include "async_write_stream.h"
+#include "internal.h"
+
+#include <fstream>
+#include <random>
+#include <vector>
+#include <span>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+
+#define STRINGNIZE(V) STRINGNIZE2(V)
+#define STRINGNIZE2(V) #V
+#define LINE_STRING STRINGNIZE(__LINE__)
+#define check(...) if(!(__VA_ARGS__)) { throw std::runtime_error("failed: " #__VA_ARGS__  " (" __FILE__ ":" LINE_STRING ")" "\n"); }
+
+using BufferPtr = ist::BufferPtr;
+using ist::ScopedHandle;
+
+constexpr size_t KiB = 1024;
+constexpr size_t MiB = 1024 * 1024;
+constexpr size_t GiB = 1024 * 1024 * 1024;
+constexpr size_t chunk_size = 1 * MiB; // read size of fstream, ReadFile and MMapStream's first block
+
+using nanosec = uint64_t;
+static nanosec NowNS()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// user + kernel time of the whole process. includes library threads (submitter, reactor, PPL workers).
+static nanosec CpuTimeNS()
+{
+    FILETIME creation, exit, kernel, user;
+    ::GetProcessTimes(::GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    auto to_ns = [](const FILETIME& t) { return ((uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime) * 100; };
+    return to_ns(kernel) + to_ns(user);
+}
+
+static BufferPtr GenRandom(size_t size_in_byte, int seed = 0)
+{
+    std::mt19937 engine(seed);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    BufferPtr buf = ist::CreateBuffer(size_in_byte);
+    std::span data{ (float*)buf.get(), size_in_byte / sizeof(float)};
+    for (float& v : data) {
+        v = dist(engine);
+    }
+    return buf;
+}
+
+static void MakeFile(const char* path, size_t size, int seed)
+{
+    if (!std::filesystem::exists(path) || std::filesystem::file_size(path) != size) {
+        printf("making %s...", path);
+        std::ofstream of(path, std::ios::out | std::ios::binary);
+        BufferPtr data = GenRandom(size, seed);
+        of.write(data.get(), size);
+        printf(" done\n");
+    }
+}
+
+static void Sum(double& total, const char* data, size_t size)
+{
+    std::span values{ (const float*)data, size / sizeof(float) };
+    for (float v : values) {
+        total += v;
+    }
+}
+
+
+#pragma region Measurement
+
+struct Options
+{
+    int num_try = 10;
+    bool cold = false; // purge the standby list before each run, and open ReadFile handles with FILE_FLAG_NO_BUFFERING
+    bool large = false; // include 1GB and 8GB files
+    const char* json_path = nullptr;
+};
+static Options g_opt;
+static bool g_purge_available = false;
+
+// requires SeProfileSingleProcessPrivilege (administrator).
+static bool PurgeStandbyList()
+{
+    using NtSetSystemInformation_t = LONG(WINAPI*)(int info_class, void* info, ULONG info_size);
+    static const auto s_NtSetSystemInformation = []() -> NtSetSystemInformation_t {
+        HANDLE token = nullptr;
+        if (::OpenProcessToken(::GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+            TOKEN_PRIVILEGES tp{};
+            tp.PrivilegeCount = 1;
+            tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+            if (::LookupPrivilegeValueW(nullptr, L"SeProfileSingleProcessPrivilege", &tp.Privileges[0].Luid)) {
+                ::AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr);
+            }
+            ::CloseHandle(token);
+        }
+        HMODULE ntdll = ::GetModuleHandleA("ntdll.dll");
+        return ntdll ? (NtSetSystemInformation_t)::GetProcAddress(ntdll, "NtSetSystemInformation") : nullptr;
+        }();
+
+    constexpr int SystemMemoryListInformation = 80;
+    int command = 4; // MemoryPurgeStandbyList
+    return s_NtSetSystemInformation && s_NtSetSystemInformation(SystemMemoryListInformation, &command, sizeof(command)) >= 0;
+}
+
+struct Sample
+{
+    double wall_ms = 0;
+    double cpu_ms = 0;
+    double first_ms = 0; // time to first block
+};
+
+struct Result
+{
+    std::string scenario;
+    std::string method;
+    uint64_t bytes = 0; // per run
+    std::vector<Sample> samples;
+};
+static std::vector<Result> g_results;
+
+static double Percentile(std::vector<double> v, double p)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    size_t i = (size_t)std::ceil(p * v.size());
+    return v[std::min(std::max(i, size_t(1)), v.size()) - 1];
+}
+
+template<class F>
+static std::vector<double> Collect(const Result& r, F&& f)
+{
+    std::vector<double> ret;
+    for (const Sample& s : r.samples) {
+        ret.push_back(f(s));
+    }
+    return ret;
+}
+
+// body(first) runs one read and returns checksum of the data (or written size for writers). it sets first to NowNS() when the first block is available.
+template<class Body>
+static double Measure(const std::string& scenario, const char* method, uint64_t bytes, Body&& body)
+{
+    DS_PROFILE_SCOPE("%s %s", scenario.c_str(), method);
+
+    Result r{ scenario, method, bytes };
+    double total = 0;
+    for (int i = 0; i < g_opt.num_try; ++i) {
+        if (g_opt.cold) {
+            PurgeStandbyList();
+        }
+        nanosec first = 0;
+        nanosec cpu_start = CpuTimeNS();
+        nanosec start = NowNS();
+        total = body(first);
+        nanosec end = NowNS();
+        nanosec cpu = CpuTimeNS() - cpu_start;
+        r.samples.push_back({ (end - start) / 1e6, cpu / 1e6, ((first ? first : end) - start) / 1e6 });
+    }
+
+    double wall = Percentile(Collect(r, [](auto& s) { return s.wall_ms; }), 0.5);
+    printf("  %-20s wall p50 %9.2fms p99 %9.2fms | cpu p50 %9.2fms | first p50 %8.3fms | %8.1fMB/s\n",
+        method, wall,
+        Percentile(Collect(r, [](auto& s) { return s.wall_ms; }), 0.99),
+        Percentile(Collect(r, [](auto& s) { return s.cpu_ms; }), 0.5),
+        Percentile(Collect(r, [](auto& s) { return s.first_ms; }), 0.5),
+        wall > 0 ? bytes / double(MiB) / (wall / 1000) : 0.0);
+    g_results.push_back(std::move(r));
+    return total;
+}
+
+static void WriteJson(const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        printf("failed to open %s\n", path);
+        return;
+    }
+    auto stats = [&](const Result& r, const char* name, auto&& get) {
+        auto v = Collect(r, get);
+        double mean = 0;
+        for (double d : v) {
+            mean += d / v.size();
+        }
+        fprintf(f, "\"%s\": {\"p50\": %.4f, \"p99\": %.4f, \"mean\": %.4f}", name, Percentile(v, 0.5), Percentile(v, 0.99), mean);
+    };
+
+    fprintf(f, "{\n  \"cold\": %s,\n  \"standby_list_purged\": %s,\n  \"num_try\": %d,\n  \"staging_buffer_size\": %u,\n  \"results\": [\n",
+        g_opt.cold ? "true" : "false", g_opt.cold && g_purge_available ? "true" : "false", g_opt.num_try,
+        (uint32_t)ist::DStorageStream::get_staging_buffer_size());
+    for (size_t i = 0; i < g_results.size(); ++i) {
+        const Result& r = g_results[i];
+        fprintf(f, "    {\"scenario\": \"%s\", \"method\": \"%s\", \"bytes\": %llu, ", r.scenario.c_str(), r.method.c_str(), (unsigned long long)r.bytes);
+        stats(r, "wall_ms", [](auto& s) { return s.wall_ms; });
+        fprintf(f, ", ");
+        stats(r, "cpu_ms", [](auto& s) { return s.cpu_ms; });
+        fprintf(f, ", ");
+        stats(r, "first_block_ms", [](auto& s) { return s.first_ms; });
+        fprintf(f, "}%s\n", i + 1 < g_results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+    printf("results are written to %s\n", path);
+}
+
+#pragma endregion Measurement
+
+
+#pragma region Readers
+
+// each reader computes the sum of floats in the file (or ranges) in order, so all readers must return the same value.
+
+static double ReadDStorage(const char* path, nanosec& first)
+{
+    double total = 0;
+    ist::DStorageStream ifs;
+    if (ifs.open(path)) {
+        size_t pos = 0;
+        while (ifs.wait_next_block()) {
+            if (!first) {
+                first = NowNS();
+            }
+            Sum(total, ifs.data() + pos, ifs.read_size() - pos);
+            pos = ifs.read_size();
+        }
+    }
+    return total;
+}
+
+// memory use is bounded by the ring. view() covers the current block only.
+static double ReadDStorageStreaming(const char* path, nanosec& first)
+{
+    double total = 0;
+    ist::DStorageStream ifs;
+    if (ifs.open(path, std::ios::in | ist::DStorageStream::streaming)) {
+        size_t pos = 0;
+        while (ifs.wait_next_block()) {
+            if (!first) {
+                first = NowNS();
+            }
+            auto block = ifs.view(pos, ifs.read_size() - pos);
+            Sum(total, block.data(), block.size());
+            pos = ifs.read_size();
+        }
+    }
+    return total;
+}
+
+static double ReadMMap(const char* path, nanosec& first)
+{
+    double total = 0;
+    ist::MMapStream ifs;
+    if (ifs.open(path, std::ios::in | ist::MMapStream::read_ahead | ist::MMapStream::async_unmap)) {
+        // page faults are the I/O. the first block is available when the first chunk is touched.
+        size_t size = ifs.size();
+        for (size_t pos = 0; pos < size; pos += chunk_size) {
+            Sum(total, ifs.data() + pos, std::min(chunk_size, size - pos));
+            if (!first) {
+                first = NowNS();
+            }
+        }
+    }
+    return total;
+}
+
+static double ReadFStream(const char* path, nanosec& first)
+{
+    double total = 0;
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    std::vector<char> buf(chunk_size);
+    while (ifs) {
+        ifs.read(buf.data(), buf.size());
+        size_t read = (size_t)ifs.gcount();
+        if (read == 0) {
+            break;
+        }
+        if (!first) {
+            first = NowNS();
+        }
+        Sum(total, buf.data(), read);
+    }
+    return total;
+}
+
+// overlapped ReadFile() with requests of chunk_size in flight. with g_opt.cold, the file cache is bypassed.
+static double ReadOverlapped(const char* path, nanosec& first)
+{
+    constexpr int queue_depth = 8;
+    constexpr size_t sector_size = 4096;
+
+    double total = 0;
+    DWORD flags = FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN | (g_opt.cold ? FILE_FLAG_NO_BUFFERING : 0);
+    ScopedHandle file(::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr));
+    if (!file) {
+        return total;
+    }
+    LARGE_INTEGER file_size;
+    ::GetFileSizeEx(file.get(), &file_size);
+    uint64_t size = file_size.QuadPart;
+
+    // CreateBuffer() is page aligned, which satisfies FILE_FLAG_NO_BUFFERING.
+    BufferPtr buf = ist::CreateBuffer(chunk_size * queue_depth, false, false);
+    OVERLAPPED ov[queue_depth]{};
+    ScopedHandle events[queue_depth];
+    uint64_t issued = 0;
+    auto issue = [&](int slot) {
+        if (issued >= size) {
+            return false;
+        }
+        ov[slot] = {};
+        ov[slot].Offset = DWORD(issued);
+        ov[slot].OffsetHigh = DWORD(issued >> 32);
+        ov[slot].hEvent = events[slot].get();
+        // unbuffered reads must be multiple of sector size. the last one just reads less.
+        DWORD read_size = (DWORD)((std::min<uint64_t>(chunk_size, size - issued) + sector_size - 1) / sector_size * sector_size);
+        issued += chunk_size;
+        return ::ReadFile(file.get(), buf.get() + chunk_size * slot, read_size, nullptr, &ov[slot]) || ::GetLastError() == ERROR_IO_PENDING;
+    };
+
+    int inflight = 0;
+    for (int i = 0; i < queue_depth; ++i) {
+        events[i].reset(::CreateEvent(nullptr, TRUE, FALSE, nullptr));
+        if (issue(i)) {
+            ++inflight;
+        }
+    }
+    // complete in order to keep the sum in file order
+    for (int slot = 0; inflight > 0; slot = (slot + 1) % queue_depth) {
+        DWORD read = 0;
+        ::GetOverlappedResult(file.get(), &ov[slot], &read, TRUE);
+        --inflight;
+        if (!first) {
+            first = NowNS();
+        }
+        Sum(total, buf.get() + chunk_size * slot, read);
+        if (issue(slot)) {
+            ++inflight;
+        }
+    }
+    return total;
+}
+
+// ranged readers. ranges are read in order and summed in order.
+
+static double ReadRangesDStorage(const char* path, std::span<const ist::DStorageStream::range> ranges, nanosec& first)
+{
+    double total = 0;
+    ist::DStorageStream ifs;
+    if (ifs.open(path, ranges)) {
+        size_t pos = 0;
+        while (ifs.wait_next_block()) {
+            if (!first) {
+                first = NowNS();
+            }
+            Sum(total, ifs.data() + pos, ifs.read_size() - pos);
+            pos = ifs.read_size();
+        }
+    }
+    return total;
+}
+
+static double ReadRangesMMap(const char* path, std::span<const ist::DStorageStream::range> ranges, nanosec& first)
+{
+    double total = 0;
+    ist::MMapStream ifs;
+    if (ifs.open(path, std::ios::in | ist::MMapStream::read_ahead | ist::MMapStream::async_unmap)) {
+        for (auto& r : ranges) {
+            Sum(total, ifs.data() + r.file_offset, r.size);
+            if (!first) {
+                first = NowNS();
+            }
+        }
+    }
+    return total;
+}
+
+static double ReadRangesFStream(const char* path, std::span<const ist::DStorageStream::range> ranges, nanosec& first)
+{
+    double total = 0;
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    std::vector<char> buf;
+    for (auto& r : ranges) {
+        buf.resize(r.size);
+        ifs.seekg(r.file_offset);
+        ifs.read(buf.data(), r.size);
+        if (!first) {
+            first = NowNS();
+        }
+        Sum(total, buf.data(), (size_t)ifs.gcount());
+    }
+    return total;
+}
+
+// ranges must be sector aligned for g_opt.cold
+static double ReadRangesOverlapped(const char* path, std::span<const ist::DStorageStream::range> ranges, nanosec& first)
+{
+    constexpr int queue_depth = 32;
+
+    double total = 0;
+    DWORD flags = FILE_FLAG_OVERLAPPED | FILE_FLAG_RANDOM_ACCESS | (g_opt.cold ? FILE_FLAG_NO_BUFFERING : 0);
+    ScopedHandle file(::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr));
+    if (!file || ranges.empty()) {
+        return total;
+    }
+
+    size_t slot_size = 0;
+    for (auto& r : ranges) {
+        slot_size = std::max(slot_size, (size_t)r.size);
+    }
+    BufferPtr buf = ist::CreateBuffer(slot_size * queue_depth, false, false);
+    OVERLAPPED ov[queue_depth]{};
+    ScopedHandle events[queue_depth];
+    size_t issued = 0;
+    auto issue = [&](int slot) {
+        if (issued >= ranges.size()) {
+            return false;
+        }
+        auto& r = ranges[issued++];
+        ov[slot] = {};
+        ov[slot].Offset = DWORD(r.file_offset);
+        ov[slot].OffsetHigh = DWORD(r.file_offset >> 32);
+        ov[slot].hEvent = events[slot].get();
+        return ::ReadFile(file.get(), buf.get() + slot_size * slot, (DWORD)r.size, nullptr, &ov[slot]) || ::GetLastError() == ERROR_IO_PENDING;
+    };
+
+    int inflight = 0;
+    for (int i = 0; i < queue_depth; ++i) {
+        events[i].reset(::CreateEvent(nullptr, TRUE, FALSE, nullptr));
+        if (issue(i)) {
+            ++inflight;
+        }
+    }
+    for (int slot = 0; inflight > 0; slot = (slot + 1) % queue_depth) {
+        DWORD read = 0;
+        ::GetOverlappedResult(file.get(), &ov[slot], &read, TRUE);
+        --inflight;
+        if (!first) {
+            first = NowNS();
+        }
+        Sum(total, buf.get() + slot_size * slot, read);
+        if (issue(slot)) {
+            ++inflight;
+        }
+    }
+    return total;
+}
+
+#pragma endregion Readers
+
+
+#pragma region Writers
+
+// write(path, data, size) writes the data in chunk_size pieces and returns the file size.
+static double WriteAsync(const char* path, const char* data, size_t size)
+{
+    ist::AsyncWriteStream of(path);
+    for (size_t pos = 0; pos < size; pos += chunk_size) {
+        of.write(data + pos, std::min(chunk_size, size - pos));
+    }
+    check(of.close());
+    return (double)std::filesystem::file_size(path);
+}
+
+static double WriteMMap(const char* path, const char* data, size_t size)
+{
+    {
+        ist::MMapStream of(path, std::ios::out);
+        for (size_t pos = 0; pos < size; pos += chunk_size) {
+            of.write(data + pos, std::min(chunk_size, size - pos));
+        }
+    }
+    return (double)std::filesystem::file_size(path);
+}
+
+static double WriteFStream(const char* path, const char* data, size_t size)
+{
+    {
+        std::ofstream of(path, std::ios::out | std::ios::binary);
+        for (size_t pos = 0; pos < size; pos += chunk_size) {
+            of.write(data + pos, std::min(chunk_size, size - pos));
+        }
+    }
+    return (double)std::filesystem::file_size(path);
+}
+
+#pragma endregion Writers
+
+
+#pragma region Scenarios
+
+// whole file, one stream at a time
+static void Bench_Sequential()
+{
+    std::vector<std::tuple<const char*, size_t>> table = {
+        {"data_4K.bin", 4 * KiB},
+        {"data_256K.bin", 256 * KiB},
+        {"data_4MB.bin", 4 * MiB},
+        {"data_64MB.bin", 64 * MiB},
+        {"data_256MB.bin", 256 * MiB},
+    };
+    if (g_opt.large) {
+        table.push_back({ "data_1GB.bin", 1 * GiB });
+        table.push_back({ "data_8GB.bin", 8 * GiB });
+    }
+    int seed = 0;
+    for (const auto& [filename, size] : table) {
+        MakeFile(filename, size, seed++);
+    }
+
+    for (const auto& [filename, size] : table) {
+        std::string scenario = "sequential_" + std::to_string(size);
+        printf("%s:\n", scenario.c_str());
+        double total_dstorage = Measure(scenario, "DStorageStream", size, [&](nanosec& first) { return ReadDStorage(filename, first); });
+        double total_streaming = Measure(scenario, "DStorageStream (streaming)", size, [&](nanosec& first) { return ReadDStorageStreaming(filename, first); });
+        double total_mmap = Measure(scenario, "MMapStream", size, [&](nanosec& first) { return ReadMMap(filename, first); });
+        double total_fstream = Measure(scenario, "std::fstream", size, [&](nanosec& first) { return ReadFStream(filename, first); });
+        double total_overlapped = Measure(scenario, "ReadFile (overlapped)", size, [&](nanosec& first) { return ReadOverlapped(filename, first); });
+        check(total_fstream == total_mmap);
+        check(total_fstream == total_dstorage);
+        check(total_fstream == total_streaming);
+        check(total_fstream == total_overlapped);
+    }
+}
+
+// N streams of the same file at once. each stream is read on its own thread.
+static void Bench_Concurrent()
+{
+    const char* filename = "data_4MB.bin";
+    const size_t file_size = 4 * MiB;
+    MakeFile(filename, file_size, 2);
+
+    for (int num_streams : { 1, 4, 16, 64 }) {
+        std::string scenario = "concurrent_" + std::to_string(num_streams) + "x" + std::to_string(file_size);
+        printf("%s:\n", scenario.c_str());
+
+        auto run = [&](auto&& reader) {
+            return [&, reader](nanosec& first) {
+                std::vector<double> totals(num_streams);
+                std::vector<nanosec> firsts(num_streams);
+                std::vector<std::thread> threads;
+                for (int si = 0; si < num_streams; ++si) {
+                    threads.emplace_back([&, si]() { totals[si] = reader(filename, firsts[si]); });
+                }
+                for (auto& t : threads) {
+                    t.join();
+                }
+                first = *std::min_element(firsts.begin(), firsts.end());
+                for (double t : totals) {
+                    check(t == totals[0]);
+                }
+                return totals[0];
+            };
+        };
+        uint64_t bytes = file_size * num_streams;
+        double total_dstorage = Measure(scenario, "DStorageStream", bytes, run(ReadDStorage));
+        double total_mmap = Measure(scenario, "MMapStream", bytes, run(ReadMMap));
+        double total_fstream = Measure(scenario, "std::fstream", bytes, run(ReadFStream));
+        double total_overlapped = Measure(scenario, "ReadFile (overlapped)", bytes, run(ReadOverlapped));
+        check(total_fstream == total_mmap);
+        check(total_fstream == total_dstorage);
+        check(total_fstream == total_overlapped);
+    }
+}
+
+// many small files of various sizes. DStorageStream keeps many streams in flight on one thread.
+// synchronous APIs read them one by one.
+static void Bench_SmallFiles()
+{
+    constexpr int num_files = 1024;
+    constexpr int num_inflight = 64;
+
+    std::filesystem::create_directories("bench_small");
+    std::vector<std::string> paths;
+    uint64_t bytes = 0;
+    std::mt19937 engine(3);
+    std::uniform_int_distribution<size_t> dist(4, 64); // 16KiB - 256KiB
+    for (int i = 0; i < num_files; ++i) {
+        char path[64];
+        snprintf(path, sizeof(path), "bench_small/%04d.bin", i);
+        size_t size = dist(engine) * 4 * KiB;
+        MakeFile(path, size, i);
+        paths.push_back(path);
+        bytes += size;
+    }
+
+    printf("small_files_%d:\n", num_files);
+    std::string scenario = "small_files_" + std::to_string(num_files);
+    // files are summed in order to compare results
+    Measure(scenario, "DStorageStream", bytes, [&](nanosec& first) {
+        double total = 0;
+        std::vector<ist::DStorageStream> streams(num_inflight);
+        for (int i = 0; i < num_files; i += num_inflight) {
+            int n = std::min(num_inflight, num_files - i);
+            for (int si = 0; si < n; ++si) {
+                streams[si].open(paths[i + si]);
+            }
+            for (int si = 0; si < n; ++si) {
+                check(streams[si].wait());
+                if (!first) {
+                    first = NowNS();
+                }
+                Sum(total, streams[si].data(), streams[si].read_size());
+                streams[si].close();
+            }
+        }
+        return total;
+        });
+    auto sequential = [&](auto&& reader) {
+        return [&, reader](nanosec& first) {
+            double total = 0;
+            for (auto& path : paths) {
+                nanosec f = 0;
+                double t = reader(path.c_str(), f);
+                first = first ? first : f;
+                total += t;
+            }
+            return total;
+        };
+    };
+    // MMapStream / fstream / ReadFile sum per file, so compare them with each other only
+    double total_mmap = Measure(scenario, "MMapStream", bytes, sequential(ReadMMap));
+    double total_fstream = Measure(scenario, "std::fstream", bytes, sequential(ReadFStream));
+    double total_overlapped = Measure(scenario, "ReadFile (overlapped)", bytes, sequential(ReadOverlapped));
+    check(total_fstream == total_mmap);
+    check(total_fstream == total_overlapped);
+}
+
+// random 64KiB reads from a 256MB file. all readers read the same ranges in the same order.
+static void Bench_RandomRanges()
+{
+    const char* filename = "data_256MB.bin";
+    const size_t file_size = 256 * MiB;
+    MakeFile(filename, file_size, 4);
+
+    constexpr size_t num_ranges = 4096;
+    constexpr size_t range_size = 64 * KiB;
+    std::vector<ist::DStorageStream::range> ranges(num_ranges);
+    std::mt19937 engine(5);
+    std::uniform_int_distribution<uint64_t> dist(0, (file_size - range_size) / (4 * KiB));
+    for (auto& r : ranges) {
+        r.file_offset = dist(engine) * 4 * KiB;
+        r.size = range_size;
+    }
+
+    std::string scenario = "random_" + std::to_string(num_ranges) + "x" + std::to_string(range_size);
+    printf("%s:\n", scenario.c_str());
+    uint64_t bytes = num_ranges * range_size;
+    double total_dstorage = Measure(scenario, "DStorageStream", bytes, [&](nanosec& first) { return ReadRangesDStorage(filename, ranges, first); });
+    double total_mmap = Measure(scenario, "MMapStream", bytes, [&](nanosec& first) { return ReadRangesMMap(filename, ranges, first); });
+    double total_fstream = Measure(scenario, "std::fstream", bytes, [&](nanosec& first) { return ReadRangesFStream(filename, ranges, first); });
+    double total_overlapped = Measure(scenario, "ReadFile (overlapped)", bytes, [&](nanosec& first) { return ReadRangesOverlapped(filename, ranges, first); });
+    check(total_fstream == total_mmap);
+    check(total_fstream == total_dstorage);
+    check(total_fstream == total_overlapped);
+}
+
+// open many small files from multiple threads at once. measures contention on the submission path.
+static void Bench_OpenContention()
+{
+    const char* filename = "data_256K.bin";
+    const size_t file_size = 256 * KiB;
+    MakeFile(filename, file_size, 1);
+
+    constexpr int num_opens = 1024;
+    constexpr int num_inflight = 16; // per thread
+    const int max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int num_threads = 1; ; num_threads = std::min(num_threads * 2, max_threads)) {
+        std::string scenario = "open_contention_" + std::to_string(num_threads) + "threads";
+        printf("%s:\n", scenario.c_str());
+
+        const int per_thread = num_opens / num_threads;
+        const int total = per_thread * num_threads;
+        Measure(scenario, "DStorageStream", uint64_t(file_size) * total, [&](nanosec& first) {
+            std::atomic_int failed{ 0 };
+            std::atomic<nanosec> first_block{ 0 };
+            std::vector<std::thread> threads;
+            for (int ti = 0; ti < num_threads; ++ti) {
+                threads.emplace_back([&]() {
+                    std::vector<ist::DStorageStream> streams(num_inflight);
+                    for (int i = 0; i < per_thread; i += num_inflight) {
+                        int n = std::min(num_inflight, per_thread - i);
+                        for (int si = 0; si < n; ++si) {
+                            streams[si].open(filename);
+                        }
+                        for (int si = 0; si < n; ++si) {
+                            if (!streams[si].wait() || streams[si].read_size() != file_size) {
+                                ++failed;
+                            }
+                            nanosec expected = 0;
+                            first_block.compare_exchange_strong(expected, NowNS());
+                            streams[si].close();
+                        }
+                    }
+                    });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+            check(failed == 0);
+            first = first_block;
+            return 0.0;
+            });
+
+        if (num_threads == max_threads) {
+            break;
+        }
+    }
+}
+
+// whole file written sequentially. "first" is not meaningful here.
+static void Bench_SequentialWrite()
+{
+    std::vector<size_t> table = { 64 * MiB, 256 * MiB };
+    if (g_opt.large) {
+        table.push_back(1 * GiB);
+        table.push_back(8 * GiB);
+    }
+    const char* filename = "data_write.bin";
+
+    for (size_t size : table) {
+        // an odd tail to exercise the truncation of the last sector
+        size += 1234;
+        BufferPtr data = GenRandom(size);
+        std::string scenario = "write_" + std::to_string(size);
+        printf("%s:\n", scenario.c_str());
+        double size_async = Measure(scenario, "AsyncWriteStream", size, [&](nanosec&) { return WriteAsync(filename, data.get(), size); });
+        double size_mmap = Measure(scenario, "MMapStream", size, [&](nanosec&) { return WriteMMap(filename, data.get(), size); });
+        double size_fstream = Measure(scenario, "std::fstream", size, [&](nanosec&) { return WriteFStream(filename, data.get(), size); });
+        check(size_async == double(size) && size_mmap == double(size) && size_fstream == double(size));
+    }
+    std::filesystem::remove(filename);
+}
+
+#pragma endregion Scenarios
+
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string_view param(argv[i]);
+        if (param == "--enable-debug") {
+            ist::DStorageStream::enable_debug(true);
+        }
+        else if (param == "--disable-bypassio") {
+            ist::DStorageStream::disable_bypassio(true);
+        }
+        else if (param == "--force-file-buffering") {
+            ist::DStorageStream::force_file_buffering(true);
+        }
+        else if (param == "--cold") {
+            g_opt.cold = true;
+        }
+        else if (param == "--large") {
+            g_opt.large = true;
+        }
+        else if (param == "--try" && i + 1 < argc) {
+            g_opt.num_try = std::max(1, atoi(argv[++i]));
+        }
+        else if (param == "--json" && i + 1 < argc) {
+            g_opt.json_path = argv[++i];
+        }
+        else {
+            printf("unknown option: \"%s\"\n", argv[i]);
+            printf("usage: Benchmark [--cold] [--large] [--try N] [--json path] [--enable-debug] [--disable-bypassio] [--force-file-buffering]\n");
+            return -1;
+        }
+    }
+
+    if (g_opt.cold) {
+        g_purge_available = PurgeStandbyList();
+        if (!g_purge_available) {
+            // DStorageStream and ReadFile still bypass the file cache. MMapStream and fstream may hit it.
+            printf("warning: can't purge the standby list (requires administrator). only unbuffered reads are cold.\n");
+        }
+    }
+
+    try {
+        Bench_Sequential();
+        Bench_Concurrent();
+        Bench_SmallFiles();
+        Bench_RandomRanges();
+        Bench_OpenContention();
+        Bench_SequentialWrite();
+    }
+    catch (const std::exception& e) {
+        printf("failed: %s\n", e.what());
+        return 1;
+    }
+
+    if (g_opt.json_path) {
+        WriteJson(g_opt.json_path);
+    }
+    return 0;
+}
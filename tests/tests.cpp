@@ -1,13 +1,20 @@
 ﻿#include "mmap_stream.h"
 #include "dstorage_stream.h"
+#include "async_write_stream.h"
 #include "internal.h"
 
 #include <fstream>
-#include <random>
 #include <vector>
 #include <span>
 #include <chrono>
 #include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <coroutine>
+#include <algorithm>
+#include <iterator>
 
 
 #define STRINGNIZE(V) STRINGNIZE2(V)
@@ -17,13 +24,6 @@
 
 using BufferPtr = ist::BufferPtr;
 
-using nanosec = uint64_t;
-static nanosec NowNS()
-{
-    using namespace std::chrono;
-    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
-}
-
 
 static void Test_MMapStream()
 {
@@ -43,7 +43,13 @@ static void Test_MMapStream()
     {
         ist::MMapStream of;
         of.open(filename, std::ios::out);
-        of.write((char*)data.data(), data.size() * sizeof(uint32_t));
+        const char* head = of.data();
+        for (size_t i = 0; i < data.size(); i += 1234) {
+            size_t n = std::min<size_t>(1234, data.size() - i);
+            of.write((char*)&data[i], n * sizeof(uint32_t));
+        }
+        // mapping grows in place. data() is stable across expansions.
+        check(of.data() == head);
     }
 
     // test read
@@ -62,6 +68,95 @@ static void Test_MMapStream()
         char tmp;
         ifs.read(&tmp, 1);
         check(ifs.eof());
+
+        auto view = ifs.view(block_size, block_size * 2);
+        check(view.data() == ifs.data() + block_size && view.size() == file_size - block_size);
+        check(ifs.view(file_size, 4).empty());
+    }
+
+    // test write back
+    const size_t write_back_size = ist::MMapStreamBuf::get_write_back_size();
+    ist::MMapStreamBuf::set_write_back_size(1024 * 1024);
+    {
+        ist::MMapStream of;
+        of.open("Test_MMapStreamWriteBack.bin", std::ios::out | ist::MMapStream::write_back);
+        for (size_t i = 0; i < data.size(); i += 1234) {
+            size_t n = std::min<size_t>(1234, data.size() - i);
+            of.write((char*)&data[i], n * sizeof(uint32_t));
+        }
+        auto flushed = of.flush_async();
+        check(flushed.get());
+        check(of.checkpoint());
+    }
+    {
+        ist::MMapStream ifs;
+        ifs.open("Test_MMapStreamWriteBack.bin", std::ios::in);
+        check(ifs.size() == file_size && std::memcmp(ifs.data(), data.data(), file_size) == 0);
+    }
+    ist::MMapStreamBuf::set_write_back_size(write_back_size);
+
+    // test read-ahead
+    {
+        ist::MMapStream ifs;
+        ifs.open(filename, std::ios::in | ist::MMapStream::read_ahead);
+        check(ifs.is_open() && ifs.good());
+
+        // sequential
+        std::vector<uint32_t> data2;
+        data2.resize(ifs.size() / sizeof(uint32_t));
+        for (size_t i = 0; i < data2.size(); i += 1234) {
+            size_t n = std::min<size_t>(1234, data2.size() - i);
+            ifs.read((char*)&data2[i], n * sizeof(uint32_t));
+        }
+        check(data == data2);
+
+        // strided
+        ifs.clear();
+        ifs.seekg(0);
+        for (size_t i = 0; i < data.size(); i += 4096) {
+            uint32_t v = 0;
+            ifs.seekg(i * sizeof(uint32_t));
+            ifs.read((char*)&v, sizeof(v));
+            check(v == data[i]);
+        }
+    }
+
+    // test windowed read
+    {
+        const size_t window_size = ist::MemoryMappedFile::get_window_size();
+        ist::MemoryMappedFile::set_window_size(1024 * 1024);
+
+        ist::MMapStream ifs;
+        ifs.open(filename, std::ios::in | ist::MMapStream::windowed);
+        check(ifs.is_open() && ifs.good());
+        check(ifs.size() == file_size && !ifs.data());
+
+        std::vector<uint32_t> data2;
+        data2.resize(ifs.size() / sizeof(uint32_t));
+        ifs.read((char*)data2.data(), ifs.size());
+        check(data == data2);
+
+        // seek across windows
+        uint32_t v = 0;
+        ifs.clear();
+        ifs.seekg(block_size + 8);
+        ifs.read((char*)&v, sizeof(v));
+        check(v == data[(block_size + 8) / sizeof(uint32_t)]);
+        ifs.seekg(8);
+        ifs.read((char*)&v, sizeof(v));
+        check(v == 2);
+
+        auto view = ifs.view(block_size, block_size);
+        check(view.size() == 1024 * 1024 && *(const uint32_t*)view.data() == data[block_size / sizeof(uint32_t)]);
+
+        // the window of the get area stays mapped while other windows are taken
+        ifs.seekg(8);
+        ifs.read((char*)&v, sizeof(v));
+        check(ifs.view(file_size - 4, 4).size() == 4 && ifs.view(block_size, 4).size() == 4);
+        ifs.read((char*)&v, sizeof(v));
+        check(v == 3);
+
+        ist::MemoryMappedFile::set_window_size(window_size);
     }
 
     // test error handling
@@ -72,6 +167,75 @@ static void Test_MMapStream()
     }
 }
 
+static void Test_AsyncWriteStream()
+{
+    DS_PROFILE_SCOPE("Test_AsyncWriteStream()");
+
+    const char* filename = "Test_AsyncWriteStream.bin";
+    const uint32_t file_size = 1024 * 1024 + 1234 * 4 + 3; // not aligned to the sector size
+
+    std::vector<char> data(file_size);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = char(i * 7);
+    }
+    auto read_file = [&]() {
+        std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+        return std::vector<char>(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    };
+
+    // small buffers to go around the pool several times
+    const size_t buffer_size = ist::AsyncWriteStreamBuf::get_buffer_size();
+    const size_t buffer_count = ist::AsyncWriteStreamBuf::get_buffer_count();
+    ist::AsyncWriteStreamBuf::set_buffer_size(64 * 1024);
+    ist::AsyncWriteStreamBuf::set_buffer_count(2);
+
+    // test write
+    {
+        ist::AsyncWriteStream of;
+        check(of.open(filename) && of.is_open() && of.good());
+        of.put(data[0]);
+        for (size_t i = 1; i < data.size(); i += 1234) {
+            size_t n = std::min<size_t>(1234, data.size() - i);
+            of.write(&data[i], n);
+        }
+        check(of.good() && of.size() == file_size && (uint64_t)of.tellp() == file_size);
+        check(of.close() && !of.is_open());
+        check(std::filesystem::file_size(filename) == file_size && read_file() == data);
+    }
+
+    // test flush and reserve
+    {
+        ist::AsyncWriteStream of(filename);
+        const size_t half = file_size / 2 + 1;
+        of.write(data.data(), half);
+        of.flush();
+        check(of.good() && std::filesystem::file_size(filename) == half);
+
+        // the unaligned tail is written again with the following data
+        check(of.reserve(file_size * 2));
+        of.write(data.data() + half, file_size - half);
+        check(of.close() && std::filesystem::file_size(filename) == file_size && read_file() == data);
+    }
+
+    // test empty file
+    {
+        ist::AsyncWriteStream of(filename);
+        check(of.is_open() && of.close() && std::filesystem::file_size(filename) == 0);
+    }
+
+    ist::AsyncWriteStreamBuf::set_buffer_size(buffer_size);
+    ist::AsyncWriteStreamBuf::set_buffer_count(buffer_count);
+
+    // test error handling
+    {
+        ist::AsyncWriteStream of;
+        check(!of.open("not_exist/Test_AsyncWriteStream.bin") && of.fail());
+        of.clear();
+        of.write(data.data(), 16);
+        check(of.bad() && !of.close());
+    }
+}
+
 static void Test_DStorageStream()
 {
     DS_PROFILE_SCOPE("Test_DStorageStream()");
@@ -104,6 +268,41 @@ static void Test_DStorageStream()
         check(ifs.read_size() == file_size);
     }
 
+    // test block callback and wait_any_block()
+    {
+        std::atomic<uint64_t> callback_total{ 0 };
+        ist::DStorageStream ifs;
+        ifs.set_block_callback([&](const ist::DStorageStream::block& b) { callback_total += b.size; });
+        ifs.open(filename);
+
+        uint64_t polled_total = 0;
+        ist::DStorageStream::block b;
+        while (ifs.wait_any_block(b)) {
+            check(b.offset + b.size <= file_size);
+            check(((const uint32_t*)(ifs.data() + b.offset))[0] == b.offset / 4);
+            polled_total += b.size;
+        }
+        check(ifs.wait());
+        check(polled_total == file_size && callback_total == file_size);
+        check(!ifs.poll_block(b));
+    }
+
+    // test view()
+    {
+        ist::DStorageStream ifs;
+        ifs.open(filename);
+
+        // across the block boundary
+        auto view = ifs.view(block_size * 2 - 8, 16);
+        check(view.size() == 16 && view.data() == ifs.data() + block_size * 2 - 8);
+        const uint32_t* data = (const uint32_t*)view.data();
+        for (uint32_t i = 0; i < 4; ++i) {
+            check(data[i] == block_size * 2 / 4 - 2 + i);
+        }
+        check(ifs.view(file_size - 4, 1024).size() == 4);
+        check(ifs.view(file_size, 4).empty());
+    }
+
     // test seekg()
     {
         ist::DStorageStream ifs;
@@ -138,6 +337,155 @@ static void Test_DStorageStream()
         check(ifs.eof());
     }
 
+    // test ranged read
+    {
+        using range = ist::DStorageStream::range;
+        const range ranges[] = {
+            { block_size * 2, 1234 * 4 },   // tail of the file
+            { 4, block_size + 4 },          // across the block boundary
+            { 0, 16, block_size * 2 },      // explicit destination
+        };
+
+        ist::DStorageStream ifs;
+        ifs.open(filename, ranges);
+        check(ifs.is_open() && ifs.file_size() == block_size * 2 + 16);
+        check(ifs.wait());
+
+        const uint32_t* data = (const uint32_t*)ifs.data();
+        for (uint32_t i = 0; i < 1234; ++i) {
+            check(data[i] == block_size * 2 / 4 + i);
+        }
+        data = (const uint32_t*)(ifs.data() + 1234 * 4);
+        for (uint32_t i = 0; i < (block_size + 4) / 4; ++i) {
+            check(data[i] == i + 1);
+        }
+        data = (const uint32_t*)(ifs.data() + block_size * 2);
+        for (uint32_t i = 0; i < 4; ++i) {
+            check(data[i] == i);
+        }
+
+        ist::DStorageStream err;
+        const range out_of_range[] = { { file_size - 4, 8 } };
+        check(!err.open(filename, out_of_range) && err.state() == ist::DStorageStream::status_code::error_out_of_range);
+    }
+
+    // test small file fast path
+    {
+        using range = ist::DStorageStream::range;
+        const range small[] = { { 16, 16 }, { block_size, 16 } };
+
+        // completed synchronously in open()
+        ist::DStorageStream ifs;
+        check(ifs.open(filename, small) && ifs.is_complete() && ifs.read_size() == 32);
+        const uint32_t* data = (const uint32_t*)ifs.data();
+        check(data[0] == 4 && data[4] == block_size / 4);
+
+        // same result through DirectStorage
+        uint32_t threshold = ist::DStorageStream::get_small_file_threshold();
+        ist::DStorageStream::set_small_file_threshold(0);
+        ist::DStorageStream ifs2;
+        check(ifs2.open(filename, small) && ifs2.wait() && std::memcmp(ifs.data(), ifs2.data(), 32) == 0);
+        ist::DStorageStream::set_small_file_threshold(threshold);
+    }
+
+    // test caller-provided buffer
+    {
+        std::vector<uint32_t> data;
+        data.resize(file_size / sizeof(uint32_t));
+
+        ist::DStorageStream ifs;
+        check(!ifs.open(filename, data.data(), file_size - 4));
+        check(ifs.open(filename, data.data(), file_size));
+        check(ifs.wait() && ifs.data() == (const char*)data.data());
+        for (size_t i = 0; i < data.size(); ++i) {
+            check(data[i] == (uint32_t)i);
+        }
+    }
+
+    // test priority
+    {
+        using ds = ist::DStorageStream;
+        check(ist::DStorageStreamBuf::get_priority({}) == 0 && ist::DStorageStreamBuf::get_priority(ds::low_priority) == -1);
+        check(ist::DStorageStreamBuf::get_priority(ds::async_free | ds::realtime_priority) == 2);
+
+        // bulk read in low priority queue and urgent read in realtime queue
+        const ds::range head[] = { { 0, 4096 } };
+        ds bulk, urgent;
+        bulk.open(filename, ds::async_free | ds::low_priority);
+        urgent.open(filename, head, ds::async_free | ds::realtime_priority);
+        check(urgent.wait() && ((const uint32_t*)urgent.data())[1023] == 1023);
+        check(bulk.wait() && bulk.read_size() == file_size);
+    }
+
+    // test adaptive request sizing
+    {
+        ist::DStorageStream::enable_adaptive_request_size(true);
+        auto info = ist::DStorageStream::get_request_size_info();
+        check(info.adaptive && info.first_request_size < info.max_request_size && info.max_request_size <= block_size);
+
+        ist::DStorageStream ifs;
+        ifs.open(filename);
+        ist::DStorageStream::block b;
+        check(ifs.wait_any_block(b) && b.offset == 0 && b.size == info.first_request_size);
+        check(ifs.wait_any_block(b) && b.offset == info.first_request_size && b.size == info.first_request_size * 2);
+        check(ifs.wait() && ifs.read_size() == file_size);
+
+        ist::DStorageStream::enable_adaptive_request_size(false);
+    }
+
+    // test cancel()
+    {
+        using status_code = ist::DStorageStream::status_code;
+
+        ist::DStorageStream ifs;
+        ifs.open(filename);
+        ifs.cancel();
+        bool completed = ifs.wait();
+        check(completed ? ifs.state() == status_code::completed : ifs.state() == status_code::cancelled);
+
+        // close() in the middle of reading. in-flight requests are cancelled and the buffer is released when they are done.
+        ifs.open(filename);
+        ifs.wait_next_block();
+        ifs.close();
+        check(!ifs.is_open() && ifs.data() == nullptr);
+
+        // the stream can be reused
+        check(ifs.open(filename) && ifs.wait() && ifs.read_size() == file_size);
+    }
+
+    // test verify
+    {
+        using status_code = ist::DStorageStream::status_code;
+
+        std::vector<uint32_t> data(file_size / sizeof(uint32_t));
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = (uint32_t)i;
+        }
+        uint32_t crc = ist::Crc32c(data.data(), file_size);
+        check(ist::Crc32cCombine(ist::Crc32c(data.data(), 100), ist::Crc32c((char*)data.data() + 100, file_size - 100), file_size - 100) == crc);
+
+        ist::DStorageStream ifs;
+        ifs.set_expected_checksum(crc);
+        check(ifs.open(filename, ist::DStorageStream::verify) && ifs.wait() && ifs.checksum() == crc);
+
+        // the expected checksum applies to the next open() only
+        check(ifs.open(filename, ist::DStorageStream::verify) && ifs.wait() && ifs.checksum() == crc);
+
+        // set on a completed stream, it re-checks the current stream
+        ifs.set_expected_checksum(crc + 1);
+        check(ifs.state() == status_code::error_checksum_mismatch);
+
+        ifs.close();
+        ifs.set_expected_checksum(crc + 1);
+        ifs.open(filename, ist::DStorageStream::verify);
+        check(!ifs.wait() && ifs.state() == status_code::error_checksum_mismatch);
+
+        // set while in flight, it applies to the current stream
+        ifs.open(filename, ist::DStorageStream::verify);
+        ifs.set_expected_checksum(crc + 1);
+        check(!ifs.wait() && ifs.state() == status_code::error_checksum_mismatch);
+    }
+
     // test error handling
     {
         ist::DStorageStream ifs;
@@ -146,134 +494,686 @@ static void Test_DStorageStream()
     }
 }
 
-static BufferPtr GenRandom(size_t size_in_byte, int seed = 0)
+static void Test_OverlappedIO()
 {
-    std::mt19937 engine(seed);
-    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    DS_PROFILE_SCOPE("Test_OverlappedIO()");
+
+    using status_code = ist::DStorageStream::status_code;
+    printf("DirectStorage: %s\n", ist::DStorageStream::is_direct_storage_available() ? "available" : "not available");
+
+    // Test_DStorageStream.bin is made by Test_DStorageStream()
+    const char* filename = "Test_DStorageStream.bin";
+    const uint32_t block_size = ist::DStorageStream::get_staging_buffer_size();
+    const uint32_t file_size = (uint32_t)std::filesystem::file_size(filename);
 
-    BufferPtr buf = ist::CreateBuffer(size_in_byte);
-    std::span data{ (float*)buf.get(), size_in_byte / sizeof(float)};
-    for (float& v : data) {
-        v = dist(engine);
+    ist::DStorageStream::force_overlapped_io(true);
+
+    // whole file. blocks are sector-aligned and read unbuffered. the tail is not a multiple of sectors.
+    {
+        std::atomic<uint64_t> callback_total{ 0 };
+        ist::DStorageStream ifs;
+        ifs.set_block_callback([&](const ist::DStorageStream::block& b) { callback_total += b.size; });
+        check(ifs.open(filename));
+
+        uint64_t prev = 0;
+        while (ifs.wait_next_block()) {
+            check(ifs.read_size() > prev);
+            prev = ifs.read_size();
+        }
+        check(ifs.wait() && ifs.read_size() == file_size && callback_total == file_size);
+        const uint32_t* data = (const uint32_t*)ifs.data();
+        for (uint32_t i = 0; i < file_size / 4; ++i) {
+            check(data[i] == i);
+        }
+    }
+
+    // unaligned ranges. read with buffering.
+    {
+        using range = ist::DStorageStream::range;
+        const range ranges[] = {
+            { 4, block_size + 4 },
+            { block_size * 2, 1234 * 4 },
+        };
+        ist::DStorageStream ifs;
+        check(ifs.open(filename, ranges) && ifs.wait());
+        const uint32_t* data = (const uint32_t*)ifs.data();
+        for (uint32_t i = 0; i < (block_size + 4) / 4; ++i) {
+            check(data[i] == i + 1);
+        }
+        data = (const uint32_t*)(ifs.data() + block_size + 4);
+        for (uint32_t i = 0; i < 1234; ++i) {
+            check(data[i] == block_size * 2 / 4 + i);
+        }
+    }
+
+    // verify
+    {
+        ist::DStorageStream ifs;
+        check(ifs.open(filename, ist::DStorageStream::verify) && ifs.wait());
+        check(ifs.checksum() == ist::Crc32c(ifs.data(), file_size));
+    }
+
+    // cancel() and close() in the middle of reading
+    {
+        ist::DStorageStream ifs;
+        ifs.open(filename);
+        ifs.cancel();
+        bool completed = ifs.wait();
+        check(completed ? ifs.state() == status_code::completed : ifs.state() == status_code::cancelled);
+
+        ifs.open(filename);
+        ifs.wait_next_block();
+        ifs.close();
+        check(!ifs.is_open() && ifs.data() == nullptr);
     }
-    return buf;
+
+    // batch
+    {
+        ist::DStorageBatch batch;
+        batch.add(filename);
+        batch.add(filename);
+        check(batch.submit() && batch.wait());
+        for (auto& ifs : batch.streams()) {
+            check(ifs.read_size() == file_size);
+        }
+    }
+
+    // errors
+    {
+        ist::DStorageStream ifs;
+        check(!ifs.open("Test_OverlappedIO_not_found.bin") && ifs.state() == status_code::error_file_open_failed);
+    }
+
+    ist::DStorageStream::force_overlapped_io(false);
 }
 
-template<class T>
-static double CalcTotal(const char* path)
+static void Test_BufferPool()
 {
-    double total = 0.0;
-    if constexpr (std::is_same_v<T, std::fstream>) {
-        std::fstream ifs;
-        ifs.open(path, std::ios::in | std::ios::binary);
-        if (ifs) {
-            size_t size = std::filesystem::file_size(path);
-            BufferPtr buf = ist::CreateBuffer(size);
-            ifs.read(buf.get(), size);
-
-            std::span data{ (const float*)buf.get(), size / sizeof(float)};
-            for (float v : data) {
-                total += v;
-            }
+    DS_PROFILE_SCOPE("Test_BufferPool()");
+
+    const size_t capacity = 1024 * 1024 * 16;
+    ist::SetBufferPoolCapacity(capacity);
+    {
+        char* ptr = nullptr;
+        {
+            BufferPtr buf = ist::CreateBuffer(1024 * 1000, false);
+            ptr = buf.get();
+        }
+        {
+            // same size class. should be reused.
+            BufferPtr buf = ist::CreateBuffer(1024 * 1024, false);
+            check(buf.get() == ptr);
+        }
+        {
+            // different size class. should not be reused.
+            BufferPtr buf = ist::CreateBuffer(1024 * 1024 * 4, false);
+            check(buf.get() != ptr);
         }
     }
-    else if constexpr (std::is_same_v<T, ist::MMapStream>) {
-        ist::MMapStream ifs;
-        if (ifs.open(path, std::ios::in | ist::MMapStream::async_prefetch | ist::MMapStream::async_unmap)) {
-            std::span data{ (const float*)ifs.data(), ifs.size() / sizeof(float) };
-            for (float v : data) {
-                total += v;
+    ist::ClearBufferPool();
+    ist::SetBufferPoolCapacity(0);
+}
+
+static void Test_FileCache()
+{
+    DS_PROFILE_SCOPE("Test_FileCache()");
+
+    const char* filenames[] = { "Test_FileCache0.bin", "Test_FileCache1.bin" };
+    auto write_file = [](const char* filename, uint32_t value) {
+        std::ofstream of(filename, std::ios::out | std::ios::binary);
+        std::vector<uint32_t> data(1024, value);
+        of.write((char*)data.data(), data.size() * sizeof(uint32_t));
+    };
+    auto read_first = [](const char* filename) -> uint32_t {
+        ist::DStorageStream ifs;
+        ifs.open(filename);
+        check(ifs.wait());
+        return ((const uint32_t*)ifs.data())[0];
+    };
+    write_file(filenames[0], 0);
+    write_file(filenames[1], 1);
+
+    ist::SetFileCacheCapacity(1);
+    check(ist::GetFileCacheCapacity() == 1);
+
+    // repeated opens. second one takes the file from the cache.
+    check(read_first(filenames[0]) == 0);
+    check(read_first(filenames[0]) == 0);
+    // evicts filenames[0]
+    check(read_first(filenames[1]) == 1);
+    check(read_first(filenames[0]) == 0);
+
+    // cached files must be released before modifying
+    ist::ClearFileCache();
+    write_file(filenames[0], 2);
+    check(read_first(filenames[0]) == 2);
+
+    ist::SetFileCacheCapacity(0);
+    ist::ClearFileCache();
+}
+
+static void Test_LargePageBuffer()
+{
+    DS_PROFILE_SCOPE("Test_LargePageBuffer()");
+
+    printf("large pages: %s\n", ist::IsLargePageAvailable() ? "available" : "not available");
+
+    // should fallback to normal pages if large pages are not available
+    const size_t size = 1024 * 1024 * 5;
+    BufferPtr buf = ist::CreateBuffer(size, false, true, true, 0);
+    check(buf);
+    std::memset(buf.get(), 1, size);
+
+    const char* filename = "Test_DStorageStream.bin";
+    ist::DStorageStream ifs;
+    check(ifs.open(filename, ist::DStorageStream::large_pages | ist::DStorageStream::numa_node(0)));
+    check(ifs.wait() && ifs.read_size() == std::filesystem::file_size(filename));
+}
+
+static void Test_DStorageBatch()
+{
+    DS_PROFILE_SCOPE("Test_DStorageBatch()");
+
+    const uint32_t block_size = ist::DStorageStream::get_staging_buffer_size();
+    const uint32_t file_sizes[] = { 4, 1234 * 4, block_size + 1234 * 4 };
+    const char* filenames[] = { "Test_DStorageBatch0.bin", "Test_DStorageBatch1.bin", "Test_DStorageBatch2.bin" };
+    for (size_t fi = 0; fi < std::size(filenames); ++fi) {
+        std::ofstream of(filenames[fi], std::ios::out | std::ios::binary);
+
+        std::vector<uint32_t> data;
+        data.resize(file_sizes[fi] / sizeof(uint32_t));
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = (uint32_t)(i + fi);
+        }
+        of.write((char*)data.data(), data.size() * sizeof(uint32_t));
+    }
+
+    // test read
+    {
+        ist::DStorageBatch batch;
+        for (const char* filename : filenames) {
+            batch.add(filename);
+        }
+        check(batch.submit());
+        check(batch.size() == std::size(filenames));
+
+        // streams can be moved out of the batch while reading
+        ist::DStorageStream last = std::move(batch[2]);
+        check(batch.wait());
+
+        for (int fi = 0; fi < 2; ++fi) {
+            auto& ifs = batch[fi];
+            check(ifs.is_complete() && ifs.read_size() == file_sizes[fi]);
+            std::span data{ (const uint32_t*)ifs.data(), ifs.file_size() / sizeof(uint32_t) };
+            for (size_t i = 0; i < data.size(); ++i) {
+                check(data[i] == (uint32_t)(i + fi));
             }
         }
+
+        std::vector<uint32_t> data;
+        data.resize(file_sizes[2] / sizeof(uint32_t));
+        last.read((char*)data.data(), file_sizes[2]);
+        check(last.read_size() == file_sizes[2]);
+        for (size_t i = 0; i < data.size(); ++i) {
+            check(data[i] == (uint32_t)(i + 2));
+        }
+    }
+
+    // test error handling
+    {
+        ist::DStorageBatch batch;
+        batch.add(filenames[0]);
+        batch.add("not_exist.bin");
+        check(!batch.submit());
+        check(batch[0].wait());
+        check(!batch[1].is_open() && batch[1].fail());
+        // errors are reported per stream
+        check(batch[0].error().hresult == 0 && batch[1].error().hresult != 0);
+    }
+
+    // many streams in flight at once. completion of all of them is handled by one thread.
+    {
+        std::vector<ist::DStorageStream> streams(64);
+        for (size_t si = 0; si < streams.size(); ++si) {
+            streams[si].open(filenames[si % std::size(filenames)]);
+        }
+        for (size_t si = 0; si < streams.size(); ++si) {
+            size_t fi = si % std::size(filenames);
+            auto& ifs = streams[si];
+            check(ifs.wait() && ifs.read_size() == file_sizes[fi]);
+            check(((const uint32_t*)ifs.data())[0] == (uint32_t)fi);
+        }
     }
-    else if constexpr (std::is_same_v<T, ist::DStorageStream>) {
+}
+
+// fire-and-forget coroutine. starts eagerly and frees itself at the end.
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static void Test_Coroutine()
+{
+    DS_PROFILE_SCOPE("Test_Coroutine()");
+
+    // Test_DStorageStream.bin is made by Test_DStorageStream()
+    const char* filename = "Test_DStorageStream.bin";
+    const uint32_t block_size = ist::DStorageStream::get_staging_buffer_size();
+    const uint32_t file_size = (uint32_t)std::filesystem::file_size(filename);
+
+    // coroutines are resumed on this thread
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::coroutine_handle<>> queue;
+    ist::DStorageStream::executor exec = [&](std::coroutine_handle<> h) {
+        {
+            std::unique_lock lock{ mutex };
+            queue.push_back(h);
+        }
+        cond.notify_one();
+    };
+
+    constexpr int num_streams = 16;
+    std::atomic<int> done{ 0 }, succeeded{ 0 };
+    std::vector<ist::DStorageStream> streams(num_streams);
+    auto load = [&](ist::DStorageStream& ifs) -> DetachedTask {
+        bool ok = ifs.open(filename);
+        uint64_t prev = 0;
+        while (co_await ifs.next_block(exec)) {
+            ok = ok && ifs.read_size() > prev;
+            prev = ifs.read_size();
+        }
+        ok = ok && co_await ifs.completed(exec) && ifs.read_size() == file_size;
+
+        auto tail = co_await ifs.ready(file_size - 16, 1024, exec);
+        ok = ok && tail.size() == 16 && ((const uint32_t*)tail.data())[3] == file_size / 4 - 1;
+        succeeded += ok;
+        ++done;
+    };
+    for (auto& ifs : streams) {
+        load(ifs);
+    }
+    while (done < num_streams) {
+        std::unique_lock lock{ mutex };
+        cond.wait(lock, [&]() { return !queue.empty(); });
+        auto h = queue.front();
+        queue.pop_front();
+        lock.unlock();
+        h.resume();
+    }
+    check(succeeded == num_streams);
+
+    // without executor, resumed on the library thread
+    {
+        std::atomic_bool resumed{ false };
+        std::span<const char> view;
         ist::DStorageStream ifs;
-        if (ifs.open(path)) {
-            size_t pos = 0;
-            while (ifs.wait_next_block()) {
-                std::span data{ (const float*)(ifs.data() + pos), (ifs.read_size() - pos) / sizeof(float) };
-                for (float v : data) {
-                    total += v;
+        auto wait_range = [&]() -> DetachedTask {
+            view = co_await ifs.ready(block_size, 16);
+            resumed = true;
+        };
+        check(ifs.open(filename));
+        wait_range();
+        check(ifs.wait());
+        while (!resumed) {
+            std::this_thread::yield();
+        }
+        check(view.size() == 16 && ((const uint32_t*)view.data())[0] == block_size / 4);
+
+        // finished streams resume immediately
+        resumed = false;
+        wait_range();
+        check(resumed && view.data() == ifs.data() + block_size);
+    }
+}
+
+static void Test_ParallelBlocks()
+{
+    DS_PROFILE_SCOPE("Test_ParallelBlocks()");
+
+    // Test_DStorageStream.bin is made by Test_DStorageStream()
+    const char* filename = "Test_DStorageStream.bin";
+    const uint32_t file_size = (uint32_t)std::filesystem::file_size(filename);
+    const uint64_t n = file_size / sizeof(uint32_t);
+
+    // ForEachBlockParallel()
+    {
+        std::atomic<uint64_t> total{ 0 };
+        std::atomic<int> mismatches{ 0 };
+        ist::DStorageStream ifs;
+        check(ifs.open(filename));
+        bool ok = ist::ForEachBlockParallel(ifs, [&](const ist::DStorageStream::block& b, std::span<const char> data) {
+            const uint32_t* values = (const uint32_t*)data.data();
+            for (size_t i = 0; i < data.size() / sizeof(uint32_t); ++i) {
+                if (values[i] != b.offset / sizeof(uint32_t) + i) {
+                    ++mismatches;
                 }
-                pos = ifs.read_size();
             }
+            total += data.size();
+            });
+        check(ok && total == file_size && mismatches == 0);
+    }
+
+    // ReduceBlocksParallel(). reduce is called in buffer order on this thread.
+    {
+        ist::DStorageStream ifs;
+        check(ifs.open(filename));
+        int64_t prev = -1; // offset of the last reduced block
+        bool ordered = true;
+        uint64_t sum = ist::ReduceBlocksParallel<uint64_t>(ifs, 0,
+            [](std::span<const char> data) {
+                // (offset of the block, sum of the block)
+                const uint32_t* values = (const uint32_t*)data.data();
+                uint64_t r = 0;
+                for (size_t i = 0; i < data.size() / sizeof(uint32_t); ++i) {
+                    r += values[i];
+                }
+                return std::make_pair(uint64_t(values[0]) * sizeof(uint32_t), r);
+            },
+            [&](uint64_t acc, const std::pair<uint64_t, uint64_t>& r) {
+                ordered = ordered && (int64_t)r.first > prev;
+                prev = (int64_t)r.first;
+                return acc + r.second;
+            });
+        check(ordered && sum == n * (n - 1) / 2);
+    }
+
+    // ForEachChunkParallel()
+    {
+        // Test_MMapStreamStream.bin is made by Test_MMapStream()
+        const char* mmap_filename = "Test_MMapStreamStream.bin";
+        const uint64_t mmap_size = std::filesystem::file_size(mmap_filename);
+        const size_t chunk_size = 64 * 1024;
+
+        auto test = [&](std::ios::openmode mode) {
+            std::atomic<uint64_t> total{ 0 };
+            std::atomic<int> mismatches{ 0 };
+            ist::MMapStream ifs;
+            ifs.open(mmap_filename, mode);
+            bool ok = ist::ForEachChunkParallel(ifs, chunk_size, [&](uint64_t pos, std::span<const char> chunk) {
+                if (chunk.size() > chunk_size || *(const uint32_t*)chunk.data() != pos / sizeof(uint32_t)) {
+                    ++mismatches;
+                }
+                total += chunk.size();
+                });
+            return ok && total == mmap_size && mismatches == 0;
+        };
+        check(test(std::ios::in));
+
+        const size_t window_size = ist::MemoryMappedFile::get_window_size();
+        ist::MemoryMappedFile::set_window_size(1024 * 1024);
+        check(test(std::ios::in | ist::MMapStream::windowed));
+        ist::MemoryMappedFile::set_window_size(window_size);
+
+        ist::MMapStream ifs;
+        check(!ist::ForEachChunkParallel(ifs, chunk_size, [](uint64_t, std::span<const char>) {}));
+    }
+}
+
+static void Test_StreamingMode()
+{
+    DS_PROFILE_SCOPE("Test_StreamingMode()");
+
+    // Test_DStorageStream.bin is made by Test_DStorageStream(). it has 3 blocks, so a ring of 2 blocks is smaller than the file.
+    const char* filename = "Test_DStorageStream.bin";
+    const uint32_t block_size = ist::DStorageStream::get_staging_buffer_size();
+    const uint32_t file_size = (uint32_t)std::filesystem::file_size(filename);
+    const uint32_t ring_size = ist::DStorageStream::get_streaming_ring_size();
+    ist::DStorageStream::set_streaming_ring_size(1);
+    check(ist::DStorageStream::get_streaming_ring_size() == 2);
+
+    // sequential read through the ring
+    {
+        ist::DStorageStream ifs;
+        check(ifs.open(filename, std::ios::in | ist::DStorageStream::streaming));
+        check(ifs.data() == nullptr);
+
+        std::vector<uint32_t> data(file_size / sizeof(uint32_t));
+        ifs.read((char*)data.data(), file_size);
+        check(ifs.gcount() == file_size);
+
+        bool ok = true;
+        for (size_t i = 0; i < data.size(); ++i) {
+            ok = ok && data[i] == (uint32_t)i;
         }
+        check(ok);
+        check(ifs.wait() && ifs.is_complete());
+    }
+
+    // forward seek and view() of the current block
+    {
+        ist::DStorageStream ifs;
+        ifs.open(filename, std::ios::in | ist::DStorageStream::streaming);
+
+        const uint32_t pos = block_size + 16;
+        ifs.seekg(pos);
+        check(ifs.good() && (uint32_t)ifs.tellg() == pos);
+        uint32_t v = 0;
+        ifs.read((char*)&v, sizeof(v));
+        check(v == pos / sizeof(uint32_t));
+
+        auto view = ifs.view(pos, sizeof(v));
+        check(view.size() == sizeof(v) && *(const uint32_t*)view.data() == pos / sizeof(uint32_t));
+        check(ifs.view(0, sizeof(v)).empty()); // the first block is released
+
+        // backward out of the current block
+        ifs.seekg(0);
+        check(ifs.fail());
+        ifs.clear();
+
+        // wait() cancels the rest. the last block may have been read already.
+        ifs.wait();
+        check(!ifs.wait_next_block() && ifs.view(pos, sizeof(v)).empty());
+    }
+
+    // wait() cancels the rest. the last block can't be read until the first one is released.
+    {
+        ist::DStorageStream ifs;
+        ifs.open(filename, std::ios::in | ist::DStorageStream::streaming);
+        check(!ifs.wait() && ifs.state() == ist::DStorageStream::status_code::cancelled);
+    }
+
+    // verify
+    {
+        ist::DStorageStream ifs;
+        ifs.open(filename, std::ios::in | ist::DStorageStream::streaming | ist::DStorageStream::verify);
+        while (ifs.wait_next_block()) {}
+        check(ifs.wait() && ifs.state() == ist::DStorageStream::status_code::completed);
     }
-    else {
-        static_assert(std::is_same_v<T, std::fstream>);
+
+    // files that fit in the ring are read as usual
+    {
+        ist::DStorageStream::set_streaming_ring_size(4);
+        ist::DStorageStream ifs;
+        ifs.open(filename, std::ios::in | ist::DStorageStream::streaming);
+        check(ifs.wait() && ifs.data() != nullptr);
+        check(ifs.data() && *(const uint32_t*)(ifs.data() + block_size) == block_size / sizeof(uint32_t));
     }
-    return total;
+    ist::DStorageStream::set_streaming_ring_size(ring_size);
 }
 
-static void Test_Benchmark()
+static void Test_CompressedFile()
 {
-    DS_PROFILE_SCOPE("Test_Benchmark()");
-
-    constexpr size_t KiB = 1024;
-    constexpr size_t MiB = 1024 * 1024;
-    constexpr size_t GiB = 1024 * 1024 * 1024;
-    std::tuple<const char*, size_t> table[] = {
-        {"data_4K.bin", 4 * KiB},
-        {"data_256K.bin", 256 * KiB},
-        {"data_4MB.bin", 4 * MiB},
-        {"data_64MB.bin", 64 * MiB},
-        {"data_256MB.bin", 256 * MiB},
-        {"data_1GB.bin", 1 * GiB},
-        {"data_8GB.bin", 8 * GiB},
-    };
+    DS_PROFILE_SCOPE("Test_CompressedFile()");
+
+    const char* filename = "Test_CompressedFile.bin";
+    const uint32_t chunk_size = 1024 * 1024;
+    const uint32_t file_size = chunk_size * 3 + 1234 * 4;
+    if (!ist::DStorageStream::is_direct_storage_available()) {
+        printf("Test_CompressedFile: skipped. GDeflate needs DirectStorage\n");
+        return;
+    }
+
+    std::vector<uint32_t> data;
+    data.resize(file_size / sizeof(uint32_t));
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint32_t)(i / 16);
+    }
+    check(ist::WriteCompressedFile(filename, data.data(), file_size, chunk_size));
+    check(std::filesystem::file_size(filename) < file_size);
 
+    // test read
     {
-        int i = 0;
-        for (const auto& [filename, size] : table) {
-            if (!std::filesystem::exists(filename)) {
-                printf("making %s...", filename);
-                std::ofstream of(filename, std::ios::out | std::ios::binary);
-                BufferPtr data = GenRandom(size, i);
-                of.write(data.get(), size);
-                printf(" done\n");
-            }
-            ++i;
+        ist::DStorageStream ifs;
+        ifs.open(filename, ist::DStorageStream::compressed);
+        check(ifs.is_open() && ifs.file_size() == file_size);
+
+        // progress is reported in uncompressed size
+        ifs.wait_next_block();
+        check(ifs.read_size() >= chunk_size);
+
+        std::vector<uint32_t> data2;
+        data2.resize(file_size / sizeof(uint32_t));
+        ifs.read((char*)data2.data(), file_size);
+        check(ifs.is_complete() && data == data2);
+    }
+
+    // test error handling
+    {
+        ist::DStorageStream ifs;
+        ifs.open("Test_DStorageStream.bin", ist::DStorageStream::compressed);
+        check(!ifs.is_open() && ifs.state() == ist::DStorageStream::status_code::error_invalid_format);
+    }
+}
+
+static void Test_PackFile()
+{
+    DS_PROFILE_SCOPE("Test_PackFile()");
+
+    const char* filename = "Test_PackFile.bin";
+    const uint32_t block_size = ist::DStorageStream::get_staging_buffer_size();
+    const uint32_t sizes[] = { 16, block_size + 1234 * 4, 1024 * 1024 * 2 };
+    const char* names[] = { "small.bin", "large.bin", "compressed.bin" };
+    const bool gdeflate = ist::DStorageStream::is_direct_storage_available(); // compressed.bin is stored as is without it
+
+    std::vector<std::vector<uint32_t>> assets(std::size(names));
+    for (size_t ai = 0; ai < assets.size(); ++ai) {
+        assets[ai].resize(sizes[ai] / sizeof(uint32_t));
+        for (size_t i = 0; i < assets[ai].size(); ++i) {
+            assets[ai][i] = (uint32_t)((i / 16) + ai);
         }
     }
 
-    constexpr int num_try = 3;
-    for (const auto& [filename, size] : table) {
-        double total_fstream = 0;
-        double total_mmap = 0;
-        double total_dstorage = 0;
+    // test build
+    {
+        ist::DStoragePackBuilder builder;
+        check(builder.open(filename, 4096));
+        for (size_t ai = 0; ai < assets.size(); ++ai) {
+            bool compress = ai == 2 && gdeflate;
+            check(builder.add(names[ai], assets[ai].data(), sizes[ai], compress, compress ? 1024 * 1024 : 0));
+        }
+        check(!builder.add(names[0], assets[0].data(), sizes[0])); // duplicated name
+        check(builder.close());
+    }
 
-        printf("file size %llu:\n", size);
-        {
-            for (int i = 0; i < num_try; ++i) {
-                DS_PROFILE_SCOPE("DStorageStream (%lluB)", size);
-                nanosec start = NowNS();
-                total_dstorage = CalcTotal<ist::DStorageStream>(filename);
-                double elapsed = (NowNS() - start) / 1000000000.0;
-                double mbps = (double)size / (1024 * 1024) / elapsed;
-                printf("DStorageStream:\t%.2lfms (%.1lfMB/s)\n", elapsed * 1000, mbps);
-            }
-            for (int i = 0; i < num_try; ++i) {
-                DS_PROFILE_SCOPE("MMapStream (%lluB)", size);
-                nanosec start = NowNS();
-                total_mmap = CalcTotal<ist::MMapStream>(filename);
-                double elapsed = (NowNS() - start) / 1000000000.0;
-                double mbps = (double)size / (1024 * 1024) / elapsed;
-                printf("MMapStream:\t%.2lfms (%.1lfMB/s)\n", elapsed * 1000, mbps);
-            }
-            for (int i = 0; i < num_try; ++i) {
-                DS_PROFILE_SCOPE("std::fstream (%lluB)", size);
-                nanosec start = NowNS();
-                total_fstream = CalcTotal<std::fstream>(filename);
-                double elapsed = (NowNS() - start) / 1000000000.0;
-                double mbps = (double)size / (1024 * 1024) / elapsed;
-                printf("std::fstream:\t%.2lfms (%.1lfMB/s)\n", elapsed * 1000, mbps);
-            }
-            check(total_fstream == total_mmap);
-            check(total_fstream == total_dstorage);
+    // test read
+    {
+        ist::DStoragePack pack;
+        check(pack.open(filename) && pack.size() == std::size(names));
+        check(pack.find("not_exist.bin") == ist::DStoragePack::npos);
+
+        std::vector<ist::DStorageStream> streams(std::size(names));
+        std::vector<uint32_t> checksums(std::size(names)); // entry() is not available after close()
+        for (size_t ai = 0; ai < assets.size(); ++ai) {
+            size_t i = pack.find(names[ai]);
+            check(i != ist::DStoragePack::npos);
+            auto e = pack.entry(i);
+            checksums[ai] = e.checksum;
+            check(e.name == names[ai] && e.uncompressed_size == sizes[ai] && e.compressed == (ai == 2 && gdeflate) && e.offset % 4096 == 0);
+            check(e.has_checksum && e.checksum == ist::Crc32c(assets[ai].data(), sizes[ai]));
+            check(pack.open_asset(streams[ai], names[ai], ist::DStoragePack::async_free | ist::DStorageStream::verify));
         }
+
+        // streams are alive after the pack is closed
+        pack.close();
+        for (size_t ai = 0; ai < assets.size(); ++ai) {
+            auto& ifs = streams[ai];
+            check(ifs.wait() && ifs.read_size() == sizes[ai]);
+            check(std::memcmp(ifs.data(), assets[ai].data(), sizes[ai]) == 0);
+            check(ifs.checksum() == checksums[ai]);
+        }
+
+        ist::DStorageStream ifs;
+        check(!pack.open_asset(ifs, names[0]) && ifs.fail());
+
+        // moved-from pack is closed and reusable
+        check(pack.open(filename));
+        ist::DStoragePack moved = std::move(pack);
+        check(moved.is_open() && moved.size() == std::size(names));
+        check(!pack.is_open() && pack.size() == 0 && pack.find(names[0]) == ist::DStoragePack::npos);
+        pack.close();
+        check(pack.open(filename) && pack.size() == std::size(names));
+    }
+
+    // test error handling
+    {
+        ist::DStoragePack pack;
+        check(!pack.open("Test_DStorageStream.bin") && !pack.is_open());
     }
 }
 
+static void Test_Stats()
+{
+    DS_PROFILE_SCOPE("Test_Stats()");
+
+    std::mutex mutex;
+    std::vector<ist::TraceEvent> events;
+    ist::SetTraceHook([&](const ist::TraceEvent& ev) {
+        std::unique_lock lock{ mutex };
+        events.push_back(ev);
+        });
+    auto count_events = [&](ist::TraceEventType type, ist::TracePhase phase) {
+        std::unique_lock lock{ mutex };
+        return std::count_if(events.begin(), events.end(), [&](auto& ev) { return ev.type == type && ev.phase == phase; });
+    };
+
+    const char* filename = "Test_DStorageStream.bin";
+    const size_t file_size = std::filesystem::file_size(filename);
+    ist::Stats before = ist::GetStats();
+    {
+        ist::DStorageStream ifs;
+        check(ifs.open(filename) && ifs.wait());
+
+        auto st = ifs.stats();
+        check(st.bytes == file_size);
+        check(st.submit_ns > 0 && st.submit_ns >= st.probe_ns);
+        check(st.first_block_ns >= st.submit_ns);
+        check(st.total_ns >= st.first_block_ns);
+    }
+    {
+        ist::DStorageStream ifs;
+        check(!ifs.open("Test_Stats_not_found.bin"));
+        check(ifs.stats().bytes == 0);
+    }
+    ist::Stats after = ist::GetStats();
+    check(after.total_streams >= before.total_streams + 2);
+    check(after.total_bytes >= before.total_bytes + file_size);
+    check(after.errors >= before.errors + 1);
+
+    ist::SetTraceHook(nullptr);
+    check(count_events(ist::TraceEventType::open, ist::TracePhase::begin) == 2);
+    check(count_events(ist::TraceEventType::open, ist::TracePhase::end) == 2);
+    check(count_events(ist::TraceEventType::submit, ist::TracePhase::instant) == 1);
+    check(count_events(ist::TraceEventType::first_block, ist::TracePhase::instant) == 1);
+    check(count_events(ist::TraceEventType::complete, ist::TracePhase::instant) == 2);
+    check(count_events(ist::TraceEventType::wait_next_block, ist::TracePhase::begin) > 0);
+    check(count_events(ist::TraceEventType::create_buffer, ist::TracePhase::begin) == 1);
+
+    // removed hook must not be called
+    size_t n = events.size();
+    {
+        ist::DStorageStream ifs;
+        check(ifs.open(filename) && ifs.wait());
+    }
+    check(events.size() == n);
+}
 
 int main(int argc, char* argv[])
 {
@@ -294,10 +1194,26 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (!ist::DStorageStream::is_direct_storage_available()) {
+        // files are read in requests smaller than the staging buffer. tests expect one block per staging buffer.
+        ist::DStorageStream::set_staging_buffer_size(ist::DStorageStream::get_request_size_info().max_request_size);
+    }
+
     try {
         Test_MMapStream();
+        Test_AsyncWriteStream();
+        Test_BufferPool();
         Test_DStorageStream();
-        Test_Benchmark();
+        Test_OverlappedIO();
+        Test_FileCache();
+        Test_LargePageBuffer();
+        Test_DStorageBatch();
+        Test_Coroutine();
+        Test_ParallelBlocks();
+        Test_StreamingMode();
+        Test_CompressedFile();
+        Test_PackFile();
+        Test_Stats();
     }
     catch (const std::exception& e) {
         printf("failed: %s\n", e.what());